@@ -7,6 +7,10 @@
 
 #include "mbed.h"
 
+#include "../bootloader/boot_info.h"
+#include "../bootloader/warm_entry.h"
+#include "../bootloader/services.h"
+
 PwmOut led0(D9);
 PwmOut led1(D10);
 
@@ -19,6 +23,23 @@ int main() {
   uart.baud(115200);
   uart.puts("\r\n\r\nBuilt " __DATE__ " " __TIME__ " (" __FILE__ ")\r\n");
 
+  const BootInfo::Info* info = BootInfo::get();
+  if (BootInfo::has_field(info, offsetof(BootInfo::Info, written_bytes) + 4)) {
+    uart.printf("Boot: flags %lx, app jump at %lu us\r\n",
+        info->flags, info->app_jump_us);
+    if (info->update_start_us != 0) {
+      uart.printf("Last update: %lu us, %lu bytes received, %lu erased, %lu written\r\n",
+          info->update_end_us - info->update_start_us,
+          info->received_bytes, info->erased_bytes, info->written_bytes);
+    }
+  }
+
+  const Services::Table* services = Services::get();
+  if (services != NULL) {
+    uart.printf("Bootloader services v%i, app region %lx-%lx\r\n",
+        services->version, services->app_start, services->app_end);
+  }
+
   int step = 0;
   bool dir = true;
 
@@ -26,6 +47,12 @@ int main() {
     if (bootInPin == 0) {
       NVIC_SystemReset();
     }
+    // A frame delimiter from the host (host.py --warm-entry) means an update
+    // is starting, so go straight into the bootloader
+    if (uart.readable() && uart.getc() == 0) {
+      WarmEntry::request(115200, WarmEntry::kDeviceAuto, 0);
+      NVIC_SystemReset();
+    }
 
     if (dir) {
       step += 1;
@@ -8,10 +8,13 @@ namespace BootProto {
   const uint8_t kAddressGlobal = 0x42 << 1;
 
   const size_t kMaxPayloadLength = 512; // TODO: size this more optimally
+  const size_t kMaxDecompressedLength = 1024; // also the DuckyLZ window size
 
   enum BootCommand {
     // kCmdStatus
     // <- RespStatus
+    // Aggregate status of queued commands: busy while any are queued or
+    // running, otherwise done, or the first error since the queue was empty.
     kCmdStatus = 0x08,
 
     // kCmdSetAddress (uint8 newAddress)
@@ -22,11 +25,14 @@ namespace BootProto {
     // Sets the boot out pin high.
     kCmdSetBootOut = 0x10,
 
-    // kCmdErase (uint32 startAddress) (uint32 length)
+    // kCmdErase (uint8 id) (uint32 startAddress) (uint32 length)
     // Erases a block.
+    // Erase, write, flush, and verify commands are queued and run in order,
+    // the id is chosen by the master and used to get the result with
+    // kCmdResult.
     kCmdErase,
 
-    // kCmdWrite (uint32 startAddress) (uint16 length) (uint16 CRC16)
+    // kCmdWrite (uint8 id) (uint32 startAddress) (uint16 length) (uint32 CRC)
     //   (length*uint8 data)
     // Writes data of length starting at the specified address.
     // CRC is of the data only.
@@ -37,9 +43,89 @@ namespace BootProto {
     // also sets up the initial PC, stack pointer, and vector table pointer.
     kCmdRunApp,
 
+    // kCmdWriteCompressed (uint8 id) (uint32 startAddress) (uint16 length)
+    //   (uint16 compressedLength) (uint32 CRC) (compressedLength*uint8 data)
+    // Writes DuckyLZ compressed data, which decompresses to length bytes,
+    // starting at the specified address. CRC is of the decompressed data.
+    kCmdWriteCompressed,
+
+    // kCmdFlush (uint8 id)
+    // Writes out any partially written write unit, padded with 0xff. Writes
+    // may be of any alignment and length, so this is needed after the last
+    // write.
+    kCmdFlush,
+
+    // kCmdVerify (uint8 id) (uint32 startAddress) (uint32 length)
+    //   (uint32 CRC)
+    // Checks the CRC of flash contents, failing with kRespInvalidChecksum on
+    // a mismatch. Does not include a partial write unit that wasn't flushed.
+    kCmdVerify,
+
+    // kCmdResult (uint8 id)
+    // <- RespStatus
+    // Result of the most recent queued command with the id, kRespBusy if it
+    // hasn't completed, or kRespInvalidArgs if the id is unknown.
+    kCmdResult,
+
+    // kCmdTrace (uint8 page)
+    // <- Trace page, at most Trace::kMaxPageBytes bytes
+    // A page of the event trace ring, oldest records first.
+    kCmdTrace,
+
+    // kCmdStats (uint8 reset)
+    // <- Profile::kStatsLength bytes of stage timing statistics
+    // Only supported by BOOTLOADER_PROFILE builds. Resets the statistics
+    // after they are read if reset is nonzero.
+    kCmdStats,
+
+    // kCmdHeader (uint8 id) (uint32 length) (uint32 CRC) (uint32 version)
+    // Writes the image header (see image.h), after the image is written.
+    // Checks the CRC of the first length bytes of the app, failing with
+    // kRespInvalidChecksum on a mismatch, and the app can only be run once
+    // this succeeds. Erasing any part of the app invalidates the header.
+    kCmdHeader,
+
+    // kCmdBootInfo
+    // <- BootInfo::kInfoLength bytes of BootInfo::Info fields, in order
+    // Boot milestone times and the last update's statistics (see boot_info.h).
+    kCmdBootInfo,
+
+    // kCmdRamWrite (uint8 id) (uint32 offset) (uint16 length) (uint32 CRC)
+    // (length bytes data)
+    // Copies data into the RAM load region at offset, for an image run with
+    // kCmdRamRun. Doesn't touch flash. Result as for kCmdWrite.
+    kCmdRamWrite,
+
+    // kCmdRamRun (uint32 offset) (uint32 length) (uint32 CRC)
+    // Checks the CRC of the first length bytes of the RAM load region, then
+    // runs the image with its vector table at offset.
+    kCmdRamRun,
+
+    // kCmdSlots
+    // <- (uint8 slot count) (uint8 boot slot, 0xff if none) (uint8 target slot)
+    // App slots (see image.h): updates are written to the target slot.
+    kCmdSlots,
+
+    // kCmdSelectSlot (uint8 id) (uint8 slot)
+    // Selects the slot to boot, which must hold a valid image, and makes the
+    // next slot the target. Rolling back is selecting the previous slot again.
+    kCmdSelectSlot,
+
+    // kCmdEraseApp (uint8 id)
+    // Erases the whole target slot, as one queued erase, leaving the
+    // bootloader and its data pages. Result as for kCmdErase.
+    kCmdEraseApp,
+
     kCmdInvalid
   };
 
+  // Host to master UART framing, selected with the 'M' command. Always starts
+  // as DuckyCOBS after reset.
+  enum Framing {
+    kFramingCOBS = 0,
+    kFramingZPE = 1,
+  };
+
   enum RespStatus {
     kRespBusy = 0x00,
     kRespInvalidFormat = 0x10,
@@ -0,0 +1,105 @@
+#ifndef BOOT_INFO_H_
+#define BOOT_INFO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Boot and update timing, kept in a RAM region reserved at the top of RAM by
+ * both the bootloader and application linker scripts (_BootInfo), so the
+ * application can read what its bootloader did. Not initialized by the C
+ * runtime; the bootloader rewrites it on every boot.
+ *
+ * Also readable over the protocol, with the 'B' command (kCmdBootInfo).
+ */
+namespace BootInfo {
+  const uint32_t kMagic = 0x49544f42;  // "BOTI"
+  // Incremented when fields are added, which are only ever appended.
+  const uint16_t kVersion = 3;
+
+  // Milestone not (yet) reached
+  const uint32_t kNotReached = 0xffffffff;
+
+  enum Flags {
+    kFlagEarlyBoot = 0x01,  // started the app directly from reset
+    kFlagMaster = 0x02,  // ran as the chain master
+    kFlagWarmEntry = 0x04,  // entered from the app (see warm_entry.h)
+  };
+
+  struct Info {
+    uint32_t magic;  // kMagic when valid
+    uint16_t version;  // kVersion of the bootloader which wrote this
+    uint16_t length;  // sizeof(Info) of that version
+    uint32_t flags;  // Flags
+
+    // Boot milestones, in microseconds. On the early boot path, timed from
+    // reset. Otherwise, on the us ticker, which starts during mbed startup
+    // shortly after reset.
+    uint32_t main_us;  // bootloader main() started
+    uint32_t scan_us;  // BOOT_IN sampled, master or slave decided
+    uint32_t enumerated_us;  // master: slaves enumerated, slave: got address
+    uint32_t first_command_us;  // first command from the host or master
+    uint32_t app_jump_us;  // about to start the app
+
+    // Last update since reset, all zero if none: times on the us ticker of
+    // the first and last flash commands (erase, write, flush, verify, header)
+    // this device handled, and the byte counts of the update. For the master,
+    // received_bytes counts all frames from the host, including for slaves.
+    // blank_bytes counts erased_bytes skipped since they were already blank
+    // (see Bootloader::set_blank_check), added in version 2. fast_rows counts
+    // rows of written_bytes fast programmed instead of by write unit (on the
+    // L432, see ISP::get_row_count), added in version 3.
+    uint32_t update_start_us;
+    uint32_t update_end_us;
+    uint32_t received_bytes;
+    uint32_t erased_bytes;
+    uint32_t written_bytes;
+    uint32_t blank_bytes;
+    uint32_t fast_rows;
+  };
+
+  // Serialized length of Info, as read with kCmdBootInfo
+  const size_t kInfoLength = 60;
+
+  // Space reserved for Info by the linker scripts, so fields can be added.
+  const uint32_t kReservedLength = 64;
+
+  // Linker symbol, declared as the Info it holds.
+  extern "C" Info _BootInfo;
+
+  inline Info* get() {
+    return &_BootInfo;
+  }
+
+  /**
+   * Returns whether the info was written by a bootloader, and has the field
+   * ending at the specified offset (like offsetof(Info, field) + 4).
+   */
+  inline bool has_field(const Info* info, uint32_t field_end) {
+    return info->magic == kMagic && info->length >= field_end;
+  }
+
+  /**
+   * Clears the info for a new boot, with all milestones not reached.
+   */
+  inline void init(Info* info, uint32_t flags) {
+    info->magic = kMagic;
+    info->version = kVersion;
+    info->length = sizeof(Info);
+    info->flags = flags;
+    info->main_us = kNotReached;
+    info->scan_us = kNotReached;
+    info->enumerated_us = kNotReached;
+    info->first_command_us = kNotReached;
+    info->app_jump_us = kNotReached;
+    info->update_start_us = 0;
+    info->update_end_us = 0;
+    info->received_bytes = 0;
+    info->erased_bytes = 0;
+    info->written_bytes = 0;
+    info->blank_bytes = 0;
+    info->fast_rows = 0;
+  }
+}
+
+#endif
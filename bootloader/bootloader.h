@@ -1,88 +1,386 @@
 #ifndef BOOTLOADER_H_
 #define BOOTLOADER_H_
 
+#include <string.h>
+
 #include "isp.h"
 #include "blproto.h"
+#include "crc.h"
+#include "profile.h"
+#include "trace.h"
+#include "image.h"
+#include "flash_word.h"
+
+// The bootloader data symbols are arrays, since it is read past their start.
+extern char _AppStart, _AppEnd, _BootloaderDataStart[], _BootloaderDataEnd[], _BootloaderVector;
+
+/**
+ * Parts of the Bootloader which don't depend on the ISP.
+ */
+class BootloaderBase {
+public:
+  // Maximum number of commands waiting to run, not including the running one.
+  static const size_t kQueueLength = 4;
+  // Number of completed command results remembered for get_result().
+  static const size_t kResultLength = 8;
+  // Command ID used by the async_*() and blocking wrappers.
+  static const uint8_t kNoId = 0xff;
+  // Largest ISP write size the write-combining buffer holds.
+  static const size_t kMaxWriteSize = 8;
+  // Bytes of CRC computed per update by verify and header commands, bounding
+  // how long an update call takes.
+  static const size_t kCrcChunkLength = 1024;
+
+  /**
+   * Runs the image with its vector table at vectors, like an app, or an image
+   * loaded into RAM: disables interrupts, sets the stack pointers, VTOR and
+   * Image::_AppVectors, and jumps to its reset handler. Doesn't return.
+   */
+  static void run_vectors(uint8_t* vectors);
 
-extern char _AppStart, _AppEnd, _BootloaderDataStart, _BootloaderDataEnd, _BootVectorBegin, _BootVectorEnd, _BootloaderVector;
+protected:
+  static BootProto::RespStatus blstatus_from_ispstatus(ISPBase::ISPStatus status);
+};
 
 /**
- * Asynchronous pooling bootloader, with remapping capaibility for high-memory
- * bootloaders.
+ * Asynchronous pooling bootloader for high-memory bootloaders.
+ *
+ * The boot vector into the bootloader lives in its own flash page before the
+ * app region, so it is never erased or rewritten by app updates. Apps are
+ * linked to start after it, and the boot vector page forwards exceptions to
+ * the app's vector table.
+ *
+ * The app region may be split into several slots, one per header page in the
+ * bootloader data segment after the first (see image.h), in which case
+ * erase, write, verify and header commands address the target slot, with
+ * offsets from its start, and run_app() runs the boot slot.
+ *
+ * ISPType is the concrete ISP class, like the target's ISP. Calls into it are
+ * qualified, so they are bound at compile time and inline into the command
+ * and write loops, instead of going through ISPBase's virtual functions.
  */
-class Bootloader {
+template <class ISPType>
+class Bootloader : public BootloaderBase {
 public:
-  Bootloader(ISPBase &isp, uint8_t* app, size_t app_length,
-      uint8_t* bootloader_data, size_t bootloader_data_length,
-      uint8_t* boot_vector, uint8_t* bootloader_vector,
-      size_t boot_vector_length) :
+  Bootloader(ISPType &isp, uint8_t* app, size_t app_length,
+      uint8_t* bootloader_data, size_t bootloader_data_length) :
       isp(isp), app(app), app_length(app_length),
       bootloader_data(bootloader_data), bootloader_data_length(bootloader_data_length),
-      boot_vector(boot_vector), bootloader_vector(bootloader_vector),
-      boot_vector_length(boot_vector_length),
+      app_slots(Image::slot_count(bootloader_data_length, isp.ISPType::get_erase_size())),
+      slot_length(Image::slot_length(app_length, isp.ISPType::get_erase_size(), app_slots)),
       current_command(BootProto::kCmdInvalid), current_stage(0),
-      last_response(BootProto::kRespDone)
-      {}
+      last_response(BootProto::kRespDone), isp_active(false), isp_pending(false),
+      queue_head(0), queue_count(0), results_next(0),
+      combine_addr(NULL), blank_check(false), blank_bytes(0)
+      {
+    for (size_t i=0; i<kResultLength; i++) {
+      results[i].id = kNoId;
+      results[i].status = BootProto::kRespInvalidArgs;
+    }
+    int selected = Image::selected_slot(bootloader_data, isp.ISPType::get_erase_size(), app_slots);
+    target_slot = selected == Image::kNoSlot ? 0 : (selected + 1) % app_slots;
+  }
+
   /**
-   * Call this periodically during an async operation.
-   * Returns kRespBusy is an operation is ongoing, otherwise returns the last
-   * status, either kRespDone if success, or an error code.
+   * Call this periodically while commands are queued. Starts the next queued
+   * command as soon as the previous one completes, so the flash controller
+   * stays busy.
+   * Returns kRespBusy if any command is queued or running, otherwise returns
+   * the aggregate status of the commands since the queue was last empty:
+   * kRespDone if all succeeded, or the first error.
    */
   BootProto::RespStatus async_update();
 
   /**
-   * Begins an asynchronous erase operation.
+   * Queues an erase, write, flush, or verify command with a caller-chosen ID,
+   * used to look up its result with get_result().
+   *
+   * Writes need not be aligned to nor a multiple of the ISP write size:
+   * partial write units are held in a write-combining buffer until completed
+   * by a later write or flushed. The data buffer must not be modified until
+   * the command completes.
    *
-   * Returns true if the operation is started (and the next async_update will
-   * return the result of this operation), or false if not (for example, if
-   * another operation is running).
+   * Flush writes out any partial write unit in the write-combining buffer,
+   * padded with 0xff (the erased value).
+   *
+   * Verify checks the CRC32 of flash contents, which does not include any
+   * partial write unit that has not been flushed.
+   *
+   * Returns true if the command was queued (or failed argument checks, in
+   * which case its result is already available), or false if the queue is
+   * full.
    */
-  bool async_erase(size_t start_offset, size_t length);
+  bool enqueue_erase(uint8_t id, size_t start_offset, size_t length);
+  bool enqueue_write(uint8_t id, size_t start_offset, void* data, size_t length);
+  bool enqueue_flush(uint8_t id);
+  bool enqueue_verify(uint8_t id, size_t start_offset, size_t length, uint32_t crc);
 
   /**
-   * Begins an asynchronous write operation.
+   * Queues writing the image header (see image.h) into the bootloader data
+   * segment, to be sent after the rest of the image. Flushes any partial
+   * write unit, then checks the CRC of the first length bytes of the app and
+   * records the result in the header, failing with kRespInvalidChecksum on a
+   * mismatch.
    *
-   * Data buffer must not be modified until the operation is complete.
-   *
-   * Returns true if the operation is started (and the next async_update will
-   * return the result of this operation), or false if not (for example, if
-   * another operation is running).
+   * Erasing any part of the app invalidates the header, so run_app() refuses
+   * to start a partially written image.
+   */
+  bool enqueue_header(uint8_t id, size_t length, uint32_t crc, uint32_t version);
+
+  /**
+   * Queues selecting the app slot to boot, by appending an entry to the
+   * current slot select page, or once it's full, moving to the other select
+   * page (see Image::SlotSelect). Fails with kRespInvalidArgs
+   * if there is only one slot, or kRespInvalidChecksum if the slot doesn't
+   * hold a valid image. The target slot then becomes the next slot, so the
+   * selected image isn't overwritten by the next update.
+   */
+  bool enqueue_select(uint8_t id, size_t slot);
+
+  /**
+   * Enables the erase blank check: erases skip pages which already read as
+   * all 0xff. Off by default, since a page can read blank without being
+   * erased, for example if 0xff was programmed into flash with ECC, which
+   * then can't be programmed again. Erases not aligned to pages are never
+   * blank checked.
+   */
+  void set_blank_check(bool enabled) {
+    blank_check = enabled;
+  }
+
+  /**
+   * Returns the number of bytes erases skipped as already blank, since
+   * construction.
    */
-  bool async_write(size_t start_offset, void* data, size_t length);
+  size_t get_blank_bytes() {
+    return blank_bytes;
+  }
+
+  /**
+   * Returns true if another command can be queued.
+   */
+  bool can_enqueue() {
+    return queue_count < kQueueLength;
+  }
+
+  /**
+   * Returns the result of the command with the specified ID: kRespBusy if it
+   * is queued or running, otherwise its status. If several commands share an
+   * ID, returns the most recent. Returns kRespInvalidArgs if the ID is not
+   * known, including if its result has been pushed out by newer results.
+   */
+  BootProto::RespStatus get_result(uint8_t id);
+
+  /**
+   * Records a result for a command which was rejected before being queued
+   * (for example, because of a bad checksum), so it is reported by
+   * get_result() and the aggregate status.
+   */
+  void set_result(uint8_t id, BootProto::RespStatus status);
 
   /**
-   * Runs the app at the specified app-relative address. Should not return under
-   * normal circumstances.
+   * Queues the respective command with no ID. Provided for callers which
+   * issue one command at a time and check the async_update() status.
+   */
+  bool async_erase(size_t start_offset, size_t length) {
+    return enqueue_erase(kNoId, start_offset, length);
+  }
+  bool async_write(size_t start_offset, void* data, size_t length) {
+    return enqueue_write(kNoId, start_offset, data, length);
+  }
+  bool async_flush() {
+    return enqueue_flush(kNoId);
+  }
+  bool async_verify(size_t start_offset, size_t length, uint32_t crc) {
+    return enqueue_verify(kNoId, start_offset, length, crc);
+  }
+  bool async_header(size_t length, uint32_t crc, uint32_t version) {
+    return enqueue_header(kNoId, length, crc, version);
+  }
+  bool async_select(size_t slot) {
+    return enqueue_select(kNoId, slot);
+  }
+
+  size_t get_slot_count() {
+    return app_slots;
+  }
+
+  size_t get_slot_length() {
+    return slot_length;
+  }
+
+  /**
+   * Returns the slot updates are written to: the slot after the selected one,
+   * or the first slot if none was selected, as with a single slot.
+   */
+  size_t get_target_slot() {
+    return target_slot;
+  }
+
+  /**
+   * Returns the slot run_app() runs (see Image::boot_slot), or Image::kNoSlot.
+   */
+  int get_boot_slot() {
+    return Image::boot_slot(bootloader_data, isp.ISPType::get_erase_size(), app_slots, slot_length);
+  }
+
+  /**
+   * Returns the image header of a slot, by default the target slot. It may be
+   * erased (magic 0xffffffff).
+   */
+  const Image::Header* get_header() {
+    return get_header(target_slot);
+  }
+  const Image::Header* get_header(size_t slot) {
+    return Image::slot_header(bootloader_data, isp.ISPType::get_erase_size(), slot);
+  }
+
+  /**
+   * Returns whether any slot has an image header which is valid, from its
+   * recorded validation result, without checking the image itself.
+   */
+  bool app_valid() {
+    return get_boot_slot() != Image::kNoSlot;
+  }
+
+  /**
+   * Runs the app in the boot slot at the specified slot-relative address,
+   * flushing any partial write unit first. Should not return under normal
+   * circumstances, returns false if no image header is valid.
    */
   bool run_app(size_t start_offset);
 
   /**
    * Blocking variants, weapper around async_*() and async_update().
+   * Returns the aggregate status, so these should be called when no other
+   * commands are queued.
    */
   BootProto::RespStatus erase(size_t start_offset, size_t length) {
     if (!async_erase(start_offset, length)) {
       return BootProto::kRespUnknownError;
     }
-    BootProto::RespStatus status = BootProto::kRespBusy;
-    while (status == BootProto::kRespBusy) {
-      status = async_update();
-    }
-    return status;
+    return wait();
   }
 
   BootProto::RespStatus write(size_t start_offset, void* data, size_t length) {
     if (!async_write(start_offset, data, length)) {
       return BootProto::kRespUnknownError;
     }
-    BootProto::RespStatus status = BootProto::kRespBusy;
-    while (status == BootProto::kRespBusy) {
-      status = async_update();
+    return wait();
+  }
+
+  BootProto::RespStatus flush() {
+    if (!async_flush()) {
+      return BootProto::kRespUnknownError;
+    }
+    return wait();
+  }
+
+  BootProto::RespStatus verify(size_t start_offset, size_t length, uint32_t crc) {
+    if (!async_verify(start_offset, length, crc)) {
+      return BootProto::kRespUnknownError;
+    }
+    return wait();
+  }
+
+  BootProto::RespStatus header(size_t length, uint32_t crc, uint32_t version) {
+    if (!async_header(length, crc, version)) {
+      return BootProto::kRespUnknownError;
+    }
+    return wait();
+  }
+
+  BootProto::RespStatus select(size_t slot) {
+    if (!async_select(slot)) {
+      return BootProto::kRespUnknownError;
+    }
+    return wait();
+  }
+
+  /**
+   * Blocks until all queued commands complete, returning the aggregate status.
+   * Between updates, waits on the ISP, which may sleep until its interrupt.
+   */
+  BootProto::RespStatus wait() {
+    while (true) {
+      BootProto::RespStatus status = async_update();
+      if (status != BootProto::kRespBusy) {
+        return status;
+      }
+      isp.ISPType::wait_for_update();
     }
-    return status;
   }
 
 private:
-  ISPBase &isp;
+  struct QueuedCommand {
+    BootProto::BootCommand command;
+    uint8_t id;
+    uint8_t* start_addr;
+    uint8_t* data;  // for kCmdHeader, the start of the slot
+    size_t length;  // for kCmdSelectSlot, the slot
+    uint32_t crc;
+    uint32_t version;  // for kCmdHeader
+  };
+
+  struct CommandResult {
+    uint8_t id;
+    BootProto::RespStatus status;
+  };
+
+  /**
+   * Checks arguments and adds a command to the queue.
+   */
+  bool enqueue(const QueuedCommand& command);
+
+  /**
+   * Advances the running command. Returns true when it has completed.
+   */
+  bool command_update();
+
+  /**
+   * Records the result of the running command and marks it done.
+   */
+  void complete(BootProto::RespStatus status);
+
+  /**
+   * Issues the next ISP write for the current write or flush operation.
+   * Returns false if there is nothing left to write.
+   */
+  bool write_step();
+
+  /**
+   * Computes the CRC of length bytes of data by the chunk, in crc_value.
+   * Returns true once the whole length is done.
+   */
+  bool crc_step(const uint8_t* data, size_t length);
+
+  /**
+   * Issues the next ISP operation for the current header command, returning
+   * false once it has completed.
+   */
+  bool header_step();
+
+  /**
+   * Issues the next ISP operation for the current select command, returning
+   * false once it has completed.
+   */
+  bool select_step();
+
+  /**
+   * Returns the start of a slot in the app region.
+   */
+  uint8_t* slot_start(size_t slot) {
+    return app + slot * slot_length;
+  }
+
+  /**
+   * Issues ISP operations, tracking them for tracing and profiling.
+   */
+  void isp_erase(uint8_t* start_addr, size_t length);
+  void isp_write(uint8_t* start_addr, uint8_t* data, size_t length);
+  void isp_issued();
+
+  ISPType &isp;
 
   uint8_t* const app;
   const size_t app_length;
@@ -90,17 +388,553 @@ private:
   uint8_t* const bootloader_data;
   const size_t bootloader_data_length;
 
-  uint8_t* const boot_vector;
-  uint8_t* const bootloader_vector;
-  const size_t boot_vector_length;
+  const size_t app_slots;
+  const size_t slot_length;
+  size_t target_slot;
 
+  // Running command, kCmdInvalid if none
   BootProto::BootCommand current_command;
-  uint8_t current_stage;
-  BootProto::RespStatus last_response;
+  uint8_t current_id;
+  uint8_t current_stage;  // 0 means no ISP operation issued yet
+  BootProto::RespStatus last_response;  // aggregate status
+  bool isp_active;  // whether isp_begin() was called
+  bool isp_pending;  // whether an issued ISP operation hasn't been seen complete
 
   uint8_t* current_start_addr;
   uint8_t* current_data;
   size_t current_length;
+  uint32_t current_crc;
+  uint32_t current_version;
+
+  // Running CRC of the current verify or header command, over crc_offset bytes
+  uint32_t crc_value;
+  size_t crc_offset;
+
+  // Ring buffer of commands waiting to run
+  QueuedCommand queue[kQueueLength];
+  size_t queue_head;
+  size_t queue_count;
+
+  // Ring buffer of completed command results
+  CommandResult results[kResultLength];
+  size_t results_next;
+
+  // Write-combining buffer for a partially written write unit
+  uint8_t combine_data[kMaxWriteSize] __attribute__((aligned(4)));
+  uint8_t* combine_addr;  // address of the buffered write unit, NULL if none
+  uint8_t combine_mask;  // bitmask of bytes written into the buffered unit
+
+  bool blank_check;
+  size_t blank_bytes;
+
+  // Source of image header and slot select writes, which must stay valid
+  // while they run
+  Image::Header header_data;
+  Image::SlotSelect select_data;
+
+#ifdef BOOTLOADER_PROFILE
+  uint32_t flash_start;  // profile counter when the ISP operation was issued
+#endif
 };
 
+template <class ISPType>
+BootProto::RespStatus Bootloader<ISPType>::async_update() {
+  while (true) {
+    if (current_command == BootProto::kCmdInvalid) {
+      if (queue_count == 0) {
+        if (isp_active) {
+          isp.ISPType::isp_end();
+          isp_active = false;
+        }
+        return last_response;
+      }
+
+      // Start the next queued command
+      QueuedCommand& next = queue[queue_head];
+      current_command = next.command;
+      current_id = next.id;
+      current_start_addr = next.start_addr;
+      current_data = next.data;
+      current_length = next.length;
+      current_crc = next.crc;
+      current_version = next.version;
+      current_stage = 0;
+      crc_value = CRC32::kCrcInit;
+      crc_offset = 0;
+      queue_head = (queue_head + 1) % kQueueLength;
+      queue_count--;
+
+      if (!isp_active) {
+        isp.ISPType::isp_begin();
+        isp_active = true;
+      }
+    }
+
+    if (!command_update()) {
+      return BootProto::kRespBusy;
+    }
+  }
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::command_update() {
+  isp.ISPType::async_update();
+  ISPBase::ISPStatus status;
+  if (!isp.ISPType::get_last_async_status(&status)) {
+    return false;
+  }
+  if (isp_pending) {
+    isp_pending = false;
+    Trace::record(Trace::kEventFlashEnd, status);
+#ifdef BOOTLOADER_PROFILE
+    Profile::record(Profile::kStageFlash, Profile::now() - flash_start);
+#endif
+  }
+  // Only check the status of ISP operations issued by this command
+  if (current_stage != 0 && status != ISPBase::kISPOk) {
+    complete(blstatus_from_ispstatus(status));
+    return true;
+  }
+
+  if (current_command == BootProto::kCmdErase) {
+    if (current_stage == 0) {
+      // A pending partial write unit would be erased anyway
+      if (combine_addr >= current_start_addr
+          && combine_addr < current_start_addr + current_length) {
+        combine_addr = NULL;
+      }
+      current_stage = 1;
+      const Image::Header* header = get_header((current_start_addr - app) / slot_length);
+      if (header->magic == Image::kMagic && header->valid != 0) {
+        // Invalidate the image header before the app changes
+        header_data.valid = 0;
+        header_data.valid_pad = 0;
+        isp_write((uint8_t*)&header->valid, (uint8_t*)&header_data.valid, 8);
+        return false;
+      }
+    }
+    // Erases the rest of the range, or with the blank check, the next run of
+    // pages which aren't blank
+    size_t page_size = isp.ISPType::get_erase_size();
+    size_t erase_length = current_length;
+    if (blank_check && (size_t)(current_start_addr - app) % page_size == 0
+        && current_length % page_size == 0) {
+      while (current_length > 0 && FlashWord::is_erased(current_start_addr, page_size)) {
+        blank_bytes += page_size;
+        current_start_addr += page_size;
+        current_length -= page_size;
+      }
+      erase_length = 0;
+      while (erase_length < current_length
+          && !FlashWord::is_erased(current_start_addr + erase_length, page_size)) {
+        erase_length += page_size;
+      }
+    }
+    if (erase_length > 0) {
+      isp_erase(current_start_addr, erase_length);
+      current_start_addr += erase_length;
+      current_length -= erase_length;
+    } else {
+      complete(BootProto::kRespDone);
+    }
+  } else if (current_command == BootProto::kCmdWrite
+      || current_command == BootProto::kCmdFlush) {
+    current_stage = 1;
+    if (!write_step()) {
+      complete(BootProto::kRespDone);
+    }
+  } else if (current_command == BootProto::kCmdVerify) {
+    if (!crc_step(current_start_addr, current_length)) {
+      return false;
+    }
+    if (crc_value == current_crc) {
+      complete(BootProto::kRespDone);
+    } else {
+      Trace::record(Trace::kEventVerifyFail, 0,
+          current_length > 0xffff ? 0xffff : current_length);
+      complete(BootProto::kRespInvalidChecksum);
+    }
+  } else if (current_command == BootProto::kCmdHeader) {
+    if (!header_step()) {
+      complete(header_data.valid == Image::kValid ?
+          BootProto::kRespDone : BootProto::kRespInvalidChecksum);
+    }
+  } else if (current_command == BootProto::kCmdSelectSlot) {
+    // Checked when run, since a queued header command may validate the image
+    if (current_stage == 0
+        && !Image::is_valid(get_header(current_length), slot_length)) {
+      complete(BootProto::kRespInvalidChecksum);
+    } else if (!select_step()) {
+      complete(BootProto::kRespDone);
+    }
+  } else {  // should never happen
+    complete(BootProto::kRespUnknownError);
+  }
+
+  return current_command == BootProto::kCmdInvalid;
+}
+
+template <class ISPType>
+void Bootloader<ISPType>::isp_erase(uint8_t* start_addr, size_t length) {
+  Trace::record(Trace::kEventFlashStart, BootProto::kCmdErase,
+      length / isp.ISPType::get_erase_size());
+  isp_issued();
+  isp.ISPType::async_erase(start_addr, length);
+}
+
+template <class ISPType>
+void Bootloader<ISPType>::isp_write(uint8_t* start_addr, uint8_t* data, size_t length) {
+  Trace::record(Trace::kEventFlashStart, BootProto::kCmdWrite, length);
+  isp_issued();
+  isp.ISPType::async_write(start_addr, data, length);
+}
+
+template <class ISPType>
+void Bootloader<ISPType>::isp_issued() {
+  isp_pending = true;
+#ifdef BOOTLOADER_PROFILE
+  flash_start = Profile::now();
+#endif
+}
+
+template <class ISPType>
+void Bootloader<ISPType>::complete(BootProto::RespStatus status) {
+  set_result(current_id, status);
+  current_command = BootProto::kCmdInvalid;
+}
+
+template <class ISPType>
+void Bootloader<ISPType>::set_result(uint8_t id, BootProto::RespStatus status) {
+  results[results_next].id = id;
+  results[results_next].status = status;
+  results_next = (results_next + 1) % kResultLength;
+
+  if (current_command == BootProto::kCmdInvalid && queue_count == 0) {
+    // Start a new aggregate status
+    last_response = BootProto::kRespDone;
+  }
+  if (last_response == BootProto::kRespDone) {
+    last_response = status;
+  }
+}
+
+template <class ISPType>
+BootProto::RespStatus Bootloader<ISPType>::get_result(uint8_t id) {
+  if (current_command != BootProto::kCmdInvalid && current_id == id) {
+    return BootProto::kRespBusy;
+  }
+  for (size_t i=0; i<queue_count; i++) {
+    if (queue[(queue_head + i) % kQueueLength].id == id) {
+      return BootProto::kRespBusy;
+    }
+  }
+  for (size_t i=1; i<=kResultLength; i++) {
+    const CommandResult& result = results[(results_next + kResultLength - i) % kResultLength];
+    if (result.id == id) {
+      return result.status;
+    }
+  }
+  return BootProto::kRespInvalidArgs;
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::write_step() {
+  size_t write_size = isp.ISPType::get_write_size();
+
+  while (current_length > 0) {
+    uint8_t* unit_addr = current_start_addr - (size_t)current_start_addr % write_size;
+
+    if (unit_addr == current_start_addr && current_length >= write_size
+        && combine_addr != unit_addr) {
+      // Whole write units can be written directly from the data buffer, up to
+      // the next pending partial write unit.
+      uint8_t* end_addr = current_start_addr + current_length - current_length % write_size;
+      if (combine_addr != NULL && current_start_addr < combine_addr
+          && end_addr > combine_addr) {
+        end_addr = combine_addr;
+      }
+      size_t length = end_addr - current_start_addr;
+
+      isp_write(current_start_addr, current_data, length);
+      current_start_addr += length;
+      current_data += length;
+      current_length -= length;
+      return true;
+    }
+
+    // Otherwise, merge the partial write unit into the combining buffer
+    if (combine_addr != NULL && combine_addr != unit_addr) {
+      // Write out the previous partial write unit first
+      isp_write(combine_addr, combine_data, write_size);
+      combine_addr = NULL;
+      return true;
+    }
+    if (combine_addr == NULL) {
+      memset(combine_data, 0xff, write_size);
+      combine_addr = unit_addr;
+      combine_mask = 0;
+    }
+
+    size_t offset = current_start_addr - unit_addr;
+    size_t length = write_size - offset;
+    if (length > current_length) {
+      length = current_length;
+    }
+    memcpy(combine_data + offset, current_data, length);
+    combine_mask |= ((1 << length) - 1) << offset;
+    current_start_addr += length;
+    current_data += length;
+    current_length -= length;
+
+    if (combine_mask == (1 << write_size) - 1) {
+      isp_write(combine_addr, combine_data, write_size);
+      combine_addr = NULL;
+      return true;
+    }
+  }
+
+  if (current_command == BootProto::kCmdFlush && combine_addr != NULL) {
+    // Pad out the partial write unit, leaving the rest erased
+    isp_write(combine_addr, combine_data, write_size);
+    combine_addr = NULL;
+    return true;
+  }
+
+  return false;
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::crc_step(const uint8_t* data, size_t length) {
+  size_t chunk_length = length - crc_offset;
+  if (chunk_length > kCrcChunkLength) {
+    chunk_length = kCrcChunkLength;
+  }
+  crc_value = CRC32::update_crc(crc_value, data + crc_offset, chunk_length);
+  crc_offset += chunk_length;
+  if (crc_offset < length) {
+    return false;
+  }
+  crc_value ^= CRC32::kCrcInit;
+  return true;
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::header_step() {
+  uint8_t* header_addr = current_start_addr;
+  if (current_stage == 0) {
+    current_stage = 1;
+    if (combine_addr != NULL) {  // the image must be complete before its CRC
+      isp_write(combine_addr, combine_data, isp.ISPType::get_write_size());
+      combine_addr = NULL;
+      return true;
+    }
+  }
+  if (current_stage == 1) {
+    current_stage = 2;
+    isp_erase(header_addr, isp.ISPType::get_erase_size());
+    return true;
+  } else if (current_stage == 2) {
+    current_stage = 3;
+    header_data.magic = Image::kMagic;
+    header_data.length = current_length;
+    header_data.crc = current_crc;
+    header_data.version = current_version;
+    isp_write(header_addr, (uint8_t*)&header_data, Image::kHeaderWriteLength);
+    return true;
+  } else if (current_stage == 3) {
+    if (!crc_step(current_data, current_length)) {
+      return true;
+    }
+    current_stage = 4;
+    bool valid = crc_value == current_crc;
+    if (!valid) {
+      Trace::record(Trace::kEventVerifyFail, 0,
+          current_length > 0xffff ? 0xffff : current_length);
+    }
+    header_data.valid = valid ? Image::kValid : 0;
+    header_data.valid_pad = valid ? 0xffffffff : 0;
+    isp_write(header_addr + Image::kHeaderWriteLength, (uint8_t*)&header_data.valid, 8);
+    return true;
+  }
+  return false;
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::select_step() {
+  size_t page_size = isp.ISPType::get_erase_size();
+  int current = Image::current_select_page(bootloader_data, page_size, app_slots);
+  // The other page, which the current one moves to once full, or if there is
+  // none, the first
+  size_t next = current == Image::kNoPage ? 0 : 1 - current;
+  uint8_t* next_page = (uint8_t*)Image::select_page(bootloader_data, page_size, app_slots, next);
+  if (current_stage == 0) {
+    if (current != Image::kNoPage) {
+      uint8_t* page = (uint8_t*)Image::select_page(bootloader_data, page_size, app_slots,
+          current);
+      size_t used = Image::select_used((const Image::SlotSelect*)page, page_size);
+      if (used < page_size / sizeof(Image::SlotSelect)) {
+        current_stage = 4;
+        select_data.slot = current_length;
+        select_data.check = current_length ^ Image::kSelectCheck;
+        isp_write(page + used * sizeof(Image::SlotSelect), (uint8_t*)&select_data,
+            sizeof(select_data));
+        return true;
+      }
+    }
+    // The other page isn't current, so it can be erased while the current
+    // page still holds the selection
+    current_stage = 1;
+    if (!FlashWord::is_erased(next_page, page_size)) {
+      isp_erase(next_page, page_size);
+      return true;
+    }
+  }
+  if (current_stage == 1) {
+    current_stage = 2;
+    select_data.slot = current_length;
+    select_data.check = current_length ^ Image::kSelectCheck;
+    isp_write(next_page + sizeof(Image::SlotSelect), (uint8_t*)&select_data,
+        sizeof(select_data));
+    return true;
+  } else if (current_stage == 2) {
+    // Writing the marker switches pages
+    current_stage = 3;
+    select_data.slot = current == Image::kNoPage ? 0
+        : Image::select_page(bootloader_data, page_size, app_slots, current)->slot + 1;
+    select_data.check = select_data.slot ^ Image::kSelectPageCheck;
+    isp_write(next_page, (uint8_t*)&select_data, sizeof(select_data));
+    return true;
+  } else if (current_stage == 3 || current_stage == 4) {
+    current_stage = 5;
+    target_slot = (current_length + 1) % app_slots;
+  }
+  return false;
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::enqueue(const QueuedCommand& command) {
+  if (queue_count >= kQueueLength) {
+    return false;
+  }
+
+  if (current_command == BootProto::kCmdInvalid && queue_count == 0) {
+    // Start a new aggregate status
+    last_response = BootProto::kRespDone;
+  }
+
+  uint8_t* slot = slot_start(target_slot);
+  if (command.command == BootProto::kCmdHeader) {
+    if (command.length > slot_length) {
+      set_result(command.id, BootProto::kRespInvalidArgs);
+      return true;
+    }
+  } else if (command.command == BootProto::kCmdSelectSlot) {
+    if (app_slots <= 1 || command.length >= app_slots) {
+      set_result(command.id, BootProto::kRespInvalidArgs);
+      return true;
+    }
+  } else if (command.command != BootProto::kCmdFlush
+      && (command.start_addr < slot
+          || command.start_addr + command.length > slot + slot_length)) {
+    set_result(command.id, BootProto::kRespInvalidArgs);
+    return true;
+  }
+
+  queue[(queue_head + queue_count) % kQueueLength] = command;
+  queue_count++;
+
+  async_update();
+  return true;
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::enqueue_erase(uint8_t id, size_t start_offset, size_t length) {
+  QueuedCommand command;
+  command.command = BootProto::kCmdErase;
+  command.id = id;
+  command.start_addr = slot_start(target_slot) + start_offset;
+  command.data = NULL;
+  command.length = length;
+  command.crc = 0;
+  command.version = 0;
+  return enqueue(command);
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::enqueue_write(uint8_t id, size_t start_offset, void* data, size_t length) {
+  QueuedCommand command;
+  command.command = BootProto::kCmdWrite;
+  command.id = id;
+  command.start_addr = slot_start(target_slot) + start_offset;
+  command.data = (uint8_t*)data;
+  command.length = length;
+  command.crc = 0;
+  command.version = 0;
+  return enqueue(command);
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::enqueue_flush(uint8_t id) {
+  QueuedCommand command;
+  command.command = BootProto::kCmdFlush;
+  command.id = id;
+  command.start_addr = NULL;
+  command.data = NULL;
+  command.length = 0;
+  command.crc = 0;
+  command.version = 0;
+  return enqueue(command);
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::enqueue_verify(uint8_t id, size_t start_offset, size_t length, uint32_t crc) {
+  QueuedCommand command;
+  command.command = BootProto::kCmdVerify;
+  command.id = id;
+  command.start_addr = slot_start(target_slot) + start_offset;
+  command.data = NULL;
+  command.length = length;
+  command.crc = crc;
+  command.version = 0;
+  return enqueue(command);
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::enqueue_header(uint8_t id, size_t length, uint32_t crc, uint32_t version) {
+  QueuedCommand command;
+  command.command = BootProto::kCmdHeader;
+  command.id = id;
+  command.start_addr = (uint8_t*)get_header();
+  command.data = slot_start(target_slot);
+  command.length = length;
+  command.crc = crc;
+  command.version = version;
+  return enqueue(command);
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::enqueue_select(uint8_t id, size_t slot) {
+  QueuedCommand command;
+  command.command = BootProto::kCmdSelectSlot;
+  command.id = id;
+  command.start_addr = NULL;
+  command.data = NULL;
+  command.length = slot;
+  command.crc = 0;
+  command.version = 0;
+  return enqueue(command);
+}
+
+template <class ISPType>
+bool Bootloader<ISPType>::run_app(size_t start_offset) {
+  flush();
+  int slot = get_boot_slot();
+  if (slot == Image::kNoSlot) {
+    return false;
+  }
+
+  run_vectors(slot_start(slot) + start_offset);
+  return true;
+}
+
 #endif
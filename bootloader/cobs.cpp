@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "cobs.h"
 
 COBSDecoder::COBSResult COBSDecoder::decode(uint8_t* chunk, size_t length, size_t *read_out) {
@@ -67,3 +69,239 @@ COBSDecoder::COBSResult COBSDecoder::decode(uint8_t* chunk, size_t length, size_
   }
   return kResultWorking;
 }
+
+void ZPEDecoder::beginGroup(uint8_t code) {
+  if (code <= 0x9f) {
+    literalsRemaining = code - 0x01;
+    terminator = kTermZero;
+  } else if (code <= 0xbf) {
+    literalsRemaining = code - 0xa0;
+    terminator = kTermZeroPair;
+  } else if (code <= 0xdf) {
+    literalsRemaining = code - 0xc0;
+    terminator = kTermRun;
+  } else if (code <= 0xfe) {
+    literalsRemaining = code - 0xdf;
+    terminator = kTermNone;
+  } else {
+    literalsRemaining = 253;
+    terminator = kTermNone;
+  }
+  if (literalsRemaining == 0) {
+    endLiterals();
+  }
+}
+
+void ZPEDecoder::endLiterals() {
+  if (terminator == kTermZero) {
+    pendingZeros = 1;
+    terminator = kTermNone;
+  } else if (terminator == kTermZeroPair) {
+    pendingZeros = 2;
+    terminator = kTermNone;
+  }
+}
+
+COBSDecoder::COBSResult ZPEDecoder::decode(uint8_t* chunk, size_t length, size_t *read_out) {
+  *read_out = 0;
+  if (currReader == NULL) {
+    return kErrorNoBuffer;
+  }
+
+  while (length > 0) {
+    uint8_t byte = *chunk;
+    (*read_out) += 1;
+
+    if (byte == 0x00) {
+      if (decoderStatus == kDecodeNormal) {
+        if (literalsRemaining == 0 && terminator == kTermNone && pendingZeros > 0) {
+          // Drop the last zero, which points to the end of frame
+          for (uint8_t i=1; i<pendingZeros; i++) {
+            if (!currReader->putByte(0)) {
+              decoderStatus = kDecodeError;
+              return kErrorOverflow;
+            }
+          }
+          decoderStatus = kDecodeBegin;
+          return kResultDone;
+        } else {
+          currReader->reset();
+
+          decoderStatus = kDecodeBegin;
+          return kErrorInvalidFormat;
+        }
+      } else {
+        decoderStatus = kDecodeBegin;
+      }
+    } else {
+      if (decoderStatus == kDecodeBegin) {
+        pendingZeros = 0;
+        beginGroup(byte);
+        decoderStatus = kDecodeNormal;
+      } else if (decoderStatus == kDecodeNormal) {
+        if (literalsRemaining > 0) {
+          if (!currReader->putByte(byte)) {
+            decoderStatus = kDecodeError;
+            return kErrorOverflow;
+          }
+          literalsRemaining -= 1;
+          if (literalsRemaining == 0) {
+            endLiterals();
+          }
+        } else if (terminator == kTermRun) {
+          for (uint8_t i=0; i<byte; i++) {
+            if (!currReader->putByte(0xff)) {
+              decoderStatus = kDecodeError;
+              return kErrorOverflow;
+            }
+          }
+          terminator = kTermNone;
+        } else {
+          for (uint8_t i=0; i<pendingZeros; i++) {
+            if (!currReader->putByte(0)) {
+              decoderStatus = kDecodeError;
+              return kErrorOverflow;
+            }
+          }
+          pendingZeros = 0;
+          beginGroup(byte);
+        }
+      } else {
+        // Drop bytes otherwise
+      }
+    }
+
+    chunk += 1;
+    length -= 1;
+  }
+  return kResultWorking;
+}
+
+#ifdef TARGET_NATIVE
+
+size_t COBSEncoder::encode(const uint8_t* data, size_t length,
+    uint8_t* out, size_t out_length) {
+  size_t outPos = 1;
+  size_t codePos = 0;
+  uint8_t code = 1;  // number of literals in the current group, plus one
+
+  if (out_length < 1) {
+    return 0;
+  }
+  for (size_t i=0; i<length; i++) {
+    if (data[i] == 0x00) {
+      out[codePos] = code;
+      codePos = outPos;
+      code = 1;
+      outPos++;
+    } else {
+      if (code == 0xfe) {  // group is full, continue without a zero
+        out[codePos] = 0xff;
+        codePos = outPos;
+        code = 1;
+        outPos++;
+      }
+      if (outPos >= out_length) {
+        return 0;
+      }
+      out[outPos] = data[i];
+      outPos++;
+      code++;
+    }
+    if (outPos > out_length) {
+      return 0;
+    }
+  }
+  out[codePos] = code;
+  return outPos;
+}
+
+// Returns the length of the run of 0xff starting at data, up to 255.
+static size_t zpe_run_length(const uint8_t* data, size_t length) {
+  size_t run = 0;
+  while (run < length && run < 255 && data[run] == 0xff) {
+    run++;
+  }
+  return run;
+}
+
+size_t ZPEEncoder::encode(const uint8_t* data, size_t length,
+    uint8_t* out, size_t out_length) {
+  const size_t kRunMin = 3;
+  size_t outPos = 0;
+  size_t pos = 0;
+
+  // Encoded as if there was an extra trailing zero, which the decoder drops.
+  while (pos <= length) {
+    size_t end = pos;
+    while (end < length && data[end] != 0x00
+        && zpe_run_length(data + end, length - end) < kRunMin) {
+      end++;
+    }
+    size_t literals = end - pos;
+
+    size_t maxLiterals, terminatorLength;
+    uint8_t base;
+    if (end == length || data[end] == 0x00) {
+      // the virtual trailing zero can also form a pair
+      if (end + 1 <= length && (end + 1 == length || data[end + 1] == 0x00)
+          && literals <= 0xbf - 0xa0) {
+        maxLiterals = 0xbf - 0xa0;
+        base = 0xa0;
+        terminatorLength = 2;
+      } else {
+        maxLiterals = 0x9f - 0x01;
+        base = 0x01;
+        terminatorLength = 1;
+      }
+    } else {
+      maxLiterals = 0xdf - 0xc0;
+      base = 0xc0;
+      terminatorLength = zpe_run_length(data + end, length - end);
+    }
+
+    // Split off literals which don't fit in the terminated group
+    while (literals > maxLiterals) {
+      size_t chunkLength;
+      if (literals >= 253) {
+        chunkLength = 253;
+        if (outPos >= out_length) {
+          return 0;
+        }
+        out[outPos++] = 0xff;
+      } else {
+        chunkLength = literals - maxLiterals;
+        if (chunkLength > 0xfe - 0xdf) {
+          chunkLength = 0xfe - 0xdf;
+        }
+        if (outPos >= out_length) {
+          return 0;
+        }
+        out[outPos++] = 0xdf + chunkLength;
+      }
+      if (outPos + chunkLength > out_length) {
+        return 0;
+      }
+      memcpy(out + outPos, data + pos, chunkLength);
+      outPos += chunkLength;
+      pos += chunkLength;
+      literals -= chunkLength;
+    }
+
+    if (outPos + 1 + literals + (base == 0xc0 ? 1 : 0) > out_length) {
+      return 0;
+    }
+    out[outPos++] = base + literals;
+    memcpy(out + outPos, data + pos, literals);
+    outPos += literals;
+    if (base == 0xc0) {
+      out[outPos++] = terminatorLength;
+    }
+
+    pos = end + terminatorLength;
+  }
+
+  return outPos;
+}
+
+#endif
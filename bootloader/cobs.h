@@ -36,7 +36,7 @@ public:
    * Attempting to call this with an unassigned COBSPacketReader will do nothing
    * and read no data.
    */
-  COBSResult decode(uint8_t* chunk, size_t length, size_t *read_out);
+  virtual COBSResult decode(uint8_t* chunk, size_t length, size_t *read_out);
 
 protected:
   BufferedPacketReaderInterface* currReader;  // current buffer, can be NULL if none assigned
@@ -53,4 +53,59 @@ protected:
                                  // modified zero
 };
 
+/**
+ * Decoder for DuckyZPE, the zero-pair and 0xff-run eliminating variant of
+ * DuckyCOBS. See host/duckyzpe.py for the format description.
+ */
+class ZPEDecoder : public COBSDecoder {
+public:
+  ZPEDecoder() :
+    literalsRemaining(0), terminator(kTermNone), pendingZeros(0) {
+  }
+
+  COBSResult decode(uint8_t* chunk, size_t length, size_t *read_out);
+
+protected:
+  enum Terminator {
+    kTermNone,  // nothing after the literals
+    kTermZero,  // a single zero after the literals
+    kTermZeroPair,  // two zeros after the literals
+    kTermRun,  // a run length byte after the literals, then that many 0xff
+  };
+
+  // Begins a new group from its code byte.
+  void beginGroup(uint8_t code);
+  // Called when all literals of the current group have been read.
+  void endLiterals();
+
+  size_t literalsRemaining;  // number of literal bytes left in the group
+  Terminator terminator;  // what follows the literals in the current group,
+                          // reset to kTermNone once handled
+  uint8_t pendingZeros;  // zeros to insert before the next group, the last
+                         // one is dropped at the end of frame
+};
+
+#ifdef TARGET_NATIVE
+/**
+ * DuckyCOBS and DuckyZPE encoders. Encodes length bytes of data into out,
+ * not including the start-of-frame or end-of-frame bytes.
+ *
+ * Returns the encoded length, or zero if it would overflow out_length.
+ *
+ * Only built natively, for tests and benchmarks, since the device never
+ * encodes.
+ */
+class COBSEncoder {
+public:
+  static size_t encode(const uint8_t* data, size_t length,
+      uint8_t* out, size_t out_length);
+};
+
+class ZPEEncoder {
+public:
+  static size_t encode(const uint8_t* data, size_t length,
+      uint8_t* out, size_t out_length);
+};
+#endif
+
 #endif
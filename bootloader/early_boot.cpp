@@ -0,0 +1,169 @@
+/*
+ * early_boot.cpp
+ *
+ * Fast path from reset straight into the application, run by EarlyBoot_Handler
+ * (in boot_vector.S) before the C runtime, static constructors and mbed are
+ * initialized. This skips the bootloader's startup delays when a device isn't
+ * being updated, so this must not use initialized data or the mbed API, only
+ * registers and constants.
+ *
+ * This is opt in, with scons EARLY_BOOT=1 (BOOTLOADER_EARLY_BOOT), since a
+ * master which boots directly never runs main(), so never starts the rest of
+ * the chain with kCmdRunApp. See early_boot_app() for the wiring it needs.
+ * Without it, early_boot_app() always returns NULL and every device starts the
+ * bootloader as before.
+ */
+
+#if defined(TARGET_NUCLEO_F303K8) || defined(TARGET_NUCLEO_L432KC)
+
+#include <stddef.h>
+
+#include "cmsis.h"
+
+#include "image.h"
+#include "boot_info.h"
+#include "warm_entry.h"
+
+#if defined(BOOTLOADER_EARLY_BOOT)
+
+extern char _AppStart, _AppEnd, _BootloaderDataStart[], _BootloaderDataEnd[], _estack;
+
+namespace {
+  // BOOT_IN (D3, PB_0) and run app (D2, PA_12) pins
+  const uint32_t kBootInPin = 0;  // on GPIOB
+  const uint32_t kRunAppPin = 12;  // on GPIOA
+
+  // Busy loop iterations to let the pull-ups settle and the previous device
+  // drive its BOOT_OUT, if it stays in its bootloader, about 2 ms on the reset
+  // clock (8 MHz HSI on the F303, 4 MHz MSI on the L432).
+  const uint32_t kSettleLoops = 1000;
+
+  // Flash page size of both parts, for the bootloader data layout
+  const size_t kPageSize = 2048;
+
+  // Reset clock frequency in MHz, for converting cycles to BootInfo times
+#if defined(TARGET_NUCLEO_F303K8)
+  const uint32_t kResetClockMhz = 8;
+#else
+  const uint32_t kResetClockMhz = 4;
+#endif
+
+  /**
+   * Returns the vector table of the application in the boot slot (see
+   * image.h), the slot whose image header records a successful CRC check.
+   * As a sanity check, the vector table must have an initial stack pointer in
+   * RAM and a Thumb reset handler inside the slot. Otherwise returns NULL.
+   */
+  uint32_t* app_vectors() {
+    const uint8_t* data = (const uint8_t*)_BootloaderDataStart;
+    size_t slots = Image::slot_count(_BootloaderDataEnd - _BootloaderDataStart, kPageSize);
+    size_t slot_length = Image::slot_length(&_AppEnd - &_AppStart, kPageSize, slots);
+    int slot = Image::boot_slot(data, kPageSize, slots, slot_length);
+    if (slot == Image::kNoSlot) {
+      return NULL;
+    }
+    uint32_t* vectors = (uint32_t*)(&_AppStart + slot * slot_length);
+    uint32_t stack = vectors[0];
+    uint32_t reset = vectors[1];
+    if (stack <= SRAM_BASE || stack > (uint32_t)&_estack) {
+      return NULL;
+    }
+    if ((reset & 1) == 0
+        || reset < (uint32_t)vectors || reset >= (uint32_t)vectors + slot_length) {
+      return NULL;
+    }
+    return vectors;
+  }
+
+  void set_mode(GPIO_TypeDef* gpio, uint32_t pin, uint32_t mode, uint32_t pull) {
+    gpio->MODER = (gpio->MODER & ~(3UL << (pin * 2))) | (mode << (pin * 2));
+    gpio->PUPDR = (gpio->PUPDR & ~(3UL << (pin * 2))) | (pull << (pin * 2));
+  }
+}
+
+/**
+ * Returns the application's vector table if it should be run directly: this
+ * device isn't held in the bootloader by the previous device (BOOT_IN is high),
+ * the run app pin is pulled low, the application didn't request a warm entry
+ * (see warm_entry.h), and the application looks valid. Otherwise, returns NULL
+ * and the bootloader starts normally. The vector table is also recorded in
+ * Image::_AppVectors, for the boot vector page to forward exceptions to.
+ *
+ * BOOT_OUT isn't touched here, so it stays released until the decision is
+ * made: a next device which resets at the same time sees its BOOT_IN pulled
+ * high, and makes the same decision from its own pins, instead of being held
+ * in its bootloader by a master which then boots directly. Only when this
+ * device stays in the bootloader does main() drive BOOT_OUT low, as before.
+ *
+ * Limitation: a master which boots directly doesn't enumerate the chain or
+ * send kCmdRunApp, so it doesn't start the other devices. Each of them only
+ * runs its app if its own run app pin is also pulled low. Otherwise it sees
+ * BOOT_IN high, comes up in main() as another master, and stays in its
+ * bootloader. With early boot enabled, every device of a chain which should
+ * start from power on needs its run app pin pulled low.
+ *
+ * Registers are restored before returning the app, so it starts from the reset
+ * state. Otherwise, they are left for mbed to reconfigure.
+ */
+extern "C" uint32_t* early_boot_app() {
+#if defined(TARGET_NUCLEO_F303K8)
+  volatile uint32_t* clock_enable = &RCC->AHBENR;
+  const uint32_t kGpioClocks = RCC_AHBENR_GPIOAEN | RCC_AHBENR_GPIOBEN;
+#else
+  volatile uint32_t* clock_enable = &RCC->AHB2ENR;
+  const uint32_t kGpioClocks = RCC_AHB2ENR_GPIOAEN | RCC_AHB2ENR_GPIOBEN;
+#endif
+  // The cycle counter times this path for BootInfo
+  uint32_t saved_demcr = CoreDebug->DEMCR;
+  uint32_t saved_dwt_ctrl = DWT->CTRL;
+  CoreDebug->DEMCR = saved_demcr | CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL = saved_dwt_ctrl | DWT_CTRL_CYCCNTENA_Msk;
+
+  uint32_t saved_clock_enable = *clock_enable;
+  *clock_enable = saved_clock_enable | kGpioClocks;
+  (void)*clock_enable;  // the peripheral clock takes effect after a read back
+
+  uint32_t saved_moder_a = GPIOA->MODER, saved_pupdr_a = GPIOA->PUPDR;
+  uint32_t saved_moder_b = GPIOB->MODER, saved_pupdr_b = GPIOB->PUPDR;
+
+  set_mode(GPIOB, kBootInPin, 0, 1);  // input, pull-up
+  set_mode(GPIOA, kRunAppPin, 0, 1);  // input, pull-up
+
+  for (volatile uint32_t i=0; i<kSettleLoops; i++) {
+  }
+
+  bool boot_in = GPIOB->IDR & (1UL << kBootInPin);
+  bool run_app = !(GPIOA->IDR & (1UL << kRunAppPin));
+  uint32_t* vectors = NULL;
+  if (boot_in && run_app && !WarmEntry::is_requested()) {
+    vectors = app_vectors();
+  }
+  if (vectors == NULL) {
+    return NULL;
+  }
+
+  BootInfo::Info* info = BootInfo::get();
+  BootInfo::init(info, BootInfo::kFlagEarlyBoot);
+  info->app_jump_us = DWT->CYCCNT / kResetClockMhz;
+
+  GPIOB->MODER = saved_moder_b;
+  GPIOB->PUPDR = saved_pupdr_b;
+  GPIOA->MODER = saved_moder_a;
+  GPIOA->PUPDR = saved_pupdr_a;
+  *clock_enable = saved_clock_enable;
+  DWT->CTRL = saved_dwt_ctrl;
+  CoreDebug->DEMCR = saved_demcr;
+  Image::_AppVectors = vectors;
+  return vectors;
+}
+
+#else
+
+extern "C" uint32_t* early_boot_app() {
+  return NULL;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef FLASH_WORD_H_
+#define FLASH_WORD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Loads of write units from ISP data buffers, for the program loops of the
+ * target ISPs. Loads go through memcpy into a local, which doesn't break
+ * strict aliasing and compiles to a single load on Cortex-M4, which allows
+ * unaligned word loads. Little-endian, like both targets.
+ */
+namespace FlashWord {
+  inline uint16_t load16(const uint8_t* data) {
+    uint16_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+  }
+
+  inline uint32_t load32(const uint8_t* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+  }
+
+  /**
+   * Returns whether all length bytes of data are 0xff, the erased state, so
+   * programming them would leave the flash unchanged. Scans by word, fast
+   * enough to blank check whole flash pages.
+   */
+  inline bool is_erased(const uint8_t* data, size_t length) {
+    size_t i = 0;
+    for (; i+4<=length; i+=4) {
+      if (load32(data + i) != 0xffffffff) {
+        return false;
+      }
+    }
+    for (; i<length; i++) {
+      if (data[i] != 0xff) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Returns the number of unit_size write units in length bytes of data which
+   * aren't erased, so would be programmed.
+   */
+  inline size_t count_programmed(const uint8_t* data, size_t length, size_t unit_size) {
+    size_t count = 0;
+    for (size_t unit=0; unit<length; unit+=unit_size) {
+      if (!is_erased(data + unit, unit_size)) {
+        count++;
+      }
+    }
+    return count;
+  }
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * App image header, kept at the start of the bootloader data segment. The host
+ * writes it after the image, and the bootloader then checks the image CRC
+ * once and records the result in the header, so boots only check the header.
+ *
+ * Targets with room for it (the L432) split the app region into several
+ * equally sized slots, each with its own image header page at the start of the
+ * bootloader data segment, followed by two pages of slot select entries.
+ * Updates are written to a slot other than the selected one, then selected,
+ * so the running image stays intact until the switch.
+ */
+namespace Image {
+  struct Header {
+    uint32_t magic;  // kMagic once written
+    uint32_t length;  // image length in bytes, from the start of the app
+    uint32_t crc;  // CRC32 of the image
+    uint32_t version;  // app defined, not interpreted by the bootloader
+    // Validation result, in its own (8-byte) write unit so it can be written
+    // after the header: erased (0xffffffff) until checked, kValid if the image
+    // matched the CRC, otherwise 0. Invalidated by writing 0, which the flash
+    // controllers allow over programmed data, so erasing the app doesn't
+    // need to erase the header page.
+    uint32_t valid;
+    uint32_t valid_pad;
+  };
+
+  const uint32_t kMagic = 0x4448424b;  // "KBHD"
+  const uint32_t kValid = 0x56414c44;  // "DLAV"
+
+  // Length of the header fields written before validation.
+  const size_t kHeaderWriteLength = 16;
+
+  /**
+   * Returns whether the header describes an image which was validated and
+   * not since invalidated, fitting in an app region of app_length bytes.
+   */
+  inline bool is_valid(const Header* header, size_t app_length) {
+    return header->magic == kMagic && header->valid == kValid
+        && header->length <= app_length;
+  }
+
+  /**
+   * Slot select entry, one write unit. Selecting a slot appends an entry to
+   * the current select page, and the last complete entry wins, so switching
+   * slots (or rolling back) is a single flash write.
+   *
+   * The first entry of each select page is instead a page marker, with a
+   * sequence number in slot, and the valid marker with the highest sequence
+   * makes its page current. Once the current page is full, the next entry is
+   * written to the other (erased) page, followed by its marker with the next
+   * sequence, so that switch is also a single write. A select page is only
+   * erased while it isn't current, so a reset at any point boots either the
+   * old or the new selection.
+   */
+  struct SlotSelect {
+    uint32_t slot;
+    uint32_t check;  // slot ^ kSelectCheck, so erased or torn entries don't match
+  };
+
+  const uint32_t kSelectCheck = 0x544f4c53;  // "SLOT"
+  const uint32_t kSelectPageCheck = 0x47415053;  // "SPAG", for page markers
+  const int kNoSlot = -1;
+  const int kNoPage = -1;
+
+  /**
+   * Returns the number of app slots for a bootloader data segment of
+   * data_length bytes: a header page per slot, then the two select pages if
+   * there are several.
+   */
+  inline size_t slot_count(size_t data_length, size_t page_size) {
+    size_t pages = data_length / page_size;
+    return pages > 3 ? pages - 2 : 1;
+  }
+
+  /**
+   * Returns the length of each slot of an app region of app_length bytes,
+   * rounded down to whole pages so slots can be erased separately.
+   */
+  inline size_t slot_length(size_t app_length, size_t page_size, size_t slots) {
+    return app_length / slots / page_size * page_size;
+  }
+
+  inline const Header* slot_header(const uint8_t* data, size_t page_size, size_t slot) {
+    return (const Header*)(data + slot * page_size);
+  }
+
+  inline const SlotSelect* select_page(const uint8_t* data, size_t page_size, size_t slots,
+      size_t page) {
+    return (const SlotSelect*)(data + (slots + page) * page_size);
+  }
+
+  /**
+   * Returns the number of entries written to a select page, which holds
+   * page_size / sizeof(SlotSelect) entries.
+   */
+  inline size_t select_used(const SlotSelect* page, size_t page_size) {
+    size_t used = 0;
+    while (used < page_size / sizeof(SlotSelect)
+        && (page[used].slot != 0xffffffff || page[used].check != 0xffffffff)) {
+      used++;
+    }
+    return used;
+  }
+
+  /**
+   * Returns the current select page (0 or 1), or kNoPage if neither has a
+   * valid page marker or there is only one slot.
+   */
+  inline int current_select_page(const uint8_t* data, size_t page_size, size_t slots) {
+    if (slots <= 1) {
+      return kNoPage;
+    }
+    int current = kNoPage;
+    for (size_t i=0; i<2; i++) {
+      const SlotSelect* marker = select_page(data, page_size, slots, i);
+      if (marker->check == (marker->slot ^ kSelectPageCheck)
+          && (current == kNoPage
+              || marker->slot > select_page(data, page_size, slots, current)->slot)) {
+        current = i;
+      }
+    }
+    return current;
+  }
+
+  /**
+   * Returns the last selected slot, or kNoSlot if none was ever selected or
+   * there is only one slot.
+   */
+  inline int selected_slot(const uint8_t* data, size_t page_size, size_t slots) {
+    int current = current_select_page(data, page_size, slots);
+    if (current == kNoPage) {
+      return kNoSlot;
+    }
+    const SlotSelect* page = select_page(data, page_size, slots, current);
+    for (size_t i=select_used(page, page_size); i>1; i--) {
+      if (page[i-1].check == (page[i-1].slot ^ kSelectCheck) && page[i-1].slot < slots) {
+        return page[i-1].slot;
+      }
+    }
+    return kNoSlot;
+  }
+
+  /**
+   * Returns the slot to boot: the selected slot if its image is valid,
+   * otherwise the first slot with a valid image, or kNoSlot if there is none.
+   */
+  inline int boot_slot(const uint8_t* data, size_t page_size, size_t slots,
+      size_t slot_length) {
+    int selected = selected_slot(data, page_size, slots);
+    if (selected != kNoSlot
+        && is_valid(slot_header(data, page_size, selected), slot_length)) {
+      return selected;
+    }
+    for (size_t slot=0; slot<slots; slot++) {
+      if (is_valid(slot_header(data, page_size, slot), slot_length)) {
+        return slot;
+      }
+    }
+    return kNoSlot;
+  }
+
+  // RAM word holding the vector table of the running app, which the boot
+  // vector page forwards exceptions to. Reserved after _WarmEntry by the
+  // linker scripts, and set by whatever starts the app.
+  extern "C" uint32_t* _AppVectors;
+}
+
+#endif
@@ -73,7 +73,8 @@ public:
   /**
    * Writes the data to the specified start address.
    *
-   * length must be a multiple of get_write_size().
+   * length must be a multiple of get_write_size(). Write units whose data is
+   * all 0xff may be skipped, since programming them leaves erased flash as is.
    *
    * Returns zero when successful, otherwise an error code.
    */
@@ -93,6 +94,14 @@ public:
    */
   virtual bool async_update() = 0;
 
+  /**
+   * Waits, like by sleeping, for the running async operation to progress, in
+   * blocking waits between async_update() calls. ISPs which advance operations
+   * from interrupts shadow this, for callers which know the concrete ISP.
+   */
+  void wait_for_update() {
+  }
+
   /**
    * Returns true if the last async operation has finished, false if it is still
    * ongoing.
@@ -114,5 +123,6 @@ public:
 
 #include "isp_stm32f303k8.h"
 #include "isp_stm32l432kc.h"
+#include "isp_simulated.h"
 
 #endif
@@ -0,0 +1,21 @@
+/*
+ * isp_irq.cpp
+ *
+ * Flash interrupt for the interrupt driven ISP (see ISP::set_interrupt_driven),
+ * overriding the weak handler in the bootloader's vector table. Only enabled
+ * while that ISP is active, since the application owns the vectors otherwise.
+ */
+
+#if defined(TARGET_NUCLEO_F303K8) || defined(TARGET_NUCLEO_L432KC)
+
+#include "mbed.h"
+
+#include "isp.h"
+
+ISP* volatile ISP::irq_isp = NULL;
+
+extern "C" void FLASH_IRQHandler() {
+  ISP::irq_handler();
+}
+
+#endif
@@ -0,0 +1,401 @@
+#ifndef ISP_SIMULATED_H_
+#define ISP_SIMULATED_H_
+
+#ifdef TARGET_NATIVE
+
+#include <string.h>
+#include <time.h>
+
+#include "flash_word.h"
+
+/**
+ * Time source for SimulatedISP, in microseconds.
+ */
+class SimulatedClock {
+public:
+  virtual uint64_t now_us() = 0;
+
+  /**
+   * Waits until the clock reaches us, like a sleeping CPU.
+   */
+  virtual void sleep_until_us(uint64_t us) = 0;
+};
+
+/**
+ * Wall clock time, so flash operations take real time to complete.
+ */
+class RealClock : public SimulatedClock {
+public:
+  uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  void sleep_until_us(uint64_t us) {
+    uint64_t now = now_us();
+    if (us > now) {
+      struct timespec ts;
+      ts.tv_sec = (us - now) / 1000000;
+      ts.tv_nsec = (us - now) % 1000000 * 1000;
+      nanosleep(&ts, NULL);
+    }
+  }
+};
+
+/**
+ * Manually advanced time, for deterministic tests and for measuring flash
+ * time without waiting for it.
+ */
+class VirtualClock : public SimulatedClock {
+public:
+  VirtualClock() : time_us(0) {
+  }
+
+  uint64_t now_us() {
+    return time_us;
+  }
+
+  void advance_us(uint64_t us) {
+    time_us += us;
+  }
+
+  void advance_to_us(uint64_t us) {
+    if (us > time_us) {
+      time_us = us;
+    }
+  }
+
+  void sleep_until_us(uint64_t us) {
+    advance_to_us(us);
+  }
+
+protected:
+  uint64_t time_us;
+};
+
+/**
+ * ISP backed by a RAM array, for running the bootloader on a host.
+ *
+ * Like NOR flash, erase sets bytes to 0xff and writes can only clear bits
+ * (the written data is ANDed in). Operations complete once the clock passes
+ * their modeled duration, the per-page erase time times the number of pages
+ * or the per-unit program time times the number of write units programmed,
+ * plus the row time for each fast programmed row.
+ *
+ * Like the target ISPs, operations can be interrupt driven, where the flash
+ * interrupt is modeled by irq_handler(), which wait_for_update() runs after
+ * sleeping until the operation (or, for erases, the next page) completes. async_update() still completes
+ * operations once the flash is idle, as the target ISPs' fallback for errors
+ * which raise no interrupt.
+ */
+class SimulatedISP : public ISPBase {
+public:
+  struct Config {
+    size_t erase_size;
+    size_t write_size;
+    uint32_t erase_page_us;  // time to erase one page
+    uint32_t program_unit_us;  // time to program one write unit
+    bool overwrite_is_error;  // fail writes to units which aren't erased,
+                              // except writing all zeros, as the STM32 flash
+                              // controllers do
+    bool skip_erased_data;  // don't program units whose data is all 0xff, as
+                            // the target ISPs don't
+    size_t row_size;  // fast programming row, 0 if not supported
+    uint32_t program_row_us;  // time to fast program one row
+  };
+
+  // Typical datasheet timings.
+  // F303: 2K pages, 20ms page erase, 16-bit program 50us.
+  static Config config_f303k8() {
+    Config config = {2048, 2, 20000, 50, true, true, 0, 0};
+    return config;
+  }
+  // L432: 2K pages, 22ms page erase, 64-bit program 82us, 256-byte row fast
+  // program 1.91ms.
+  static Config config_l432kc() {
+    Config config = {2048, 8, 22000, 82, true, true, 256, 1910};
+    return config;
+  }
+
+  SimulatedISP(uint8_t* flash, size_t flash_length, const Config& config,
+      SimulatedClock& clock) :
+      flash(flash), flash_length(flash_length), config(config), clock(clock),
+      interrupt_driven(false), async_op(OP_NONE), async_status(kISPOk),
+      erase_count(0), write_count(0), row_count(0), busy_us(0) {
+    memset(flash, 0xff, flash_length);
+  }
+
+  /**
+   * Replaces the flash geometry and timing, only while no operation is running.
+   */
+  void set_config(const Config& new_config) {
+    config = new_config;
+  }
+
+  void set_interrupt_driven(bool enable) {
+    interrupt_driven = enable;
+  }
+
+  bool isp_begin() {
+    return true;
+  }
+
+  bool isp_end() {
+    return true;
+  }
+
+  uint32_t get_device_id() {
+    return 0;
+  }
+
+  uint32_t get_device_serial() {
+    return 0;
+  }
+
+  size_t get_flash_addr_start() {
+    return (size_t)flash;
+  }
+
+  size_t get_flash_addr_end() {
+    return (size_t)flash + flash_length - 1;
+  }
+
+  size_t get_erase_size() {
+    return config.erase_size;
+  }
+
+  size_t get_write_size() {
+    return config.write_size;
+  }
+
+  bool async_update() {
+    if (async_op == OP_NONE) {
+      return false;
+    }
+    if (clock.now_us() < async_done_us) {
+      return true;
+    }
+
+    if (async_op == OP_ERASE) {
+      memset(async_addr, 0xff, async_length);
+    } else if (async_op == OP_WRITE) {
+      size_t offset = 0;
+      while (offset < async_length && async_status == kISPOk) {
+        if (is_row(async_addr + offset, async_data + offset, async_length - offset)) {
+          for (size_t unit=offset; unit<offset+config.row_size && async_status == kISPOk;
+              unit+=config.write_size) {
+            program_unit(unit);
+          }
+          offset += config.row_size;
+        } else {
+          if (!is_skipped(async_data + offset)) {
+            program_unit(offset);
+          }
+          offset += config.write_size;
+        }
+      }
+    }
+    async_op = OP_NONE;
+    return false;
+  }
+
+  /**
+   * Models the flash interrupt in interrupt driven mode, completing the
+   * operation if the flash is done with it.
+   */
+  void irq_handler() {
+    if (interrupt_driven) {
+      async_update();
+    }
+  }
+
+  /**
+   * Models sleeping until the flash interrupt in interrupt driven mode,
+   * advancing the clock to the end of the operation and running irq_handler().
+   * Erases wake after each page, as the target ISPs take an interrupt per page.
+   */
+  void wait_for_update() {
+    if (interrupt_driven && async_op != OP_NONE) {
+      uint64_t wake_us = async_done_us;
+      if (async_op == OP_ERASE && clock.now_us() + config.erase_page_us < wake_us) {
+        wake_us = clock.now_us() + config.erase_page_us;
+      }
+      clock.sleep_until_us(wake_us);
+      irq_handler();
+    }
+  }
+
+  bool get_last_async_status(ISPStatus* statusOut) {
+    *statusOut = async_status;
+    return async_op == OP_NONE;
+  }
+
+  bool async_erase(void* start_addr, size_t length) {
+    if (async_op != OP_NONE) {
+      return false;
+    }
+    async_status = kISPOk;
+
+    if (!is_valid_range(start_addr, length, config.erase_size)) {
+      async_status = kISPInvalidArgs;
+      return true;
+    }
+
+    erase_count += length / config.erase_size;
+    begin(OP_ERASE, start_addr, NULL, length,
+        (uint64_t)(length / config.erase_size) * config.erase_page_us);
+    return true;
+  }
+
+  bool async_write(void* start_addr, void* data, size_t length) {
+    if (async_op != OP_NONE) {
+      return false;
+    }
+    async_status = kISPOk;
+
+    if (!is_valid_range(start_addr, length, config.write_size)) {
+      async_status = kISPInvalidArgs;
+      return true;
+    }
+
+    uint64_t duration_us = 0;
+    size_t offset = 0;
+    while (offset < length) {
+      uint8_t* addr = (uint8_t*)start_addr + offset;
+      uint8_t* unit_data = (uint8_t*)data + offset;
+      if (is_row(addr, unit_data, length - offset)) {
+        row_count++;
+        duration_us += config.program_row_us;
+        offset += config.row_size;
+      } else {
+        if (!is_skipped(unit_data)) {
+          write_count++;
+          duration_us += config.program_unit_us;
+        }
+        offset += config.write_size;
+      }
+    }
+    begin(OP_WRITE, start_addr, data, length, duration_us);
+    return true;
+  }
+
+  /**
+   * Returns the clock time at which the current operation completes, or the
+   * current time if none is running. With a VirtualClock, advance to this to
+   * skip waiting on the flash.
+   */
+  uint64_t get_busy_until_us() {
+    if (async_op == OP_NONE) {
+      return clock.now_us();
+    }
+    return async_done_us;
+  }
+
+  // Statistics since construction
+  size_t get_erase_count() {  // pages erased
+    return erase_count;
+  }
+  size_t get_write_count() {  // write units programmed, not counting skipped
+    return write_count;        // ones or ones in fast programmed rows
+  }
+  size_t get_row_count() {  // rows fast programmed
+    return row_count;
+  }
+  uint64_t get_busy_us() {  // total modeled flash operation time
+    return busy_us;
+  }
+
+protected:
+  bool is_valid_range(void* start_addr, size_t length, size_t align) {
+    uint8_t* addr = (uint8_t*)start_addr;
+    size_t offset = addr - flash;
+    return addr >= flash && offset <= flash_length && length <= flash_length - offset
+        && offset % align == 0 && length % align == 0;
+  }
+
+  static bool is_erased(const uint8_t* addr, size_t length) {
+    return FlashWord::is_erased(addr, length);
+  }
+
+  // Whether a write unit of data isn't programmed
+  bool is_skipped(const uint8_t* data) {
+    return config.skip_erased_data && FlashWord::is_erased(data, config.write_size);
+  }
+
+  // Whether a write of length bytes of data at addr starts with a fast
+  // programmed row, as the L432 ISP does for aligned rows where that's faster
+  // than programming their units individually.
+  bool is_row(const uint8_t* addr, const uint8_t* data, size_t length) {
+    return config.row_size != 0 && (size_t)(addr - flash) % config.row_size == 0
+        && length >= config.row_size
+        && (uint64_t)FlashWord::count_programmed(data, config.row_size, config.write_size)
+            * config.program_unit_us >= config.program_row_us;
+  }
+
+  // Programs the write unit at offset into the current write, failing the
+  // write if it isn't erased, when that's an error.
+  void program_unit(size_t offset) {
+    if (config.overwrite_is_error && !is_erased(async_addr + offset, config.write_size)
+        && !is_zero(async_data + offset, config.write_size)) {
+      async_status = kISPFlashError;
+      return;
+    }
+    for (size_t i=offset; i<offset+config.write_size; i++) {
+      async_addr[i] &= async_data[i];
+    }
+  }
+
+  static bool is_zero(const uint8_t* addr, size_t length) {
+    for (size_t i=0; i<length; i++) {
+      if (addr[i] != 0x00) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  enum AsyncOp {OP_NONE, OP_ERASE, OP_WRITE};
+
+  void begin(AsyncOp op, void* start_addr, void* data, size_t length,
+      uint64_t duration_us) {
+    async_op = op;
+    async_addr = (uint8_t*)start_addr;
+    async_data = (uint8_t*)data;
+    async_length = length;
+    async_done_us = clock.now_us() + duration_us;
+    busy_us += duration_us;
+  }
+
+  uint8_t* const flash;
+  const size_t flash_length;
+  Config config;
+  SimulatedClock& clock;
+
+  bool interrupt_driven;
+  AsyncOp async_op;
+  uint8_t* async_addr;
+  uint8_t* async_data;
+  size_t async_length;
+  uint64_t async_done_us;
+  ISPStatus async_status;
+
+  size_t erase_count;
+  size_t write_count;
+  size_t row_count;
+  uint64_t busy_us;
+};
+
+#ifdef TARGET_NATIVE_SIM
+/**
+ * The chain simulator's flash, the app and bootloader data regions of the
+ * linked image, defined in native/simulator.cpp.
+ */
+class ISP : public SimulatedISP {
+public:
+  ISP();
+};
+#endif
+
+#endif
+#endif
@@ -3,7 +3,17 @@
 
 #ifdef TARGET_NUCLEO_F303K8
 
-extern "C" void FLASH_PageErase(uint32_t PageAddress);
+#include "flash_word.h"
+
+// stm32f3xx_hal_flash_ex.c FLASH_PageErase, without clearing the HAL's error
+// state, so this keeps no state in RAM and also works from the application
+// services (services.cpp)
+static void FLASH_PageErase_NoState(uint32_t PageAddress)
+{
+  SET_BIT(FLASH->CR, FLASH_CR_PER);
+  WRITE_REG(FLASH->AR, PageAddress);
+  SET_BIT(FLASH->CR, FLASH_CR_STRT);
+}
 
 // for some reason, this isn't exposed in stm32f3xx_hal_flash.h
 static void FLASH_Program_HalfWord(uint32_t Address, uint16_t Data)
@@ -18,21 +28,45 @@ static void FLASH_Program_HalfWord(uint32_t Address, uint16_t Data)
 }
 
 class ISP : public ISPBase {
-private:
+public:
+  // Flash geometry, as compile-time constants for Bootloader<ISP> and services
   const static size_t kFlashStartAddr = 0x8000000;
   const static size_t kFlashEndAddr = 0x800ffff;
   const static size_t kEraseSize = 2048;
   const static size_t kWriteSize = 2;
 
-public:
-  ISP() : async_op(OP_NONE) {
+  ISP() : interrupt_driven(false), async_op(OP_NONE), async_status(kISPOk) {
+  }
+
+  /**
+   * Selects whether operations are advanced by the flash interrupt (see
+   * irq_handler()) instead of by polling async_update(), so flash throughput
+   * doesn't depend on how often the caller polls, and blocking waits can sleep
+   * in wait_for_update(). Set before isp_begin(). Off by default, since the
+   * application owns the vector table when the ISP runs from the services.
+   */
+  void set_interrupt_driven(bool enable) {
+    interrupt_driven = enable;
   }
 
   bool isp_begin() {
-    return HAL_FLASH_Unlock() == HAL_OK;
+    if (HAL_FLASH_Unlock() != HAL_OK) {
+      return false;
+    }
+    if (interrupt_driven) {
+      irq_isp = this;
+      __HAL_FLASH_ENABLE_IT(FLASH_IT_EOP | FLASH_IT_ERR);
+      NVIC_EnableIRQ(FLASH_IRQn);
+    }
+    return true;
   }
 
   bool isp_end() {
+    if (interrupt_driven) {
+      NVIC_DisableIRQ(FLASH_IRQn);
+      __HAL_FLASH_DISABLE_IT(FLASH_IT_EOP | FLASH_IT_ERR);
+      irq_isp = NULL;
+    }
     return HAL_FLASH_Lock() == HAL_OK;
   }
 
@@ -61,6 +95,61 @@ public:
   }
 
   bool async_update() {
+    if (interrupt_driven) {
+      // Advanced by irq_handler(), but this also steps it once the flash is
+      // idle, in case an error left it waiting without an interrupt.
+      if (async_op != OP_NONE && !__HAL_FLASH_GET_FLAG(FLASH_FLAG_BSY)) {
+        step_masked();
+      }
+      return async_op != OP_NONE;
+    }
+    return step();
+  }
+
+  /**
+   * Sleeps until the next interrupt while an interrupt driven operation has
+   * the flash busy, for blocking waits, since a busy flash always ends with an
+   * end of operation or error interrupt. Returns immediately otherwise.
+   */
+  void wait_for_update() {
+    __disable_irq();
+    if (interrupt_driven && async_op != OP_NONE && __HAL_FLASH_GET_FLAG(FLASH_FLAG_BSY)) {
+      __WFI();  // wakes on the pending interrupt, which runs once enabled
+    }
+    __enable_irq();
+  }
+
+  /**
+   * Flash interrupt handler, called by FLASH_IRQHandler (isp_irq.cpp) on each
+   * end of operation or error, which issues the next page erase or write unit.
+   * Flags are cleared so the interrupt doesn't fire again, errors only once
+   * the operation has ended on them.
+   */
+  static void irq_handler() {
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP);
+    ISP* isp = irq_isp;
+    if (isp != NULL) {
+      isp->step();
+    }
+    if (isp == NULL || isp->async_op == OP_NONE) {
+      __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_WRPERR | FLASH_FLAG_PGERR);
+    }
+  }
+
+  virtual bool get_last_async_status(ISPStatus* statusOut) {
+    // async_op is read first, since the interrupt handler sets async_status
+    // before ending the operation
+    bool done = async_op == OP_NONE;
+    *statusOut = async_status;
+    return done;
+  }
+
+  /**
+   * Advances the running operation once the flash isn't busy, issuing the next
+   * page erase or write units. Returns true while it's busy. Run by
+   * async_update() when polled, otherwise by irq_handler().
+   */
+  bool step() {
     if (async_op == OP_NONE) {
       return false;
     }
@@ -76,7 +165,7 @@ public:
       }
 
       if (async_length_remaining > 0) {
-        FLASH_PageErase(async_addr_current);
+        FLASH_PageErase_NoState(async_addr_current);
 
         async_addr_current += kEraseSize;
         async_length_remaining -= kEraseSize;
@@ -88,45 +177,48 @@ public:
         return false;
       }
     } else if (async_op == OP_WRITE) {
-      if (__HAL_FLASH_GET_FLAG(FLASH_FLAG_WRPERR) || __HAL_FLASH_GET_FLAG(FLASH_FLAG_PGERR)) {
-        CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
-        async_op = OP_NONE;
-        async_status = kISPFlashError;
-        return false;
-      }
+      // Program as many halfwords as the flash allows in this call, skipping
+      // ones which are all 0xff, since the flash is already erased to that.
+      while (!__HAL_FLASH_GET_FLAG(FLASH_FLAG_BSY)) {
+        if (__HAL_FLASH_GET_FLAG(FLASH_FLAG_WRPERR) || __HAL_FLASH_GET_FLAG(FLASH_FLAG_PGERR)) {
+          CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
+          async_op = OP_NONE;
+          async_status = kISPFlashError;
+          return false;
+        }
+
+        uint16_t halfword = 0xffff;
+        while (async_length_remaining > 0
+            && (halfword = FlashWord::load16(async_data_ptr)) == 0xffff) {
+          async_addr_current += kWriteSize;
+          async_data_ptr += kWriteSize;
+          async_length_remaining -= kWriteSize;
+        }
+        if (async_length_remaining == 0) {
+          CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
+          async_op = OP_NONE;
+          async_status = kISPOk;
+          return false;
+        }
 
-      if (async_length_remaining > 0) {
         if (__HAL_FLASH_GET_FLAG(FLASH_FLAG_EOP)) {
           __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP);
         }
         CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
 
-        uint16_t halfword = ((*(uint8_t*)(async_data_ptr+0)) << 0)
-            + ((*(uint8_t*)(async_data_ptr+1)) << 8);
-
         FLASH_Program_HalfWord(async_addr_current, halfword);
 
         async_addr_current += kWriteSize;
         async_data_ptr += kWriteSize;
         async_length_remaining -= kWriteSize;
-        return true;
-      } else {
-        CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
-        async_op = OP_NONE;
-        async_status = kISPOk;
-        return false;
       }
+      return true;
     } else {
       // This shouldn't happen, so make it fail obviously when it does.
       return false;
     }
   }
 
-  virtual bool get_last_async_status(ISPStatus* statusOut) {
-    *statusOut = async_status;
-    return async_op == OP_NONE;
-  }
-
   virtual bool async_erase(void* start_addr, size_t length) {
     if (async_op != OP_NONE) {
       return false;
@@ -155,7 +247,7 @@ public:
     async_length_remaining = length;
 
     __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_WRPERR | FLASH_FLAG_PGERR);
-    async_update();
+    step_masked();
 
     return true;
   }
@@ -165,6 +257,7 @@ public:
     if (async_op != OP_NONE) {
       return false;
     }
+    async_status = kISPOk;
 
     if (length % kWriteSize != 0) {
       async_status = kISPInvalidArgs;
@@ -186,18 +279,38 @@ public:
     async_length_remaining = length;
 
     __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_WRPERR | FLASH_FLAG_PGERR);
-    async_update();
+    step_masked();
 
     return true;
   }
 
 private:
+  /**
+   * Steps the operation from the caller, like to issue the first step of a new
+   * operation. In interrupt driven mode, the flash interrupt is masked
+   * meanwhile, so it can't step concurrently.
+   */
+  void step_masked() {
+    if (interrupt_driven) {
+      NVIC_DisableIRQ(FLASH_IRQn);
+      step();
+      NVIC_EnableIRQ(FLASH_IRQn);
+    } else {
+      step();
+    }
+  }
+
+  // The ISP whose operation the flash interrupt advances, while it's active
+  static ISP* volatile irq_isp;
+
+  bool interrupt_driven;
+
   enum AsyncOp {OP_NONE, OP_ERASE, OP_WRITE};
-  AsyncOp async_op;
+  volatile AsyncOp async_op;
   uint32_t async_addr_current;
   uint8_t* async_data_ptr;
   size_t async_length_remaining;
-  ISPStatus async_status;
+  volatile ISPStatus async_status;
 };
 
 #endif
@@ -0,0 +1,66 @@
+#include "lz.h"
+
+LZDecoder::LZResult LZDecoder::decode(const uint8_t* chunk, size_t length) {
+  if (outBegin == NULL) {
+    return kErrorNoBuffer;
+  }
+  if (decoderStatus == kDecodeError) {
+    return kErrorInvalidFormat;
+  }
+
+  while (length > 0) {
+    uint8_t byte = *chunk;
+
+    if (decoderStatus == kDecodeFlags) {
+      flags = byte;
+      flagsRemaining = 8;
+      decoderStatus = kDecodeItem;
+    } else if (decoderStatus == kDecodeItem) {
+      if (flags & 0x01) {  // literal
+        if (outPtr >= outEnd) {
+          decoderStatus = kDecodeError;
+          return kErrorOverflow;
+        }
+        *outPtr = byte;
+        outPtr++;
+        flags >>= 1;
+        flagsRemaining -= 1;
+        if (flagsRemaining == 0) {
+          decoderStatus = kDecodeFlags;
+        }
+      } else {  // back-reference, wait for the second byte
+        matchHigh = byte;
+        decoderStatus = kDecodeMatch;
+      }
+    } else {  // kDecodeMatch
+      size_t offset = (((size_t)matchHigh << 2) | (byte >> 6)) + 1;
+      size_t matchLength = (byte & 0x3f) + kMinMatchLength;
+      if (offset > (size_t)(outPtr - outBegin)) {
+        decoderStatus = kDecodeError;
+        return kErrorInvalidFormat;
+      }
+      if (matchLength > (size_t)(outEnd - outPtr)) {
+        decoderStatus = kDecodeError;
+        return kErrorOverflow;
+      }
+      // Byte-by-byte copy, since the source may overlap the destination (runs)
+      uint8_t* src = outPtr - offset;
+      for (size_t i=0; i<matchLength; i++) {
+        *outPtr = *src;
+        outPtr++;
+        src++;
+      }
+      flags >>= 1;
+      flagsRemaining -= 1;
+      if (flagsRemaining == 0) {
+        decoderStatus = kDecodeFlags;
+      } else {
+        decoderStatus = kDecodeItem;
+      }
+    }
+
+    chunk += 1;
+    length -= 1;
+  }
+  return kResultWorking;
+}
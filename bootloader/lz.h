@@ -0,0 +1,83 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Streaming decoder for DuckyLZ, a LZSS variant with a window bounded by the
+ * output buffer. See host/duckylz.py for the format description.
+ */
+class LZDecoder {
+public:
+  LZDecoder() :
+    outBegin(NULL), outPtr(NULL), outEnd(NULL),
+    decoderStatus(kDecodeFlags), flags(0), flagsRemaining(0), matchHigh(0) {
+  }
+
+  /**
+   * Sets the output buffer and resets the decoder state. Back-references can
+   * only point into data previously decoded into this buffer, so its length is
+   * also the window size.
+   */
+  void set_buffer(uint8_t* buffer, size_t length) {
+    outBegin = buffer;
+    outPtr = buffer;
+    outEnd = buffer + length;
+    decoderStatus = kDecodeFlags;
+    flagsRemaining = 0;
+  }
+
+  enum LZResult {
+    kResultWorking,  // data consumed, ready for more
+    kErrorOverflow,  // decoded data would overflow the output buffer
+    kErrorInvalidFormat,  // back-reference points outside the decoded data
+    kErrorNoBuffer,  // no buffer assigned
+  };
+
+  /**
+   * Decodes a chunk of data from the input stream. May be called multiple
+   * times with consecutive pieces of a stream. On error, the decoder must be
+   * reset with set_buffer before decoding again.
+   */
+  LZResult decode(const uint8_t* chunk, size_t length);
+
+  /**
+   * Returns true if the input so far ends on an item boundary, that is, the
+   * stream is not truncated in the middle of a back-reference.
+   */
+  bool is_complete() const {
+    return decoderStatus == kDecodeFlags || decoderStatus == kDecodeItem;
+  }
+
+  /**
+   * Returns the number of bytes decoded into the output buffer.
+   */
+  size_t get_length() const {
+    return outPtr - outBegin;
+  }
+
+  // Back-reference encoding: 10 bits of (offset-1), 6 bits of (length-3).
+  static const size_t kMinMatchLength = 3;
+  static const size_t kMaxMatchLength = kMinMatchLength + 63;
+  static const size_t kMaxMatchOffset = 1024;
+
+protected:
+  uint8_t* outBegin;
+  uint8_t* outPtr;
+  uint8_t* outEnd;
+
+  enum DecoderStatus {
+    kDecodeFlags,  // next byte is a flags byte
+    kDecodeItem,  // next byte begins an item (literal or back-reference)
+    kDecodeMatch,  // next byte is the second byte of a back-reference
+    kDecodeError,  // stream in error, discard remaining bytes
+  };
+
+  DecoderStatus decoderStatus;
+  uint8_t flags;  // flags for the current group, LSB is the next item
+  uint8_t flagsRemaining;  // number of items remaining in the current group
+  uint8_t matchHigh;  // first byte of the current back-reference
+};
+
+#endif
@@ -5,17 +5,27 @@
  *      Author: ducky
  */
 
+#include <string.h>
+
 #include "mbed.h"
+#ifndef TARGET_NATIVE
+#include "us_ticker_api.h"
+#endif
 
 #include "crc.h"
 #include "packet.h"
 #include "cobs.h"
+#include "lz.h"
 
 #include "blproto.h"
 
 #include "ActivityLED.h"
 #include "isp.h"
 #include "bootloader.h"
+#include "profile.h"
+#include "trace.h"
+#include "boot_info.h"
+#include "warm_entry.h"
 
 RawSerial usb_uart(SERIAL_TX, SERIAL_RX);
 RawSerial ext_uart(D1, D0);
@@ -30,57 +40,115 @@ const uint32_t kI2CFrequency = 1000000;
 
 const uint32_t kActivityPulseTimeMs = 25;
 
+// Interval between progress lines while erasing the app region, well within
+// the host's reply timeout
+const uint32_t kEraseProgressUs = 250000;
+
 const uint32_t kHeartbeatPeriodMs = 1000;
 const uint32_t kInitHeartbeatPeriodMs = 500;
 const uint32_t kHeartbeatPulseTimeMs = kActivityPulseTimeMs;
 
-extern char _AppStart, _AppEnd, _BootloaderDataStart, _BootloaderDataEnd, _BootVectorBegin, _BootVectorEnd, _BootloaderVector;
+extern char _AppStart, _AppEnd, _BootloaderDataStart[], _BootloaderDataEnd[], _BootloaderVector;
 uint8_t* const kAppBeginPtr = (uint8_t*)&_AppStart;
 uint8_t* const kAppEndPtr = (uint8_t*)&_AppEnd;
-uint8_t* const kBootloaderDataBeginPtr = (uint8_t*)&_BootloaderDataStart;
-uint8_t* const kBootloaderDataEndPtr = (uint8_t*)&_BootloaderDataEnd;
-uint8_t* const kBootVectorPtr = (uint8_t*)&_BootVectorBegin;
-const size_t kBootVectorSize = (uint8_t*)&_BootVectorEnd - (uint8_t*)&_BootVectorBegin;
-uint8_t* const kBootloaderVectorPtr = (uint8_t*)&_BootloaderVector;
+uint8_t* const kBootloaderDataBeginPtr = (uint8_t*)_BootloaderDataStart;
+uint8_t* const kBootloaderDataEndPtr = (uint8_t*)_BootloaderDataEnd;
+
+// RAM the bootloader doesn't use, for images loaded with 'R' and run with 'X'
+extern char _RamLoadStart, _RamLoadEnd;
+uint8_t* const kRamLoadBeginPtr = (uint8_t*)&_RamLoadStart;
+uint8_t* const kRamLoadEndPtr = (uint8_t*)&_RamLoadEnd;
+// VTOR alignment, for vector tables of up to 128 entries
+const uint32_t kVectorAlignment = 512;
 
 ISP this_isp;
-Bootloader bootloader(this_isp, kAppBeginPtr, kAppEndPtr - kAppBeginPtr,
-    kBootloaderDataBeginPtr, kBootloaderDataEndPtr - kBootloaderDataBeginPtr,
-    kBootVectorPtr, kBootloaderVectorPtr, kBootVectorSize);
+Bootloader<ISP> bootloader(this_isp, kAppBeginPtr, kAppEndPtr - kAppBeginPtr,
+    kBootloaderDataBeginPtr, kBootloaderDataEndPtr - kBootloaderDataBeginPtr);
+
+#ifndef TARGET_NATIVE
+// Fail to compile if the ISP's write size doesn't fit the bootloader's write
+// combining, or doesn't divide the image header and slot select writes.
+typedef char WriteSizeFits[ISP::kWriteSize <= BootloaderBase::kMaxWriteSize ? 1 : -1];
+typedef char HeaderWriteAligned[Image::kHeaderWriteLength % ISP::kWriteSize == 0 ? 1 : -1];
+typedef char SelectWriteAligned[sizeof(Image::SlotSelect) % ISP::kWriteSize == 0 ? 1 : -1];
+#endif
+
+// Data buffers for queued writes (and the output of compressed writes), each
+// must not be modified until its write completes. Two buffers allow the next
+// write to be received while the previous one is programmed. Word aligned, so
+// the ISP loads write units directly.
+const size_t kWriteBufferCount = 2;
+uint8_t writeBuffers[kWriteBufferCount][BootProto::kMaxDecompressedLength]
+    __attribute__((aligned(4)));
+uint8_t writeBufferIds[kWriteBufferCount];  // id of the write using each buffer
+size_t nextWriteBuffer = 0;
+
+// Id of the next command sent to a slave, used to get its result.
+uint8_t nextSlaveCommandId = 0;
+
+// Slave writes and erases are pipelined: the master responds once the command
+// is sent, so the host can send the next one while the slave programs. At most
+// one per slave write buffer are outstanding, so the slave always has a free
+// buffer and never blocks while receiving a command. Results are collected
+// when the window is full, and before any other command, whose response then
+// reports the first failure instead of running it.
+const size_t kSlaveWindow = kWriteBufferCount;
+uint8_t pendingSlaveIds[kSlaveWindow];  // oldest first
+size_t pendingSlaveCount = 0;
+uint8_t pendingSlaveDevice = 0;
+BootProto::RespStatus pendingSlaveStatus = BootProto::kRespDone;  // first failure
+
+// Whether an update command was handled since the last note_update_done()
+bool updateCommandPending = false;
 
 /**
- * Runs an application at the specified address. Should not return under normal
- * circumstances.
+ * Records a boot milestone (see BootInfo::Info) the first time it's reached.
  */
-void runApp(void* app_ptrs, void* isr_vectors) {
-  // Use statics since the stack pointer gets reset without the compiler knowing.
-  static uint32_t stack_ptr = 0;
-  static void (*target)(void) = 0;
-
-  stack_ptr = (*(uint32_t*)((uint8_t*)app_ptrs + 0));
-  target = (void (*)(void))(*(uint32_t*)((uint8_t*)app_ptrs + 4));
-
-  // Just to be extra safe
-  for (uint8_t i=0; i<NVIC_NUM_VECTORS; i++) {
-    NVIC_DisableIRQ((IRQn_Type)i);
+void boot_milestone(uint32_t& milestone) {
+  if (milestone == BootInfo::kNotReached) {
+    milestone = us_ticker_read();
   }
+}
 
-  // Reset the interrupt table so the application can re-load it
-  SCB->VTOR = (uint32_t)isr_vectors;
-
-  __set_MSP(stack_ptr);
-  __set_PSP(stack_ptr);
-
-  goto *target;
+/**
+ * Records an update (flash) command of received_bytes, starting the update if
+ * it's the first.
+ */
+void note_update(size_t received_bytes) {
+  BootInfo::Info* info = BootInfo::get();
+  if (info->update_start_us == 0) {
+    info->update_start_us = us_ticker_read() | 1;  // 0 means no update
+  }
+  info->received_bytes += received_bytes;
+  updateCommandPending = true;
+}
 
-  // TODO: replace with standard function call instead of goto.
-  // For some reason, this increments the stack pointer past the top of memory,
-  // causing a hardfault when it tries to access those locations.
-  // target();
+/**
+ * Records the end of the update so far, once its commands have completed.
+ */
+void note_update_done() {
+  if (updateCommandPending) {
+    BootInfo::get()->update_end_us = us_ticker_read();
+    BootInfo::get()->blank_bytes = bootloader.get_blank_bytes();
+#if defined(TARGET_NUCLEO_L432KC) || defined(TARGET_NATIVE_SIM)
+    BootInfo::get()->fast_rows = this_isp.get_row_count();
+#endif
+    updateCommandPending = false;
+  }
 }
 
-void runApp(void* app_ptr) {
-  runApp(app_ptr, app_ptr);
+/**
+ * Starts the app, recording the time in BootInfo. Returns false if the image
+ * header isn't valid.
+ */
+bool start_app(size_t start_offset) {
+  BootInfo::Info* info = BootInfo::get();
+  boot_milestone(info->app_jump_us);
+  if (!bootloader.run_app(start_offset)) {
+    info->app_jump_us = BootInfo::kNotReached;
+    return false;
+  }
+  return true;
 }
 
 BootProto::RespStatus blstatus_from_ispstatus(ISPBase::ISPStatus status) {
@@ -95,23 +163,414 @@ BootProto::RespStatus blstatus_from_ispstatus(ISPBase::ISPStatus status) {
   }
 }
 
-BootProto::RespStatus get_slave_status(I2C &i2c, uint8_t device) {
-  uint8_t i2cData[1];
+/**
+ * Returns the next free write buffer and assigns it to the write with the
+ * specified id, running queued commands until the buffer is free.
+ */
+uint8_t* get_write_buffer(uint8_t id) {
+  while (bootloader.get_result(writeBufferIds[nextWriteBuffer]) == BootProto::kRespBusy) {
+    bootloader.async_update();
+  }
+  uint8_t* buffer = writeBuffers[nextWriteBuffer];
+  writeBufferIds[nextWriteBuffer] = id;
+  nextWriteBuffer = (nextWriteBuffer + 1) % kWriteBufferCount;
+  return buffer;
+}
+
+/**
+ * Runs queued commands until there is space in the queue.
+ */
+void wait_for_queue() {
+  while (!bootloader.can_enqueue()) {
+    bootloader.async_update();
+  }
+}
+
+/**
+ * Decompresses a DuckyLZ payload into out, checking the decompressed length
+ * and CRC.
+ */
+BootProto::RespStatus decompress_payload(uint8_t* data, size_t length,
+    uint8_t* out, size_t decompressed_length, uint32_t crc) {
+  if (decompressed_length > BootProto::kMaxDecompressedLength) {
+    return BootProto::kRespInvalidArgs;
+  }
+  LZDecoder decoder;
+  decoder.set_buffer(out, decompressed_length);
+  if (decoder.decode(data, length) != LZDecoder::kResultWorking
+      || !decoder.is_complete()
+      || decoder.get_length() != decompressed_length) {
+    return BootProto::kRespInvalidFormat;
+  }
+  uint32_t computed_crc = CRC32::compute_crc(out, decompressed_length);
+  if (computed_crc != crc) {
+    Trace::record(Trace::kEventCrcFail, 0, decompressed_length);
+    return BootProto::kRespInvalidChecksum;
+  }
+  return BootProto::kRespDone;
+}
+
+/**
+ * Copies a block of a RAM image into the RAM load region at offset, after
+ * checking its CRC.
+ */
+BootProto::RespStatus ram_write(uint32_t offset, uint8_t* data, size_t length,
+    uint32_t crc) {
+  if (CRC32::compute_crc(data, length) != crc) {
+    Trace::record(Trace::kEventCrcFail, 0, length);
+    return BootProto::kRespInvalidChecksum;
+  }
+  size_t region_length = kRamLoadEndPtr - kRamLoadBeginPtr;
+  if (offset > region_length || length > region_length - offset) {
+    return BootProto::kRespInvalidArgs;
+  }
+  memcpy(kRamLoadBeginPtr + offset, data, length);
+  return BootProto::kRespDone;
+}
+
+/**
+ * Runs the RAM image in the first length bytes of the RAM load region, with
+ * its vector table at offset, after checking the image CRC. Only returns on
+ * failure.
+ */
+BootProto::RespStatus ram_run(uint32_t offset, uint32_t length, uint32_t crc) {
+  if (length > (size_t)(kRamLoadEndPtr - kRamLoadBeginPtr)
+      || offset % kVectorAlignment != 0 || offset >= length || length - offset < 8) {
+    return BootProto::kRespInvalidArgs;
+  }
+  if (CRC32::compute_crc(kRamLoadBeginPtr, length) != crc) {
+    Trace::record(Trace::kEventCrcFail, 0, length);
+    return BootProto::kRespInvalidChecksum;
+  }
+  bootloader.flush();
+  boot_milestone(BootInfo::get()->app_jump_us);
+  BootloaderBase::run_vectors(kRamLoadBeginPtr + offset);
+  return BootProto::kRespUnknownError;
+}
+
+/**
+ * Sends a string to the host, on both UARTs.
+ */
+void uart_puts(const char* str) {
+  usb_uart.puts(str);
+  ext_uart.puts(str);
+}
+
+/**
+ * Sends a value to the host as 8 hex digits.
+ */
+void uart_put_hex(uint32_t value) {
+  const char* digits = "0123456789abcdef";
+  char str[9];
+  for (size_t i=0; i<8; i++) {
+    str[i] = digits[(value >> (28 - 4*i)) & 0xf];
+  }
+  str[8] = '\0';
+  uart_puts(str);
+}
+
+/**
+ * Sends an 'e' progress line to the host, with the time since start in us in
+ * hex, if kEraseProgressUs passed since last (which is then updated). This
+ * keeps the host's reply timeout from expiring during a long erase.
+ */
+void put_erase_progress(uint32_t start, uint32_t& last) {
+  uint32_t now = us_ticker_read();
+  if (now - last >= kEraseProgressUs) {
+    uart_puts("e ");
+    uart_put_hex(now - start);
+    uart_puts("\n");
+    last = now;
+  }
+}
+
+void send_slave_command(I2C &i2c, uint8_t device,
+    BufferedPacketBuilder<BootProto::kMaxPayloadLength>& packet) {
+  PROFILE_SCOPE(kStageI2C);
+  if (i2c.write(BootProto::GetDeviceAddr(device),
+      (char*)packet.getBuffer(), packet.getLength()) != 0) {
+    Trace::record(Trace::kEventI2CNack, device);
+  }
+}
+
+/**
+ * Polls a slave until the command with the specified id completes, returning
+ * its status. If progress is true, sends erase progress lines meanwhile.
+ */
+BootProto::RespStatus get_slave_result(I2C &i2c, uint8_t device, uint8_t id,
+    bool progress=false) {
+  PROFILE_SCOPE(kStageI2C);
+  uint8_t i2cData[2];
   BootProto::RespStatus resp = BootProto::kRespBusy;
+  uint16_t polls = 0;
+  uint32_t start = us_ticker_read();
+  uint32_t last = start;
   while (resp == BootProto::kRespBusy) {
-    i2cData[0] = BootProto::kCmdStatus;
-    // TODO: debug why I2C device resets are necessary...
+    if (progress) {
+      put_erase_progress(start, last);
+    }
+    i2cData[0] = BootProto::kCmdResult;
+    i2cData[1] = id;
     i2c.frequency(kI2CFrequency); // reset the I2C device
-    i2c.write(BootProto::GetDeviceAddr(device), (char*)i2cData, 1);
+    if (i2c.write(BootProto::GetDeviceAddr(device), (char*)i2cData, 2) != 0) {
+      Trace::record(Trace::kEventI2CNack, device);
+    }
     i2c.read(BootProto::GetDeviceAddr(device), (char*)i2cData, 1);
     resp = (BootProto::RespStatus)i2cData[0];
+    if (polls < 0xffff) {
+      polls++;
+    }
   }
+  Trace::record(Trace::kEventStatusPolls, device, polls);
   return resp;
 }
 
-BootProto::RespStatus process_bootloader_command(I2C &i2c, MemoryPacketReader& packet) {
+/**
+ * Collects the result of the oldest pipelined slave command, keeping the
+ * first failure.
+ */
+void collect_slave_result(I2C &i2c) {
+  BootProto::RespStatus status = get_slave_result(i2c, pendingSlaveDevice,
+      pendingSlaveIds[0]);
+  if (status != BootProto::kRespDone && pendingSlaveStatus == BootProto::kRespDone) {
+    pendingSlaveStatus = status;
+  }
+  pendingSlaveCount--;
+  for (size_t i=0; i<pendingSlaveCount; i++) {
+    pendingSlaveIds[i] = pendingSlaveIds[i + 1];
+  }
+}
+
+/**
+ * Collects the results of all pipelined slave commands, returning (and
+ * clearing) the first failure, or kRespDone.
+ */
+BootProto::RespStatus collect_slave_results(I2C &i2c) {
+  while (pendingSlaveCount > 0) {
+    collect_slave_result(i2c);
+  }
+  BootProto::RespStatus status = pendingSlaveStatus;
+  pendingSlaveStatus = BootProto::kRespDone;
+  return status;
+}
+
+/**
+ * Sends a pipelined command with the specified id to a slave, after
+ * collecting results to make room in the window (all of them, if they are
+ * from another slave). If one failed, returns the failure without sending.
+ */
+BootProto::RespStatus send_slave_pipelined(I2C &i2c, uint8_t device,
+    BufferedPacketBuilder<BootProto::kMaxPayloadLength>& packet, uint8_t id) {
+  while (pendingSlaveCount > 0
+      && (device != pendingSlaveDevice || pendingSlaveCount >= kSlaveWindow)) {
+    collect_slave_result(i2c);
+  }
+  if (pendingSlaveStatus != BootProto::kRespDone) {
+    return collect_slave_results(i2c);
+  }
+  send_slave_command(i2c, device, packet);
+  pendingSlaveDevice = device;
+  pendingSlaveIds[pendingSlaveCount++] = id;
+  return BootProto::kRespDone;
+}
+
+/**
+ * Serializes a page of this device's trace records, in the kCmdTrace format.
+ */
+void put_trace_page(BufferedPacketBuilder<BootProto::kMaxPayloadLength>& packet,
+    uint8_t page) {
+  size_t start = page * Trace::kPageLength;
+  size_t count = 0;
+  if (start < Trace::get_count()) {
+    count = Trace::get_count() - start;
+    if (count > Trace::kPageLength) {
+      count = Trace::kPageLength;
+    }
+  }
+  packet.put<uint32_t>(Trace::get_total());
+  packet.put<uint8_t>((uint8_t)count);
+  for (size_t i=start; i<start+count; i++) {
+    const Trace::Record& record = Trace::get(i);
+    packet.put<uint32_t>(record.time_us);
+    packet.put<uint8_t>(record.event);
+    packet.put<uint8_t>(record.arg8);
+    packet.put<uint16_t>(record.arg16);
+  }
+}
+
+/**
+ * Prints a serialized trace page as text lines to the host, each starting
+ * with 't': the total events recorded, then time, event, arg8 and arg16 per
+ * record, all in hex. Returns false without printing if the page is invalid,
+ * as read from a slave without tracing.
+ */
+bool print_trace_page(MemoryPacketReader& packet) {
+  uint32_t total = packet.read<uint32_t>();
+  uint8_t count = packet.read<uint8_t>();
+  if (count > Trace::kPageLength) {
+    return false;
+  }
+  uart_puts("t ");
+  uart_put_hex(total);
+  uart_puts("\n");
+  for (size_t i=0; i<count; i++) {
+    uart_puts("t ");
+    uart_put_hex(packet.read<uint32_t>());  // time
+    uart_puts(" ");
+    uart_put_hex(packet.read<uint8_t>());  // event
+    uart_puts(" ");
+    uart_put_hex(packet.read<uint8_t>());  // arg8
+    uart_puts(" ");
+    uart_put_hex(packet.read<uint16_t>());  // arg16
+    uart_puts("\n");
+  }
+  return true;
+}
+
+/**
+ * Serializes this device's boot info (see boot_info.h), in the kCmdBootInfo
+ * format: the Info fields in order, kBootInfoLength bytes.
+ */
+void put_boot_info(BufferedPacketBuilder<BootProto::kMaxPayloadLength>& packet) {
+  const BootInfo::Info* info = BootInfo::get();
+  packet.put<uint32_t>(info->magic);
+  packet.put<uint16_t>(info->version);
+  packet.put<uint16_t>(info->length);
+  packet.put<uint32_t>(info->flags);
+  packet.put<uint32_t>(info->main_us);
+  packet.put<uint32_t>(info->scan_us);
+  packet.put<uint32_t>(info->enumerated_us);
+  packet.put<uint32_t>(info->first_command_us);
+  packet.put<uint32_t>(info->app_jump_us);
+  packet.put<uint32_t>(info->update_start_us);
+  packet.put<uint32_t>(info->update_end_us);
+  packet.put<uint32_t>(info->received_bytes);
+  packet.put<uint32_t>(info->erased_bytes);
+  packet.put<uint32_t>(info->written_bytes);
+  packet.put<uint32_t>(info->blank_bytes);
+  packet.put<uint32_t>(info->fast_rows);
+}
+
+/**
+ * Prints serialized boot info as a text line to the host, starting with 'b',
+ * then its fields after the magic, in order and in hex. Returns false without
+ * printing if the info wasn't written by a bootloader.
+ */
+bool print_boot_info(MemoryPacketReader& packet) {
+  if (packet.read<uint32_t>() != BootInfo::kMagic) {
+    return false;
+  }
+  uart_puts("b ");
+  uart_put_hex(packet.read<uint16_t>());  // version
+  uart_puts(" ");
+  uart_put_hex(packet.read<uint16_t>());  // length
+  while (packet.getRemainingBytes() >= 4) {
+    uart_puts(" ");
+    uart_put_hex(packet.read<uint32_t>());
+  }
+  uart_puts("\n");
+  return true;
+}
+
+// Serialized length of the app slots, as read with kCmdSlots
+const size_t kSlotsLength = 3;
+
+/**
+ * Serializes this device's app slots, in the kCmdSlots format.
+ */
+void put_slots(BufferedPacketBuilder<BootProto::kMaxPayloadLength>& packet) {
+  int bootSlot = bootloader.get_boot_slot();
+  packet.put<uint8_t>(bootloader.get_slot_count());
+  packet.put<uint8_t>(bootSlot == Image::kNoSlot ? 0xff : bootSlot);
+  packet.put<uint8_t>(bootloader.get_target_slot());
+}
+
+/**
+ * Prints serialized app slots as a text line to the host, starting with 'q',
+ * then the slot count, boot slot (ffffffff if none) and target slot, in hex.
+ * Returns false without printing if the slot count is invalid, as read from a
+ * slave without app slot support.
+ */
+bool print_slots(MemoryPacketReader& packet) {
+  uint8_t count = packet.read<uint8_t>();
+  if (count == 0 || count == 0xff) {
+    return false;
+  }
+  uint8_t bootSlot = packet.read<uint8_t>();
+  uart_puts("q ");
+  uart_put_hex(count);
+  uart_puts(" ");
+  uart_put_hex(bootSlot == 0xff ? 0xffffffff : bootSlot);
+  uart_puts(" ");
+  uart_put_hex(packet.read<uint8_t>());
+  uart_puts("\n");
+  return true;
+}
+
+#ifdef BOOTLOADER_PROFILE
+/**
+ * Serializes this device's stage statistics, in the kCmdStats format.
+ */
+void put_stats(BufferedPacketBuilder<BootProto::kMaxPayloadLength>& packet) {
+  packet.put<uint32_t>(Profile::get_frequency());
+  for (size_t i=0; i<Profile::kNumStages; i++) {
+    const Profile::StageStats& stats = Profile::get_stats((Profile::Stage)i);
+    packet.put<uint32_t>(stats.count);
+    packet.put<uint32_t>(stats.min);
+    packet.put<uint32_t>(stats.max);
+    packet.put<uint32_t>((uint32_t)(stats.sum >> 32));
+    packet.put<uint32_t>((uint32_t)stats.sum);
+  }
+}
+
+/**
+ * Prints serialized stage statistics as text lines to the host, each starting
+ * with 's': the counter frequency, then count, min, max and sum per stage, all
+ * in hex. Returns false without printing if the statistics are invalid, as
+ * read from a slave without profiling.
+ */
+bool print_stats(MemoryPacketReader& packet) {
+  uint32_t frequency = packet.read<uint32_t>();
+  if (frequency == 0 || frequency == 0xffffffff) {
+    return false;
+  }
+  uart_puts("s ");
+  uart_put_hex(frequency);
+  uart_puts("\n");
+  for (size_t i=0; i<Profile::kNumStages; i++) {
+    uart_puts("s ");
+    uart_put_hex(packet.read<uint32_t>());  // count
+    uart_puts(" ");
+    uart_put_hex(packet.read<uint32_t>());  // min
+    uart_puts(" ");
+    uart_put_hex(packet.read<uint32_t>());  // max
+    uart_puts(" ");
+    uart_put_hex(packet.read<uint32_t>());  // sum, high then low word
+    uart_put_hex(packet.read<uint32_t>());
+    uart_puts("\n");
+  }
+  return true;
+}
+#endif
+
+BootProto::RespStatus process_bootloader_command(I2C &i2c, MemoryPacketReader& packet,
+    BootProto::Framing* framing) {
+  PROFILE_SCOPE(kStageCommand);
   BufferedPacketBuilder<BootProto::kMaxPayloadLength> i2cPacket;
   uint8_t opcode = packet.read<uint8_t>();
+  if (opcode != 'T') {  // dumping the trace shouldn't shift it between pages
+    Trace::record(Trace::kEventCommand, opcode, packet.getRemainingBytes());
+  }
+  boot_milestone(BootInfo::get()->first_command_us);
+  if (strchr("WZECFVHA", opcode) != NULL) {
+    note_update(1 + packet.getRemainingBytes());
+  }
+  if (strchr("WZE", opcode) == NULL) {
+    BootProto::RespStatus status = collect_slave_results(i2c);
+    if (status != BootProto::kRespDone) {
+      return status;
+    }
+  }
 
   if (opcode == 'W') {
     uint8_t device = packet.read<uint8_t>();
@@ -125,27 +584,66 @@ BootProto::RespStatus process_bootloader_command(I2C &i2c, MemoryPacketReader& p
     if (device > 0) {
       device = device - 1;
 
+      uint8_t id = nextSlaveCommandId++;
       i2cPacket.put<uint8_t>(BootProto::kCmdWrite);
+      i2cPacket.put<uint8_t>(id);
       i2cPacket.put<uint32_t>(addr);
       i2cPacket.put<uint16_t>((uint16_t)data_length);
       i2cPacket.put<uint32_t>(crc);
       while (packet.getRemainingBytes() > 0) {
         i2cPacket.put<uint8_t>(packet.read<uint8_t>());
       }
-      i2c.write(BootProto::GetDeviceAddr(device),
-          (char*)i2cPacket.getBuffer(), i2cPacket.getLength());
 
-      return get_slave_status(i2c, device);
+      return send_slave_pipelined(i2c, device, i2cPacket, id);
     } else {
       uint8_t* data = packet.read_buf(data_length);
       uint32_t computed_crc = CRC32::compute_crc(data, data_length);
       if (computed_crc != crc) {
+        Trace::record(Trace::kEventCrcFail, 0, data_length);
         return BootProto::kRespInvalidChecksum;
       }
 
+      BootInfo::get()->written_bytes += data_length;
       return bootloader.write(addr, data, data_length);
 
     }
+  } else if (opcode == 'Z') {
+    uint8_t device = packet.read<uint8_t>();
+    uint32_t addr = packet.read<uint32_t>();
+    uint32_t crc = packet.read<uint32_t>();
+    uint16_t length = packet.read<uint16_t>();
+    size_t data_length = packet.getRemainingBytes();
+    if (data_length < 1) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    if (device > 0) {
+      device = device - 1;
+
+      uint8_t id = nextSlaveCommandId++;
+      i2cPacket.put<uint8_t>(BootProto::kCmdWriteCompressed);
+      i2cPacket.put<uint8_t>(id);
+      i2cPacket.put<uint32_t>(addr);
+      i2cPacket.put<uint16_t>(length);
+      i2cPacket.put<uint16_t>((uint16_t)data_length);
+      i2cPacket.put<uint32_t>(crc);
+      while (packet.getRemainingBytes() > 0) {
+        i2cPacket.put<uint8_t>(packet.read<uint8_t>());
+      }
+
+      return send_slave_pipelined(i2c, device, i2cPacket, id);
+    } else {
+      uint8_t* data = packet.read_buf(data_length);
+      uint8_t* buffer = writeBuffers[0];
+      BootProto::RespStatus status = decompress_payload(data, data_length,
+          buffer, length, crc);
+      if (status != BootProto::kRespDone) {
+        return status;
+      }
+
+      BootInfo::get()->written_bytes += length;
+      return bootloader.write(addr, buffer, length);
+    }
   } else if (opcode == 'E') {
     uint8_t device = packet.read<uint8_t>();
     uint32_t addr = packet.read<uint32_t>();
@@ -157,16 +655,172 @@ BootProto::RespStatus process_bootloader_command(I2C &i2c, MemoryPacketReader& p
     if (device > 0) {
       device = device - 1;
 
+      uint8_t id = nextSlaveCommandId++;
       i2cPacket.put<uint8_t>(BootProto::kCmdErase);
+      i2cPacket.put<uint8_t>(id);
       i2cPacket.put<uint32_t>(addr);
       i2cPacket.put<uint32_t>(length);
-      i2c.write(BootProto::GetDeviceAddr(device),
-          (char*)i2cPacket.getBuffer(), i2cPacket.getLength());
 
-      return get_slave_status(i2c, device);
+      return send_slave_pipelined(i2c, device, i2cPacket, id);
     } else {
+      BootInfo::get()->erased_bytes += length;
       return bootloader.erase(addr, length);
     }
+  } else if (opcode == 'C') {
+    // Erases the app region (the target slot), then prints 'c' and the time
+    // it took in us, in hex, before the response. Neither part has a bank
+    // erase which spares the bootloader, so this is the usual page erase, but
+    // as one command which the master runs without returning to the host.
+    // A whole slot can take longer than the host's reply timeout (over a
+    // second on the L432), so 'e' progress lines are sent meanwhile.
+    uint8_t device = packet.read<uint8_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    uint32_t start = us_ticker_read();
+    BootProto::RespStatus status;
+    if (device > 0) {
+      device = device - 1;
+
+      uint8_t id = nextSlaveCommandId++;
+      i2cPacket.put<uint8_t>(BootProto::kCmdEraseApp);
+      i2cPacket.put<uint8_t>(id);
+      send_slave_command(i2c, device, i2cPacket);
+
+      status = get_slave_result(i2c, device, id, true);
+    } else {
+      BootInfo::get()->erased_bytes += bootloader.get_slot_length();
+      if (bootloader.async_erase(0, bootloader.get_slot_length())) {
+        uint32_t last = start;
+        while ((status = bootloader.async_update()) == BootProto::kRespBusy) {
+          put_erase_progress(start, last);
+          this_isp.wait_for_update();
+        }
+      } else {
+        status = BootProto::kRespUnknownError;
+      }
+    }
+    if (status == BootProto::kRespDone) {
+      uart_puts("c ");
+      uart_put_hex(us_ticker_read() - start);
+      uart_puts("\n");
+    }
+    return status;
+  } else if (opcode == 'F') {
+    uint8_t device = packet.read<uint8_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    if (device > 0) {
+      device = device - 1;
+
+      uint8_t id = nextSlaveCommandId++;
+      i2cPacket.put<uint8_t>(BootProto::kCmdFlush);
+      i2cPacket.put<uint8_t>(id);
+      send_slave_command(i2c, device, i2cPacket);
+
+      return get_slave_result(i2c, device, id);
+    } else {
+      return bootloader.flush();
+    }
+  } else if (opcode == 'V') {
+    uint8_t device = packet.read<uint8_t>();
+    uint32_t addr = packet.read<uint32_t>();
+    uint32_t length = packet.read<uint32_t>();
+    uint32_t crc = packet.read<uint32_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    if (device > 0) {
+      device = device - 1;
+
+      uint8_t id = nextSlaveCommandId++;
+      i2cPacket.put<uint8_t>(BootProto::kCmdVerify);
+      i2cPacket.put<uint8_t>(id);
+      i2cPacket.put<uint32_t>(addr);
+      i2cPacket.put<uint32_t>(length);
+      i2cPacket.put<uint32_t>(crc);
+      send_slave_command(i2c, device, i2cPacket);
+
+      return get_slave_result(i2c, device, id);
+    } else {
+      return bootloader.verify(addr, length, crc);
+    }
+  } else if (opcode == 'H') {
+    uint8_t device = packet.read<uint8_t>();
+    uint32_t length = packet.read<uint32_t>();
+    uint32_t crc = packet.read<uint32_t>();
+    uint32_t version = packet.read<uint32_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    if (device > 0) {
+      device = device - 1;
+
+      uint8_t id = nextSlaveCommandId++;
+      i2cPacket.put<uint8_t>(BootProto::kCmdHeader);
+      i2cPacket.put<uint8_t>(id);
+      i2cPacket.put<uint32_t>(length);
+      i2cPacket.put<uint32_t>(crc);
+      i2cPacket.put<uint32_t>(version);
+      send_slave_command(i2c, device, i2cPacket);
+
+      return get_slave_result(i2c, device, id);
+    } else {
+      return bootloader.header(length, crc, version);
+    }
+  } else if (opcode == 'Q') {
+    // Prints the app slots line (see print_slots) before the response.
+    uint8_t device = packet.read<uint8_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    uint8_t slots[kSlotsLength];
+    if (device > 0) {
+      device = device - 1;
+
+      i2cPacket.put<uint8_t>(BootProto::kCmdSlots);
+      send_slave_command(i2c, device, i2cPacket);
+      if (i2c.read(BootProto::GetDeviceAddr(device), (char*)slots, sizeof(slots)) != 0) {
+        return BootProto::kRespUnknownError;
+      }
+    } else {
+      put_slots(i2cPacket);
+      memcpy(slots, i2cPacket.getBuffer(), sizeof(slots));
+    }
+
+    MemoryPacketReader slotsPacket(slots, sizeof(slots));
+    if (!print_slots(slotsPacket)) {
+      return BootProto::kRespInvalidFormat;
+    }
+    return BootProto::kRespDone;
+  } else if (opcode == 'A') {
+    // Selects the app slot to boot, switching to a newly written image or
+    // rolling back to the previous one.
+    uint8_t device = packet.read<uint8_t>();
+    uint8_t slot = packet.read<uint8_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    if (device > 0) {
+      device = device - 1;
+
+      uint8_t id = nextSlaveCommandId++;
+      i2cPacket.put<uint8_t>(BootProto::kCmdSelectSlot);
+      i2cPacket.put<uint8_t>(id);
+      i2cPacket.put<uint8_t>(slot);
+      send_slave_command(i2c, device, i2cPacket);
+
+      return get_slave_result(i2c, device, id);
+    } else {
+      return bootloader.select(slot);
+    }
   } else if (opcode == 'J') {
     uint8_t device = packet.read<uint8_t>();
     uint32_t addr = packet.read<uint32_t>();
@@ -178,19 +832,175 @@ BootProto::RespStatus process_bootloader_command(I2C &i2c, MemoryPacketReader& p
       device = device - 1;
       i2cPacket.put<uint8_t>(BootProto::kCmdRunApp);
       i2cPacket.put<uint32_t>(addr);
-      i2c.write(BootProto::GetDeviceAddr(device),
-          (char*)i2cPacket.getBuffer(), i2cPacket.getLength());
+      send_slave_command(i2c, device, i2cPacket);
+    } else if (!start_app(addr)) {
+      return BootProto::kRespInvalidChecksum;  // no valid image
+    }
+
+    return BootProto::kRespDone;
+  } else if (opcode == 'R') {
+    // Writes to the RAM load region, with the same format as 'W'.
+    uint8_t device = packet.read<uint8_t>();
+    uint32_t offset = packet.read<uint32_t>();
+    uint32_t crc = packet.read<uint32_t>();
+    size_t data_length = packet.getRemainingBytes();
+    if (data_length < 1) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    if (device > 0) {
+      device = device - 1;
+
+      uint8_t id = nextSlaveCommandId++;
+      i2cPacket.put<uint8_t>(BootProto::kCmdRamWrite);
+      i2cPacket.put<uint8_t>(id);
+      i2cPacket.put<uint32_t>(offset);
+      i2cPacket.put<uint16_t>((uint16_t)data_length);
+      i2cPacket.put<uint32_t>(crc);
+      while (packet.getRemainingBytes() > 0) {
+        i2cPacket.put<uint8_t>(packet.read<uint8_t>());
+      }
+      send_slave_command(i2c, device, i2cPacket);
+
+      return get_slave_result(i2c, device, id);
+    } else {
+      return ram_write(offset, packet.read_buf(data_length), data_length, crc);
+    }
+  } else if (opcode == 'X') {
+    // Runs the image in the RAM load region, checking its CRC first.
+    uint8_t device = packet.read<uint8_t>();
+    uint32_t offset = packet.read<uint32_t>();
+    uint32_t length = packet.read<uint32_t>();
+    uint32_t crc = packet.read<uint32_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    if (device > 0) {
+      device = device - 1;
+      i2cPacket.put<uint8_t>(BootProto::kCmdRamRun);
+      i2cPacket.put<uint32_t>(offset);
+      i2cPacket.put<uint32_t>(length);
+      i2cPacket.put<uint32_t>(crc);
+      send_slave_command(i2c, device, i2cPacket);
+      return BootProto::kRespDone;
     } else {
-      bootloader.run_app(addr);
+      return ram_run(offset, length, crc);
     }
+  } else if (opcode == 'T') {
+    // Prints a page of trace records (see print_trace_page) before the
+    // response.
+    uint8_t device = packet.read<uint8_t>();
+    uint8_t page = packet.read<uint8_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    uint8_t trace[Trace::kMaxPageBytes];
+    if (device > 0) {
+      device = device - 1;
 
+      i2cPacket.put<uint8_t>(BootProto::kCmdTrace);
+      i2cPacket.put<uint8_t>(page);
+      send_slave_command(i2c, device, i2cPacket);
+      if (i2c.read(BootProto::GetDeviceAddr(device), (char*)trace, sizeof(trace)) != 0) {
+        Trace::record(Trace::kEventI2CNack, device);
+        return BootProto::kRespUnknownError;
+      }
+    } else {
+      put_trace_page(i2cPacket, page);
+      memcpy(trace, i2cPacket.getBuffer(), i2cPacket.getLength());
+    }
+
+    MemoryPacketReader tracePacket(trace, sizeof(trace));
+    if (!print_trace_page(tracePacket)) {
+      return BootProto::kRespInvalidFormat;
+    }
     return BootProto::kRespDone;
+  } else if (opcode == 'B') {
+    // Prints the boot info line (see print_boot_info) before the response.
+    uint8_t device = packet.read<uint8_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    uint8_t info[BootInfo::kInfoLength];
+    if (device > 0) {
+      device = device - 1;
+
+      i2cPacket.put<uint8_t>(BootProto::kCmdBootInfo);
+      send_slave_command(i2c, device, i2cPacket);
+      if (i2c.read(BootProto::GetDeviceAddr(device), (char*)info, sizeof(info)) != 0) {
+        return BootProto::kRespUnknownError;
+      }
+    } else {
+      put_boot_info(i2cPacket);
+      memcpy(info, i2cPacket.getBuffer(), sizeof(info));
+    }
+
+    MemoryPacketReader infoPacket(info, sizeof(info));
+    if (!print_boot_info(infoPacket)) {
+      return BootProto::kRespInvalidFormat;
+    }
+    return BootProto::kRespDone;
+#ifdef BOOTLOADER_PROFILE
+  } else if (opcode == 'S') {
+    // Prints stage statistics lines (see print_stats) before the response.
+    uint8_t device = packet.read<uint8_t>();
+    uint8_t reset = packet.read<uint8_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    uint8_t stats[Profile::kStatsLength];
+    if (device > 0) {
+      device = device - 1;
+
+      i2cPacket.put<uint8_t>(BootProto::kCmdStats);
+      i2cPacket.put<uint8_t>(reset);
+      send_slave_command(i2c, device, i2cPacket);
+      if (i2c.read(BootProto::GetDeviceAddr(device), (char*)stats, sizeof(stats)) != 0) {
+        return BootProto::kRespUnknownError;
+      }
+    } else {
+      put_stats(i2cPacket);
+      memcpy(stats, i2cPacket.getBuffer(), sizeof(stats));
+      if (reset) {
+        Profile::reset();
+      }
+    }
+
+    MemoryPacketReader statsPacket(stats, sizeof(stats));
+    if (!print_stats(statsPacket)) {
+      return BootProto::kRespInvalidFormat;
+    }
+    return BootProto::kRespDone;
+#endif
+  } else if (opcode == 'M') {
+    // Selects the framing of subsequent frames, the host should send a
+    // start-of-frame flag after the response.
+    uint8_t mode = packet.read<uint8_t>();
+    if (packet.getRemainingBytes() > 0) {
+      return BootProto::kRespInvalidFormat;
+    }
+
+    if (mode == BootProto::kFramingCOBS || mode == BootProto::kFramingZPE) {
+      *framing = (BootProto::Framing)mode;
+      return BootProto::kRespDone;
+    } else {
+      return BootProto::kRespInvalidArgs;
+    }
   } else {  // unknown command
     return BootProto::kRespInvalidFormat;
   }
 }
 
-int bootloaderMaster() {
+/**
+ * Runs as the chain master. On a warm entry, stays in the bootloader
+ * regardless of the run app pin, and if skipEnumeration, doesn't scan for
+ * slaves.
+ */
+int bootloaderMaster(bool warmEntry, bool skipEnumeration) {
   DigitalIn i2cUp1 = DigitalIn(D4);
   DigitalIn i2cUp2 = DigitalIn(D5);
 
@@ -205,7 +1015,7 @@ int bootloaderMaster() {
   bootOutPin = 1;
 
   uint8_t numDevices = 0;
-  while (1) {
+  while (!skipEnumeration) {
     wait_ms(BootProto::kBootToAddrDelayMs);
 
     i2c.frequency(kI2CFrequency); // reset the I2C device
@@ -234,16 +1044,17 @@ int bootloaderMaster() {
   ext_uart.putc(numDevices + '1');
   usb_uart.puts(" devices in chain\r\n");
   ext_uart.puts(" devices in chain\r\n");
+  boot_milestone(BootInfo::get()->enumerated_us);
 
-  if (!masterRunAppPin) {
+  if (!warmEntry && !masterRunAppPin) {
     for (size_t i=0; i<numDevices; i++) {
       BufferedPacketBuilder<BootProto::kMaxPayloadLength> i2cPacket;
       i2cPacket.put<uint8_t>(BootProto::kCmdRunApp);
       i2cPacket.put<uint32_t>(0);
-      i2c.write(BootProto::GetDeviceAddr(i),
-          (char*)i2cPacket.getBuffer(), i2cPacket.getLength());
+      send_slave_command(i2c, i, i2cPacket);
     }
-    runApp(kBootloaderDataBeginPtr, kAppBeginPtr);
+    start_app(0);
+    // Otherwise the image isn't valid, so stay in the bootloader
   }
 
   statusLED.setIdlePolarity(true);
@@ -252,8 +1063,11 @@ int bootloaderMaster() {
   heartbeatTimer.start();
 
   BufferedPacketReader<BootProto::kMaxPayloadLength> packet;
-  COBSDecoder decoder;
-  decoder.set_buffer(&packet);
+  BootProto::Framing framing = BootProto::kFramingCOBS;
+  COBSDecoder cobsDecoder;
+  ZPEDecoder zpeDecoder;
+  COBSDecoder* decoder = &cobsDecoder;
+  decoder->set_buffer(&packet);
 
   while (1) {
     if (bootInPin == 0) {
@@ -263,10 +1077,22 @@ int bootloaderMaster() {
     while (usb_uart.readable() || ext_uart.readable()) {
       uint8_t rx = usb_uart.readable() ? (uint8_t)usb_uart.getc() : (uint8_t)ext_uart.getc();
       size_t bytes_decoded;
-      COBSDecoder::COBSResult result = decoder.decode(&rx, 1, &bytes_decoded);
+      COBSDecoder::COBSResult result;
+      {
+        PROFILE_SCOPE(kStageDecode);
+        result = decoder->decode(&rx, 1, &bytes_decoded);
+      }
 
-      if (result == COBSDecoder::kResultDone) {
-        BootProto::RespStatus status = process_bootloader_command(i2c, packet);
+      if (result == COBSDecoder::kErrorOverflow
+          || result == COBSDecoder::kErrorInvalidFormat) {
+        Trace::record(Trace::kEventFrameError, result);
+      } else if (result == COBSDecoder::kResultDone) {
+        uint32_t trace_total = Trace::get_total();
+        BootProto::RespStatus status = process_bootloader_command(i2c, packet, &framing);
+        if (Trace::get_total() != trace_total) {  // only for traced commands
+          Trace::record(Trace::kEventResponse, status);
+        }
+        note_update_done();
         if (status == BootProto::kRespDone) {
           usb_uart.puts("D\n");
           ext_uart.puts("D\n");
@@ -290,7 +1116,12 @@ int bootloaderMaster() {
           ext_uart.puts("?\n");
         }
         packet.reset();
-        decoder.set_buffer(&packet);
+        if (framing == BootProto::kFramingZPE) {
+          decoder = &zpeDecoder;
+        } else {
+          decoder = &cobsDecoder;
+        }
+        decoder->set_buffer(&packet);
       }
 
       statusLED.pulse(kActivityPulseTimeMs);
@@ -305,14 +1136,18 @@ int bootloaderMaster() {
   return 0;
 }
 
-int bootloaderSlaveInit() {
+/**
+ * Runs as a slave, waiting for the master to assign an address unless one is
+ * specified (not kAddressGlobal), as on a warm entry.
+ */
+int bootloaderSlaveInit(uint8_t address) {
   statusLED.setIdlePolarity(false);
 
   Timer heartbeatTimer;
   heartbeatTimer.start();
 
   // Wait for BOOT pin to go high
-  while (1) {
+  while (address == BootProto::kAddressGlobal) {
     if (bootInPin == 1) {
       break;
     }
@@ -329,7 +1164,6 @@ int bootloaderSlaveInit() {
   I2CSlave i2c(D4, D5);
   i2c.frequency(kI2CFrequency);
   i2c.address(BootProto::kAddressGlobal);
-  uint8_t address = BootProto::kAddressGlobal;
 
   BootProto::BootCommand lastCommand = BootProto::kCmdInvalid;
 
@@ -368,12 +1202,20 @@ int bootloaderSlaveInit() {
   }
 
   i2c.address(address);
+  boot_milestone(BootInfo::get()->enumerated_us);
 
   BufferedPacketReader<BootProto::kMaxPayloadLength> i2cPacket;
   // If anything other than kRespDone, this is a command parser status
   // and takes priority over the actual bootloader status (which should be
   // "not running").
   BootProto::RespStatus lastStatus = BootProto::kRespDone;
+  uint8_t resultId = 0;  // command id requested by kCmdResult
+  // Data for block reads, snapshotted when their command is received
+  BufferedPacketBuilder<BootProto::kMaxPayloadLength> blockPacket;
+
+  for (size_t i=0; i<kWriteBufferCount; i++) {
+    writeBufferIds[i] = BootloaderBase::kNoId;
+  }
 
   // Main bootloader loop
   while (1) {
@@ -385,6 +1227,8 @@ int bootloaderSlaveInit() {
 
     if (status == BootProto::kRespBusy) {
       statusLED.pulse(kActivityPulseTimeMs);
+    } else {
+      note_update_done();
     }
 
     switch (i2c.receive()) {
@@ -396,6 +1240,13 @@ int bootloaderSlaveInit() {
         } else {
           i2c.write(lastStatus);
         }
+      } else if (lastCommand == BootProto::kCmdResult) {
+        i2c.write(bootloader.get_result(resultId));
+      } else if (lastCommand == BootProto::kCmdTrace
+          || lastCommand == BootProto::kCmdStats
+          || lastCommand == BootProto::kCmdBootInfo
+          || lastCommand == BootProto::kCmdSlots) {
+        i2c.write((char*)blockPacket.getBuffer(), blockPacket.getLength());
       } else {
         // Drop everything else
       }
@@ -404,21 +1255,35 @@ int bootloaderSlaveInit() {
     case I2CSlave::WriteAddressed:
       statusLED.pulse(kActivityPulseTimeMs);
       lastCommand = (BootProto::BootCommand)i2c.read();
+      if (lastCommand != BootProto::kCmdResult && lastCommand != BootProto::kCmdTrace) {
+        // polls are counted by the master instead
+        Trace::record(Trace::kEventCommand, lastCommand);
+      }
+      boot_milestone(BootInfo::get()->first_command_us);
       i2cPacket.reset();
       if (lastCommand == BootProto::kCmdSetBootOut) {
         bootOutPin = 1;
+      } else if (lastCommand == BootProto::kCmdResult) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(1), 1)) {
+          resultId = i2cPacket.read<uint8_t>();
+        }
       } else if (lastCommand == BootProto::kCmdErase) {
-        if (!i2c.read((char*)i2cPacket.ptrPutBytes(8), 8)) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(9), 9)) {
+          uint8_t id = i2cPacket.read<uint8_t>();
           uint32_t startAddr = i2cPacket.read<uint32_t>();
           uint32_t len = i2cPacket.read<uint32_t>();
 
-          bootloader.async_erase(startAddr, len);
+          note_update(1 + 9);
+          BootInfo::get()->erased_bytes += len;
+          wait_for_queue();
+          bootloader.enqueue_erase(id, startAddr, len);
           lastStatus = BootProto::kRespDone;
         } else {
           lastStatus = BootProto::kRespInvalidFormat;
         }
       } else if (lastCommand == BootProto::kCmdWrite) {
-        if (!i2c.read((char*)i2cPacket.ptrPutBytes(10), 10)) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(11), 11)) {
+          uint8_t id = i2cPacket.read<uint8_t>();
           uint32_t startAddr = i2cPacket.read<uint32_t>();
           uint16_t len = i2cPacket.read<uint16_t>();
           uint32_t crc = i2cPacket.read<uint32_t>();
@@ -427,22 +1292,157 @@ int bootloaderSlaveInit() {
           if (!i2c.read((char*)i2cPacket.ptrPutBytes(len), len)) {
             uint8_t* data = i2cPacket.read_buf(len);
             uint32_t computed_crc = CRC32::compute_crc(data, len);
+            note_update(1 + 11 + len);
             if (computed_crc == crc) {
-              bootloader.async_write(startAddr, data, len);
-              lastStatus = BootProto::kRespDone;
+              BootInfo::get()->written_bytes += len;
+              uint8_t* buffer = get_write_buffer(id);
+              memcpy(buffer, data, len);
+              wait_for_queue();
+              bootloader.enqueue_write(id, startAddr, buffer, len);
+            } else {
+              Trace::record(Trace::kEventCrcFail, 0, len);
+              bootloader.set_result(id, BootProto::kRespInvalidChecksum);
+            }
+            lastStatus = BootProto::kRespDone;
+          } else {
+            lastStatus = BootProto::kRespInvalidFormat;
+          }
+        } else {
+          lastStatus = BootProto::kRespInvalidFormat;
+        }
+      } else if (lastCommand == BootProto::kCmdRamWrite) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(11), 11)) {
+          uint8_t id = i2cPacket.read<uint8_t>();
+          uint32_t offset = i2cPacket.read<uint32_t>();
+          uint16_t len = i2cPacket.read<uint16_t>();
+          uint32_t crc = i2cPacket.read<uint32_t>();
+          if (!i2c.read((char*)i2cPacket.ptrPutBytes(len), len)) {
+            bootloader.set_result(id, ram_write(offset, i2cPacket.read_buf(len), len, crc));
+            lastStatus = BootProto::kRespDone;
+          } else {
+            lastStatus = BootProto::kRespInvalidFormat;
+          }
+        } else {
+          lastStatus = BootProto::kRespInvalidFormat;
+        }
+      } else if (lastCommand == BootProto::kCmdWriteCompressed) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(13), 13)) {
+          uint8_t id = i2cPacket.read<uint8_t>();
+          uint32_t startAddr = i2cPacket.read<uint32_t>();
+          uint16_t len = i2cPacket.read<uint16_t>();
+          uint16_t compressedLen = i2cPacket.read<uint16_t>();
+          uint32_t crc = i2cPacket.read<uint32_t>();
+          if (!i2c.read((char*)i2cPacket.ptrPutBytes(compressedLen), compressedLen)) {
+            uint8_t* data = i2cPacket.read_buf(compressedLen);
+            uint8_t* buffer = get_write_buffer(id);
+            BootProto::RespStatus decompressStatus = decompress_payload(
+                data, compressedLen, buffer, len, crc);
+            note_update(1 + 13 + compressedLen);
+            if (decompressStatus == BootProto::kRespDone) {
+              BootInfo::get()->written_bytes += len;
+              wait_for_queue();
+              bootloader.enqueue_write(id, startAddr, buffer, len);
             } else {
-              lastStatus = BootProto::kRespInvalidChecksum;
+              bootloader.set_result(id, decompressStatus);
             }
+            lastStatus = BootProto::kRespDone;
           } else {
             lastStatus = BootProto::kRespInvalidFormat;
           }
         } else {
           lastStatus = BootProto::kRespInvalidFormat;
         }
+      } else if (lastCommand == BootProto::kCmdFlush) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(1), 1)) {
+          uint8_t id = i2cPacket.read<uint8_t>();
+          note_update(1 + 1);
+          wait_for_queue();
+          bootloader.enqueue_flush(id);
+          lastStatus = BootProto::kRespDone;
+        } else {
+          lastStatus = BootProto::kRespInvalidFormat;
+        }
+      } else if (lastCommand == BootProto::kCmdVerify) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(13), 13)) {
+          uint8_t id = i2cPacket.read<uint8_t>();
+          uint32_t startAddr = i2cPacket.read<uint32_t>();
+          uint32_t len = i2cPacket.read<uint32_t>();
+          uint32_t crc = i2cPacket.read<uint32_t>();
+          note_update(1 + 13);
+          wait_for_queue();
+          bootloader.enqueue_verify(id, startAddr, len, crc);
+          lastStatus = BootProto::kRespDone;
+        } else {
+          lastStatus = BootProto::kRespInvalidFormat;
+        }
+      } else if (lastCommand == BootProto::kCmdHeader) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(13), 13)) {
+          uint8_t id = i2cPacket.read<uint8_t>();
+          uint32_t len = i2cPacket.read<uint32_t>();
+          uint32_t crc = i2cPacket.read<uint32_t>();
+          uint32_t version = i2cPacket.read<uint32_t>();
+          note_update(1 + 13);
+          wait_for_queue();
+          bootloader.enqueue_header(id, len, crc, version);
+          lastStatus = BootProto::kRespDone;
+        } else {
+          lastStatus = BootProto::kRespInvalidFormat;
+        }
+      } else if (lastCommand == BootProto::kCmdTrace) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(1), 1)) {
+          blockPacket.reset();
+          put_trace_page(blockPacket, i2cPacket.read<uint8_t>());
+        }
+      } else if (lastCommand == BootProto::kCmdBootInfo) {
+        blockPacket.reset();
+        put_boot_info(blockPacket);
+      } else if (lastCommand == BootProto::kCmdSlots) {
+        blockPacket.reset();
+        put_slots(blockPacket);
+      } else if (lastCommand == BootProto::kCmdEraseApp) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(1), 1)) {
+          uint8_t id = i2cPacket.read<uint8_t>();
+          note_update(1 + 1);
+          BootInfo::get()->erased_bytes += bootloader.get_slot_length();
+          wait_for_queue();
+          bootloader.enqueue_erase(id, 0, bootloader.get_slot_length());
+          lastStatus = BootProto::kRespDone;
+        } else {
+          lastStatus = BootProto::kRespInvalidFormat;
+        }
+      } else if (lastCommand == BootProto::kCmdSelectSlot) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(2), 2)) {
+          uint8_t id = i2cPacket.read<uint8_t>();
+          uint8_t slot = i2cPacket.read<uint8_t>();
+          note_update(1 + 2);
+          wait_for_queue();
+          bootloader.enqueue_select(id, slot);
+          lastStatus = BootProto::kRespDone;
+        } else {
+          lastStatus = BootProto::kRespInvalidFormat;
+        }
+#ifdef BOOTLOADER_PROFILE
+      } else if (lastCommand == BootProto::kCmdStats) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(1), 1)) {
+          uint8_t reset = i2cPacket.read<uint8_t>();
+          blockPacket.reset();
+          put_stats(blockPacket);
+          if (reset) {
+            Profile::reset();
+          }
+        }
+#endif
+      } else if (lastCommand == BootProto::kCmdRamRun) {
+        if (!i2c.read((char*)i2cPacket.ptrPutBytes(12), 12)) {
+          uint32_t offset = i2cPacket.read<uint32_t>();
+          uint32_t length = i2cPacket.read<uint32_t>();
+          uint32_t crc = i2cPacket.read<uint32_t>();
+          lastStatus = ram_run(offset, length, crc);
+        }
       } else if (lastCommand == BootProto::kCmdRunApp) {
         if (!i2c.read((char*)i2cPacket.ptrPutBytes(4), 4)) {
           uint32_t addr = i2cPacket.read<uint32_t>();
-          bootloader.run_app(addr);
+          start_app(addr);
         }
       } else {
         // Drop everything else
@@ -460,25 +1460,70 @@ int bootloaderSlaveInit() {
 
 int main() {
   bootOutPin = 0;
+  BootInfo::Info* info = BootInfo::get();
+  BootInfo::init(info, 0);
+  info->main_us = us_ticker_read();
+
+  WarmEntry::Request warm;
+  bool warmEntry = WarmEntry::take(&warm);
+  if (warmEntry) {
+    info->flags |= BootInfo::kFlagWarmEntry;
+  } else {
+    warm.baud = 0;
+    warm.device = WarmEntry::kDeviceAuto;
+    warm.flags = 0;
+  }
+
+#ifdef BOOTLOADER_PROFILE
+  Profile::init();
+#endif
 
-  wait_ms(BootProto::kBootscanDelayMs);  // wait for some time to let boot in stabilize
+#ifdef BOOTLOADER_FLASH_IRQ
+  // Advance flash operations from the flash interrupt, so they don't wait on
+  // the main loop, and blocking commands sleep meanwhile. Opt in (scons
+  // FLASH_IRQ=1) until verified on hardware.
+  this_isp.set_interrupt_driven(true);
+#endif
 
-  usb_uart.baud(115200);
-  ext_uart.baud(115200);
+#ifndef TARGET_NUCLEO_L432KC
+  // Skip erasing blank pages, except on the L432, whose flash has ECC
+  bootloader.set_blank_check(true);
+#endif
+
+  if (warm.device == WarmEntry::kDeviceAuto) {
+    wait_ms(BootProto::kBootscanDelayMs);  // wait for some time to let boot in stabilize
+  }
+
+  uint32_t baud = warm.baud != 0 ? warm.baud : 115200;
+  usb_uart.baud(baud);
+  ext_uart.baud(baud);
 
   // floating or high means master mode
-  if (bootInPin == 1) {
-    wait_ms(5*BootProto::kBootscanDelayMs);
+  bool master = bootInPin == 1;
+  if (warm.device != WarmEntry::kDeviceAuto) {
+    master = warm.device == 0;
+  }
+  bool skipEnumeration = warm.flags & WarmEntry::kFlagSkipEnumeration;
+  boot_milestone(info->scan_us);
+  if (master) {
+    info->flags |= BootInfo::kFlagMaster;
+    if (!warmEntry) {
+      wait_ms(5*BootProto::kBootscanDelayMs);
+    }
 
     usb_uart.puts("\r\n\r\nBuilt " __DATE__ " " __TIME__ " (" __FILE__ "), master\r\n");
     ext_uart.puts("\r\n\r\nBuilt " __DATE__ " " __TIME__ " (" __FILE__ "), master\r\n");
 
-    return bootloaderMaster();
+    return bootloaderMaster(warmEntry, skipEnumeration);
   } else {
 
 	usb_uart.puts("\r\n\r\nBuilt " __DATE__ " " __TIME__ " (" __FILE__ "), slave\r\n");
 	ext_uart.puts("\r\n\r\nBuilt " __DATE__ " " __TIME__ " (" __FILE__ "), slave\r\n");
 
-    return bootloaderSlaveInit();
+    uint8_t address = BootProto::kAddressGlobal;
+    if (skipEnumeration && warm.device != WarmEntry::kDeviceAuto) {
+      address = BootProto::GetDeviceAddr(warm.device - 1);
+    }
+    return bootloaderSlaveInit(address);
   }
 }
@@ -62,25 +62,25 @@ bool MemoryPacketBuilder::put_float(float data) {
 }
 
 template<> uint8_t PacketReader::read<uint8_t>() {
-  uint8_t out;
+  uint8_t out = 0;
   read_uint8(&out);
   return out;
 }
 
 template<> uint16_t PacketReader::read<uint16_t>() {
-  uint16_t out;
+  uint16_t out = 0;
   read_uint16(&out);
   return out;
 }
 
 template<> uint32_t PacketReader::read<uint32_t>() {
-  uint32_t out;
+  uint32_t out = 0;
   read_uint32(&out);
   return out;
 }
 
 template<> float PacketReader::read<float>() {
-  float out;
+  float out = 0;
   read_float(&out);
   return out;
 }
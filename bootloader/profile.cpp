@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include "mbed.h"
+
+#include "profile.h"
+
+#ifdef BOOTLOADER_PROFILE
+
+#ifdef TARGET_NATIVE
+#include <time.h>
+#endif
+
+namespace Profile {
+  StageStats stats[kNumStages];
+
+  void init() {
+#ifndef TARGET_NATIVE
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+    reset();
+  }
+
+  uint32_t now() {
+#ifdef TARGET_NATIVE
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return DWT->CYCCNT;
+#endif
+  }
+
+  uint32_t get_frequency() {
+#ifdef TARGET_NATIVE
+    return 1000000000;
+#else
+    return SystemCoreClock;
+#endif
+  }
+
+  void record(Stage stage, uint32_t ticks) {
+    StageStats& stageStats = stats[stage];
+    if (stageStats.count == 0 || ticks < stageStats.min) {
+      stageStats.min = ticks;
+    }
+    if (ticks > stageStats.max) {
+      stageStats.max = ticks;
+    }
+    stageStats.sum += ticks;
+    stageStats.count++;
+  }
+
+  const StageStats& get_stats(Stage stage) {
+    return stats[stage];
+  }
+
+  void reset() {
+    memset(stats, 0, sizeof(stats));
+  }
+}
+
+#endif
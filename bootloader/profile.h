@@ -0,0 +1,83 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Cycle counter profiling of bootloader stages, using the Cortex-M4 DWT cycle
+ * counter (or a nanosecond clock on native builds).
+ *
+ * Only built with BOOTLOADER_PROFILE (scons PROFILE=1), otherwise
+ * PROFILE_SCOPE compiles to nothing and the stats command is unsupported.
+ */
+#ifdef BOOTLOADER_PROFILE
+
+namespace Profile {
+  // Keep in sync with STAGE_NAMES in host/duckyboot.py.
+  enum Stage {
+    kStageDecode,  // host framing decode, per received byte
+    kStageCrc,  // CRC32::compute_crc and update_crc
+    kStageFlash,  // ISP erase or write, from issue until complete
+    kStageI2C,  // master I2C transfers to slaves, including result polling
+    kStageCommand,  // master command processing, from decoded to response
+    kNumStages
+  };
+
+  // Accumulated durations of a stage, in counter ticks.
+  struct StageStats {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+  };
+
+  // Serialized length of the stats, as sent over I2C: uint32 tick frequency,
+  // then for each stage uint32 count, min, max, sum high, sum low.
+  const size_t kStatsLength = 4 + kNumStages * 20;
+
+  /**
+   * Starts the cycle counter. Call once at startup.
+   */
+  void init();
+
+  /**
+   * Returns the current counter value, which wraps.
+   */
+  uint32_t now();
+
+  /**
+   * Returns the counter frequency in Hz.
+   */
+  uint32_t get_frequency();
+
+  void record(Stage stage, uint32_t ticks);
+  const StageStats& get_stats(Stage stage);
+  void reset();
+
+  /**
+   * Records the time from construction to destruction as a stage.
+   */
+  class Scope {
+  public:
+    Scope(Stage stage) : stage(stage), start(now()) {
+    }
+    ~Scope() {
+      record(stage, now() - start);
+    }
+
+  protected:
+    Stage stage;
+    uint32_t start;
+  };
+}
+
+#define PROFILE_SCOPE(stage) Profile::Scope profileScope(Profile::stage)
+
+#else
+
+#define PROFILE_SCOPE(stage)
+
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * services.cpp
+ *
+ * Flash services table exported to the application (see services.h). These
+ * run from the application, so must not use the bootloader's RAM: ISP state
+ * lives in the caller's context, and everything else is constants.
+ */
+
+#if defined(TARGET_NUCLEO_F303K8) || defined(TARGET_NUCLEO_L432KC)
+
+#include <new>
+
+#include "mbed.h"
+
+#include "crc.h"
+#include "image.h"
+#include "isp.h"
+#include "services.h"
+
+extern char _AppStart, _AppEnd, _BootloaderDataStart[], _BootloaderDataEnd[];
+
+namespace {
+  // Fails to compile if an ISP doesn't fit in a context.
+  typedef char ContextFits[sizeof(ISP) <= Services::kContextSize ? 1 : -1];
+
+  ISP* get_isp(void* context) {
+    return (ISP*)context;
+  }
+
+  bool in_app(uint32_t addr, size_t length) {
+    uint32_t start = (uint32_t)&_AppStart, end = (uint32_t)&_AppEnd;
+    return addr >= start && addr <= end && length <= end - addr;
+  }
+
+  // App slots, as the bootloader splits the app region (see image.h)
+  size_t get_slot_count() {
+    return Image::slot_count(_BootloaderDataEnd - _BootloaderDataStart, ISP::kEraseSize);
+  }
+
+  size_t get_slot_length() {
+    return Image::slot_length(&_AppEnd - &_AppStart, ISP::kEraseSize, get_slot_count());
+  }
+
+  const Image::Header* get_header(size_t slot) {
+    return Image::slot_header((const uint8_t*)_BootloaderDataStart, ISP::kEraseSize, slot);
+  }
+
+  /**
+   * Invalidates the image headers of the slots overlapping length bytes of the
+   * app region at addr, before they change, like the bootloader's erase
+   * command. Blocking, returning a Status. Headers which are already
+   * invalidated aren't rewritten, so this only writes on the first change.
+   */
+  uint8_t invalidate(ISP* isp, uint32_t addr, size_t length) {
+    if (length == 0) {
+      return Services::kOk;
+    }
+    uint32_t start = (uint32_t)&_AppStart;
+    size_t slot_length = get_slot_length();
+    for (size_t slot = (addr - start) / slot_length;
+        slot <= (addr + length - 1 - start) / slot_length && slot < get_slot_count(); slot++) {
+      const Image::Header* header = get_header(slot);
+      if (header->magic == Image::kMagic && header->valid != 0) {
+        uint32_t invalid[2] = {0, 0};
+        uint8_t status = isp->write((void*)&header->valid, invalid, sizeof(invalid));
+        if (status != Services::kOk) {
+          return status;
+        }
+      }
+    }
+    return Services::kOk;
+  }
+
+  bool is_busy(ISP* isp) {
+    ISPBase::ISPStatus status;
+    return !isp->get_last_async_status(&status);
+  }
+
+  bool begin(void* context) {
+    ISP* isp = new (context) ISP();
+    return isp->isp_begin();
+  }
+
+  bool end(void* context) {
+    return get_isp(context)->isp_end();
+  }
+
+  bool async_erase(void* context, uint32_t addr, size_t length) {
+    ISP* isp = get_isp(context);
+    if (is_busy(isp)) {
+      return false;
+    }
+    if (!in_app(addr, length)) {
+      addr = 0;  // outside flash, so the ISP reports kISPInvalidArgs
+    } else if (invalidate(isp, addr, length) != Services::kOk) {
+      addr = 0;  // fail without changing the app
+    }
+    return isp->async_erase((void*)addr, length);
+  }
+
+  bool async_write(void* context, uint32_t addr, const void* data, size_t length) {
+    ISP* isp = get_isp(context);
+    if (is_busy(isp)) {
+      return false;
+    }
+    if (!in_app(addr, length)) {
+      addr = 0;
+    } else if (invalidate(isp, addr, length) != Services::kOk) {
+      addr = 0;
+    }
+    return isp->async_write((void*)addr, (void*)data, length);
+  }
+
+  bool async_update(void* context) {
+    return get_isp(context)->async_update();
+  }
+
+  bool get_status(void* context, uint8_t* status) {
+    ISPBase::ISPStatus ispStatus;
+    bool done = get_isp(context)->get_last_async_status(&ispStatus);
+    *status = ispStatus;
+    return done;
+  }
+
+  uint8_t erase(void* context, uint32_t addr, size_t length) {
+    if (!in_app(addr, length)) {
+      return Services::kInvalidArgs;
+    }
+    uint8_t status = invalidate(get_isp(context), addr, length);
+    if (status != Services::kOk) {
+      return status;
+    }
+    return get_isp(context)->erase((void*)addr, length);
+  }
+
+  uint8_t write(void* context, uint32_t addr, const void* data, size_t length) {
+    if (!in_app(addr, length)) {
+      return Services::kInvalidArgs;
+    }
+    uint8_t status = invalidate(get_isp(context), addr, length);
+    if (status != Services::kOk) {
+      return status;
+    }
+    return get_isp(context)->write((void*)addr, (void*)data, length);
+  }
+
+  uint32_t crc(const void* data, size_t length) {
+    return CRC32::compute_crc_unprofiled((const uint8_t*)data, length);
+  }
+
+  bool verify(uint32_t addr, size_t length, uint32_t expected_crc) {
+    return crc((const void*)addr, length) == expected_crc;
+  }
+
+  uint8_t validate(void* context, uint32_t addr, size_t length, uint32_t image_crc,
+      uint32_t version) {
+    size_t slot_length = get_slot_length();
+    uint32_t offset = addr - (uint32_t)&_AppStart;
+    if (!in_app(addr, length) || offset % slot_length != 0 || length > slot_length
+        || offset / slot_length >= get_slot_count()) {
+      return Services::kInvalidArgs;
+    }
+    ISP* isp = get_isp(context);
+    uint8_t* header_addr = (uint8_t*)get_header(offset / slot_length);
+
+    // Like the bootloader's header command: rewrite the header, then record
+    // whether the image matches it
+    Image::Header header;
+    header.magic = Image::kMagic;
+    header.length = length;
+    header.crc = image_crc;
+    header.version = version;
+    uint8_t status = isp->erase(header_addr, ISP::kEraseSize);
+    if (status == Services::kOk) {
+      status = isp->write(header_addr, &header, Image::kHeaderWriteLength);
+    }
+    if (status != Services::kOk) {
+      return status;
+    }
+    bool valid = crc((const void*)addr, length) == image_crc;
+    header.valid = valid ? Image::kValid : 0;
+    header.valid_pad = valid ? 0xffffffff : 0;
+    status = isp->write(header_addr + Image::kHeaderWriteLength, &header.valid, 8);
+    if (status != Services::kOk) {
+      return status;
+    }
+    return valid ? Services::kOk : Services::kInvalidChecksum;
+  }
+}
+
+// Placed at _BootloaderServices by the linker script.
+extern "C" const Services::Table bootloader_services
+    __attribute__((section(".bootloader_services"), used)) = {
+  Services::kMagic,
+  Services::kVersion,
+  sizeof(Services::Table),
+  (uint32_t)&_AppStart,
+  (uint32_t)&_AppEnd,
+  ISP::kEraseSize,
+  ISP::kWriteSize,
+  begin,
+  end,
+  async_erase,
+  async_write,
+  async_update,
+  get_status,
+  erase,
+  write,
+  crc,
+  verify,
+  validate,
+};
+
+#endif
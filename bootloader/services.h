@@ -0,0 +1,128 @@
+#ifndef SERVICES_H_
+#define SERVICES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Flash services the bootloader exports to the application, as a table of
+ * function pointers at a fixed offset (kTableOffset) from the bootloader's
+ * vector table. Both linker scripts define _BootloaderServices there, so the
+ * application can use the bootloader's ISP instead of linking its own flash
+ * driver, like:
+ *   const Services::Table* services = Services::get();
+ *   if (services != NULL) {
+ *     uint8_t context[Services::kContextSize];
+ *     services->begin(context);
+ *     services->erase(context, addr, length);
+ *     services->end(context);
+ *   }
+ *
+ * Services run on the caller's stack and keep their state in the caller's
+ * context buffer, since the application owns RAM. Erase and write are limited
+ * to the app region. The first erase or write into a slot invalidates its
+ * image header (see image.h), so a self update which is interrupted doesn't
+ * boot a half written image. Once the new image is complete, the application
+ * validates it with validate(), which rewrites the header like the host's
+ * header command.
+ */
+namespace Services {
+  const uint32_t kMagic = 0x56524553;  // "SERV"
+  // Incremented when functions are added, which are only ever appended.
+  const uint16_t kVersion = 2;
+
+  // Offset of the table from the bootloader's vector table, past its end.
+  const uint32_t kTableOffset = 0x200;
+
+  // Bytes of caller storage needed for a context, larger than any ISP.
+  const size_t kContextSize = 64;
+
+  // Operation status, the values of ISPBase::ISPStatus
+  enum Status {
+    kOk = 0x00,
+    kInvalidArgs = 0x10,
+    kFlashError,
+    kInvalidChecksum = 0x20  // validate() only, the image didn't match its CRC
+  };
+
+  struct Table {
+    uint32_t magic;  // kMagic
+    uint16_t version;  // kVersion of the bootloader
+    uint16_t length;  // sizeof(Table) of that version
+
+    uint32_t app_start;  // address of the app region
+    uint32_t app_end;  // address past the end of the app region
+    uint32_t erase_size;  // erase and write alignment, as in ISPBase
+    uint32_t write_size;
+
+    /**
+     * Initializes a context of kContextSize bytes, aligned to 4, and unlocks
+     * the flash. Returns false on failure.
+     */
+    bool (*begin)(void* context);
+
+    /**
+     * Re-locks the flash, after any operation has finished.
+     */
+    bool (*end)(void* context);
+
+    /**
+     * Starts an erase or write, like ISPBase. Returns false if an operation is
+     * already running. The data must not change until it finishes.
+     */
+    bool (*async_erase)(void* context, uint32_t addr, size_t length);
+    bool (*async_write)(void* context, uint32_t addr, const void* data, size_t length);
+
+    /**
+     * Advances the running operation, returns true while it's busy.
+     */
+    bool (*async_update)(void* context);
+
+    /**
+     * Returns true if the last operation finished, with its Status in status.
+     */
+    bool (*get_status)(void* context, uint8_t* status);
+
+    /**
+     * Blocking erase and write, returning a Status.
+     */
+    uint8_t (*erase)(void* context, uint32_t addr, size_t length);
+    uint8_t (*write)(void* context, uint32_t addr, const void* data, size_t length);
+
+    /**
+     * Returns the CRC32 of the data, as used by the bootloader protocol.
+     */
+    uint32_t (*crc)(const void* data, size_t length);
+
+    /**
+     * Returns whether the CRC32 of length bytes of flash at addr matches.
+     */
+    bool (*verify)(uint32_t addr, size_t length, uint32_t crc);
+
+    /**
+     * Rewrites the image header of the slot starting at addr, for an image of
+     * length bytes with the CRC and app defined version, then checks the image
+     * and records the result, so the slot boots again. Blocking, returning a
+     * Status. Version 2.
+     */
+    uint8_t (*validate)(void* context, uint32_t addr, size_t length, uint32_t crc,
+        uint32_t version);
+  };
+
+  // Linker symbol, declared as the Table it holds.
+  extern "C" const Table _BootloaderServices;
+
+  /**
+   * Returns the bootloader's services, or NULL if this bootloader doesn't
+   * export them.
+   */
+  inline const Table* get() {
+    const Table* table = &_BootloaderServices;
+    if (table->magic != kMagic || table->length < sizeof(Table)) {
+      return NULL;
+    }
+    return table;
+  }
+}
+
+#endif
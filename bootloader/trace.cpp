@@ -0,0 +1,32 @@
+#include "mbed.h"
+#ifndef TARGET_NATIVE
+#include "us_ticker_api.h"
+#endif
+
+#include "trace.h"
+
+namespace Trace {
+  Record records[kLength];
+  uint32_t total = 0;
+
+  void record(Event event, uint8_t arg8, uint16_t arg16) {
+    Record& entry = records[total % kLength];
+    entry.time_us = us_ticker_read();
+    entry.event = event;
+    entry.arg8 = arg8;
+    entry.arg16 = arg16;
+    total++;
+  }
+
+  uint32_t get_total() {
+    return total;
+  }
+
+  size_t get_count() {
+    return total < kLength ? total : kLength;
+  }
+
+  const Record& get(size_t i) {
+    return records[(total - get_count() + i) % kLength];
+  }
+}
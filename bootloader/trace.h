@@ -0,0 +1,65 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Ring buffer of timestamped protocol events, for finding where an update
+ * stalled or spent its time. Always built in; recording is a few stores.
+ *
+ * Timestamps are the device's microsecond ticker, so they are only comparable
+ * between events of the same device.
+ */
+namespace Trace {
+  // Keep in sync with EVENT_NAMES in host/tracedump.py.
+  enum Event {
+    kEventCommand,  // command received, arg8 = opcode or BootCommand, arg16 = payload length
+    kEventResponse,  // master responded to the host, arg8 = RespStatus
+    kEventFrameError,  // host frame discarded, arg8 = COBSResult
+    kEventCrcFail,  // received data failed its CRC, arg16 = length
+    kEventI2CNack,  // slave didn't acknowledge, arg8 = device
+    kEventStatusPolls,  // slave result ready, arg8 = device, arg16 = number of polls
+    kEventFlashStart,  // ISP operation issued, arg8 = kCmdErase (arg16 = pages)
+                       // or kCmdWrite (arg16 = bytes)
+    kEventFlashEnd,  // ISP operation completed, arg8 = ISPStatus
+    kEventVerifyFail,  // flash CRC mismatch, arg16 = length
+  };
+
+  struct Record {
+    uint32_t time_us;
+    uint8_t event;
+    uint8_t arg8;
+    uint16_t arg16;
+  };
+
+  const size_t kLength = 64;  // records kept, 8 bytes each
+
+  // Records per kCmdTrace / 'T' dump page, keeping I2C transfers short.
+  const size_t kPageLength = 16;
+  // Serialized length of a page: uint32 total events recorded, uint8 records
+  // in the page, then each record as uint32 time, uint8 event, uint8 arg8,
+  // uint16 arg16.
+  const size_t kMaxPageBytes = 5 + kPageLength * 8;
+
+  void record(Event event, uint8_t arg8=0, uint16_t arg16=0);
+
+  /**
+   * Returns the number of events recorded since startup, including those
+   * which were overwritten.
+   */
+  uint32_t get_total();
+
+  /**
+   * Returns the number of records in the ring, at most kLength.
+   */
+  size_t get_count();
+
+  /**
+   * Returns the i-th oldest record in the ring, i must be less than
+   * get_count().
+   */
+  const Record& get(size_t i);
+}
+
+#endif
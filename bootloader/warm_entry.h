@@ -0,0 +1,88 @@
+#ifndef WARM_ENTRY_H_
+#define WARM_ENTRY_H_
+
+#include <stdint.h>
+
+/**
+ * Warm entry into the bootloader from the application: the application writes
+ * a request into the RAM region reserved after BootInfo (_WarmEntry, not
+ * initialized by either C runtime) and resets, like:
+ *   WarmEntry::request(115200, WarmEntry::kDeviceAuto, 0);
+ *   NVIC_SystemReset();
+ * The bootloader then stays in update mode regardless of the run app pin,
+ * skips the boot scan delays and uses the requested settings. The request is
+ * cleared when the bootloader takes it, so it only applies to one reset.
+ */
+namespace WarmEntry {
+  const uint32_t kMagic = 0x4d524157;  // "WARM"
+
+  // Device number to run as: 0 for the master, otherwise the slave at that
+  // position in the chain (using BootProto::GetDeviceAddr(device - 1)).
+  // kDeviceAuto decides from BOOT_IN, as on a cold boot.
+  const uint8_t kDeviceAuto = 0xff;
+
+  enum Flags {
+    // Master: don't scan for slaves, for example when they were already
+    // addressed. Slave (only with a device number): take its address
+    // directly, instead of waiting for BOOT_IN and the master's enumeration.
+    // As usual, the previous device must then keep BOOT_IN high.
+    kFlagSkipEnumeration = 0x01,
+  };
+
+  struct Request {
+    uint32_t magic;  // kMagic when requested
+    uint32_t baud;  // UART baud rate, or 0 for the default
+    uint8_t device;  // device number, or kDeviceAuto
+    uint8_t flags;  // Flags
+    uint16_t reserved;
+    uint32_t check;  // check_value() of the above, against random RAM at power on
+  };
+
+  // Linker symbol, declared as the Request it holds.
+  extern "C" Request _WarmEntry;
+
+  inline Request* get() {
+    return &_WarmEntry;
+  }
+
+  inline uint32_t check_value(const Request* request) {
+    return ~(request->magic ^ request->baud
+        ^ ((uint32_t)request->device << 8) ^ request->flags);
+  }
+
+  /**
+   * Returns whether a warm entry was requested.
+   */
+  inline bool is_requested() {
+    const Request* request = get();
+    return request->magic == kMagic && request->check == check_value(request);
+  }
+
+  /**
+   * Requests a warm entry on the next reset, called by the application.
+   */
+  inline void request(uint32_t baud, uint8_t device, uint8_t flags) {
+    Request* request = get();
+    request->baud = baud;
+    request->device = device;
+    request->flags = flags;
+    request->reserved = 0;
+    request->magic = kMagic;
+    request->check = check_value(request);
+  }
+
+  /**
+   * If a warm entry was requested, copies the request into out, clears it and
+   * returns true. Called by the bootloader.
+   */
+  inline bool take(Request* out) {
+    if (!is_requested()) {
+      return false;
+    }
+    *out = *get();
+    get()->magic = 0;
+    return true;
+  }
+}
+
+#endif
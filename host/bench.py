@@ -0,0 +1,183 @@
+"""
+End-to-end programming benchmark. Sweeps chunk size, baud rate, device count
+and image size, programming random images onto a connected chain or onto the
+chain simulator (build/native/simulator), and records per-device erase, write
+and verify times, command round-trip latency percentiles, retries, and the
+flash programming mode used (rows fast programmed, from the boot info).
+
+Results are written as JSON, and compared against a baseline results file if
+given:
+  python bench.py --simulator ../build/native/simulator --output base.json
+  (change things)
+  python bench.py --simulator ../build/native/simulator --baseline base.json
+
+A connected chain runs at its firmware baud rate (115200), so sweeping baud
+needs the simulator, which overrides the device rate. Device counts must not
+exceed the length of a connected chain.
+"""
+
+import argparse
+import itertools
+import json
+import logging
+import random
+import re
+import subprocess
+import time
+
+from duckyboot import *
+
+def run_simulator(simulator, slaves, baud, target):
+  """Starts the chain simulator and returns (process, USB UART PTY path)."""
+  process = subprocess.Popen([simulator, '--slaves', str(slaves), '--baud', str(baud),
+                              '--target', target],
+                             stdout=subprocess.PIPE, universal_newlines=True)
+  while True:
+    line = process.stdout.readline()
+    if not line:
+      raise RuntimeError("Simulator exited before opening its UARTs")
+    match = re.match(r'USB UART: (\S+)', line)
+    if match:
+      return process, match.group(1)
+
+def run(args, chunk_size, baud, devices, image_size):
+  """Programs all devices with random images of image_size bytes, returning a
+  dict describing the run and each device's results.
+  """
+  import serial
+
+  rand = random.Random(args.seed)
+  if args.simulator:
+    process, port = run_simulator(args.simulator, devices - 1, baud, args.target)
+  else:
+    process, port = None, args.serial
+
+  try:
+    ser = serial.Serial(port, baud, timeout=args.timeout)
+    time.sleep(args.settle)  # let the chain enumerate
+    bootloader = BootloaderComms(ser, progress=False)
+    if args.zpe and not bootloader.set_framing(FRAMING_ZPE):
+      logging.warning("Bootloader doesn't support DuckyZPE framing, using DuckyCOBS")
+
+    results = []
+    for device in range(devices):
+      # Mostly compressible, like real firmware images with padding and tables
+      image = bytearray(rand.randint(0, 255) if rand.random() < 0.5 else 0xff
+                        for _ in range(image_size))
+      logging.info("chunk %i, baud %i, devices %i, image %i: device %i",
+                   chunk_size, baud, devices, image_size, device)
+      stats = bootloader.program_bytes(device, bytes(image), args.compress, chunk_size)
+      latencies = stats.pop('latencies_s')
+      stats['device'] = device
+      stats['write_kib_s'] = image_size / 1024.0 / stats['write_s']
+      for p in [50, 90, 99]:
+        stats['latency_p%i_ms' % p] = percentile(latencies, p) * 1000
+      # Since the device's reset, None if its bootloader doesn't report it
+      stats['fast_rows'] = bootloader.boot_info(device).get('fast_rows')
+      results.append(stats)
+    ser.close()
+  finally:
+    if process:
+      process.terminate()
+      process.wait()
+
+  return {
+    'chunk_size': chunk_size,
+    'baud': baud,
+    'devices': devices,
+    'image_size': image_size,
+    'compress': args.compress,
+    'zpe': args.zpe,
+    'results': results,
+  }
+
+def run_key(run):
+  return (run['chunk_size'], run['baud'], run['devices'], run['image_size'],
+          run['compress'], run['zpe'])
+
+def summarize(run):
+  """Returns run totals over all devices: erase and write times, worst p99 latency,
+  retries and fast programmed rows.
+  """
+  results = run['results']
+  return {
+    'erase_s': sum([result['erase_s'] for result in results]),
+    'write_s': sum([result['write_s'] for result in results]),
+    'latency_p99_ms': max([result['latency_p99_ms'] for result in results]),
+    'retries': sum([result['retries'] for result in results]),
+    'fast_rows': sum([result.get('fast_rows') or 0 for result in results]),
+  }
+
+def print_comparison(runs, baseline_runs):
+  baseline = dict([(run_key(run), summarize(run)) for run in baseline_runs])
+  print("%6s %7s %4s %7s  %-28s %-28s %-28s %-10s %s"
+        % ("chunk", "baud", "devs", "image", "erase s (base, delta)",
+           "write s (base, delta)", "p99 ms (base, delta)", "retries", "fast rows"))
+  for run in runs:
+    current = summarize(run)
+    base = baseline.get(run_key(run))
+    columns = []
+    for field in ['erase_s', 'write_s', 'latency_p99_ms']:
+      if base is None:
+        columns.append("%8.3f" % current[field])
+      else:
+        change = (current[field] - base[field]) / base[field] * 100 if base[field] else 0
+        columns.append("%8.3f (%8.3f, %+6.1f%%)" % (current[field], base[field], change))
+    retries = "%i" % current['retries']
+    fast_rows = "%i" % current['fast_rows']
+    if base is not None:
+      retries += " (%i)" % base['retries']
+      fast_rows += " (%i)" % base.get('fast_rows', 0)
+    print("%6i %7i %4i %7i  %-28s %-28s %-28s %-10s %s"
+          % (run['chunk_size'], run['baud'], run['devices'], run['image_size'],
+             columns[0], columns[1], columns[2], retries, fast_rows))
+
+if __name__ == '__main__':
+  logging.basicConfig(format='%(asctime)s %(levelname)s: %(message)s', datefmt='%H:%M:%S', level=logging.WARNING)
+
+  parser = argparse.ArgumentParser(description='Bootloader programming benchmark')
+  target = parser.add_mutually_exclusive_group(required=True)
+  target.add_argument('--serial', type=str,
+                      help='serial port of a connected chain')
+  target.add_argument('--simulator', type=str,
+                      help='path to the chain simulator, started fresh for each run')
+  parser.add_argument('--target', type=str, default='f303k8',
+                      help='simulated device flash model, f303k8 or l432kc')
+  parser.add_argument('--chunk-sizes', type=int, nargs='+', default=[CHUNK_SIZE],
+                      help='write chunk sizes to sweep')
+  parser.add_argument('--bauds', type=int, nargs='+', default=[115200],
+                      help='baud rates to sweep')
+  parser.add_argument('--devices', type=int, nargs='+', default=[1],
+                      help='device counts to sweep, programming devices 0 to N-1')
+  parser.add_argument('--image-sizes', type=int, nargs='+', default=[16384],
+                      help='image sizes to sweep, in bytes')
+  parser.add_argument('--compress', action='store_true',
+                      help='send DuckyLZ compressed data')
+  parser.add_argument('--zpe', action='store_true',
+                      help='use DuckyZPE framing')
+  parser.add_argument('--seed', type=int, default=0,
+                      help='random image seed')
+  parser.add_argument('--settle', type=float, default=1.0,
+                      help='time to wait for the chain to start, in seconds')
+  parser.add_argument('--timeout', type=float, default=1.0,
+                      help='serial reply timeout, in seconds')
+  parser.add_argument('--output', type=str,
+                      help='file to write JSON results to')
+  parser.add_argument('--baseline', type=str,
+                      help='JSON results file to compare against')
+  args = parser.parse_args()
+
+  runs = []
+  for chunk_size, baud, devices, image_size in itertools.product(
+      args.chunk_sizes, args.bauds, args.devices, args.image_sizes):
+    runs.append(run(args, chunk_size, baud, devices, image_size))
+
+  if args.output:
+    with open(args.output, 'w') as output:
+      json.dump({'runs': runs}, output, indent=2)
+
+  baseline_runs = []
+  if args.baseline:
+    with open(args.baseline) as baseline:
+      baseline_runs = json.load(baseline)['runs']
+  print_comparison(runs, baseline_runs)
@@ -0,0 +1,498 @@
+"""
+Host side of the bootloader serial protocol: commands are DuckyPacket payloads
+framed with DuckyCOBS (or DuckyZPE, once selected), and the master replies to
+each with a single status line ('D' for done). The master replies to slave
+writes and erases once they are sent, so their failures are reported on a
+later command, see program_pages.
+Used by host.py (command line programming) and bench.py (benchmarks).
+"""
+
+import binascii
+import logging
+import sys
+import time
+
+from duckycobs import *
+from duckylz import *
+from duckyzpe import *
+from duckypacket import *
+
+CHUNK_SIZE = 128  # any size, the bootloader combines partial write units
+ERASE_SIZE = 2048
+MAX_DECOMPRESSED_SIZE = 1024  # device decompression buffer size
+
+FRAMING_COBS = 0
+FRAMING_ZPE = 1
+
+# Profiled stages, in the order of Profile::Stage in bootloader/profile.h
+STAGE_NAMES = ['decode', 'crc', 'flash', 'i2c', 'command']
+
+TRACE_PAGE_LENGTH = 16  # records per 'T' page, Trace::kPageLength
+
+# Boot info fields after the magic, in the order of BootInfo::Info in
+# bootloader/boot_info.h. Milestones are in device microseconds, and
+# BOOT_NOT_REACHED if not (yet) reached.
+BOOT_INFO_FIELDS = ['version', 'length', 'flags',
+                    'main_us', 'scan_us', 'enumerated_us', 'first_command_us',
+                    'app_jump_us', 'update_start_us', 'update_end_us',
+                    'received_bytes', 'erased_bytes', 'written_bytes',
+                    'blank_bytes', 'fast_rows']
+BOOT_NOT_REACHED = 0xffffffff
+BOOT_FLAG_EARLY_BOOT = 0x01
+BOOT_FLAG_MASTER = 0x02
+BOOT_FLAG_WARM_ENTRY = 0x04
+
+# App slots, see bootloader/image.h
+NO_SLOT = 0xffffffff  # boot slot when no slot holds a valid image
+
+# Time for a warm entry from the app, including enumerating a chain, in seconds
+WARM_ENTRY_DELAY = 0.5
+
+def pbar(curr, max, sym='=', space=' ', arrow='>', nsyms=32):
+  assert curr <= max
+  if curr == 0:
+    combined = space * nsyms
+  elif curr == max:
+    combined = sym * nsyms
+  else:
+    syms = int(curr * nsyms / max)
+    if syms > 0:
+      combined = (syms-1) * sym + arrow + (nsyms - syms) * space
+    else:
+      combined = arrow + (nsyms-1) * space
+
+  return "[{0}] {1}/{2}".format(combined, curr, max)
+
+def percentile(values, p):
+  """Returns the p-th percentile (0-100) of values by the nearest-rank method,
+  or None if values is empty.
+  """
+  if not values:
+    return None
+  ordered = sorted(values)
+  rank = max(1, int(-(-p * len(ordered) // 100)))  # ceil(p/100 * n)
+  return ordered[min(rank, len(ordered)) - 1]
+
+# General exception when the bootloader returns a non-success error code.
+class BootloaderResponseError(Exception):
+  pass
+
+class BootloaderComms(object):
+  def __init__(self, ser, retries=3, progress=True):
+    self.serial = ser
+    self.serial.write(b'\x00')
+    self.retries = retries
+    self.progress = progress  # draw progress bars on stdout
+    self.encode = cobs_encode
+
+    # Statistics, see reset_stats()
+    self.latencies = []
+    self.retry_count = 0
+
+  def reset_stats(self):
+    """Clears the round-trip latencies (in seconds) of commands which got a
+    reply, and the count of retried commands and pages.
+    """
+    self.latencies = []
+    self.retry_count = 0
+
+  def set_framing(self, framing):
+    """Switches to the specified framing, returning False (and staying with the
+    current framing) if the bootloader doesn't support it.
+    """
+    packet = PacketBuilder()
+    packet.put_uint8(ord('M'))
+    packet.put_uint8(framing)
+    try:
+      self.command(packet, "Set framing %i" % framing)
+    except BootloaderResponseError:
+      return False
+    self.encode = zpe_encode if framing == FRAMING_ZPE else cobs_encode
+    self.serial.write(b'\x00')
+    return True
+
+  def command(self, packet, debug_text="", reply_expected=True, data_lines=None,
+              retries=None):
+    """Sends a command and checks its response. If data_lines is a list, lines
+    of data the bootloader sends before the (single character) response are
+    appended to it. Retries up to retries times, by default self.retries.
+    """
+    if retries is None:
+      retries = self.retries
+    retry = 0
+    while retry <= retries:
+      if retry > 0:
+        logging.error("Retrying command (try %i of max %i): %s", retry, retries, debug_text)
+        self.retry_count += 1
+      start = time.time()
+      self.serial.write(self.encode(packet.get_bytes()) + b'\x00')
+      if reply_expected:
+        line = self.serial.readline().strip()
+        if data_lines is not None:
+          del data_lines[:]  # only keep lines from the last try
+          while len(line) > 1:
+            data_lines.append(line)
+            line = self.serial.readline().strip()
+        self.latencies.append(time.time() - start)
+        logging.debug("Serial <- '%s'", line)  # discard the ending space
+        if (line == b'D'):
+          return
+        else:
+          logging.error("Got response '%s' from bootloader", line)
+          retry += 1
+      else:
+        return
+    raise BootloaderResponseError("Hit max retries for command: %s" % (debug_text))
+
+  def erase(self, device, address, length):
+    packet = PacketBuilder()
+    packet.put_uint8(ord('E'))
+    packet.put_uint8(device)
+    packet.put_uint32(address)
+    packet.put_uint32(length)
+    self.command(packet, "Erase %i bytes @ +%08x" % (length, address))
+
+  def erase_app(self, device):
+    """Erases the device's whole app region (its target slot), returning the
+    time the device took in seconds. The master sends 'e' progress lines while
+    it erases, so this doesn't hit the serial timeout.
+    """
+    packet = PacketBuilder()
+    packet.put_uint8(ord('C'))
+    packet.put_uint8(device)
+    lines = []
+    self.command(packet, "Erase app", data_lines=lines)
+
+    fields = [line.split()[1:] for line in lines if line.startswith(b'c ')][0]
+    return int(fields[0], 16) / 1e6
+
+  def write(self, device, address, data):
+    """Writes data, without retrying: the master pipelines slave writes, so a
+    failure may be reported on a later command, see program_pages.
+    """
+    packet = PacketBuilder()
+    packet.put_uint8(ord('W'))
+    packet.put_uint8(device)
+    packet.put_uint32(address)
+    packet.put_uint32(binascii.crc32(data) & 0xffffffff)
+    packet.put_bytes(data, len(data))
+    self.command(packet, "Program %i bytes @ +%08x" % (len(data), address), retries=0)
+
+  def ram_write(self, device, offset, data):
+    packet = PacketBuilder()
+    packet.put_uint8(ord('R'))
+    packet.put_uint8(device)
+    packet.put_uint32(offset)
+    packet.put_uint32(binascii.crc32(data) & 0xffffffff)
+    packet.put_bytes(data, len(data))
+    self.command(packet, "Load %i bytes @ RAM +%08x" % (len(data), offset))
+
+  def ram_run(self, device, offset, length, crc):
+    packet = PacketBuilder()
+    packet.put_uint8(ord('X'))
+    packet.put_uint8(device)
+    packet.put_uint32(offset)
+    packet.put_uint32(length)
+    packet.put_uint32(crc)
+    self.command(packet, "Run RAM image @ +%08x" % offset, reply_expected=False)
+
+  def write_compressed(self, device, address, data, compressed):
+    """Writes DuckyLZ compressed data, without retrying, as write."""
+    packet = PacketBuilder()
+    packet.put_uint8(ord('Z'))
+    packet.put_uint8(device)
+    packet.put_uint32(address)
+    packet.put_uint32(binascii.crc32(data) & 0xffffffff)
+    packet.put_uint16(len(data))
+    packet.put_bytes(compressed, len(compressed))
+    self.command(packet, "Program %i bytes (%i compressed) @ +%08x"
+                 % (len(data), len(compressed), address), retries=0)
+
+  def flush(self, device, retries=None):
+    packet = PacketBuilder()
+    packet.put_uint8(ord('F'))
+    packet.put_uint8(device)
+    self.command(packet, "Flush", retries=retries)
+
+  def verify(self, device, address, length, crc):
+    packet = PacketBuilder()
+    packet.put_uint8(ord('V'))
+    packet.put_uint8(device)
+    packet.put_uint32(address)
+    packet.put_uint32(length)
+    packet.put_uint32(crc)
+    self.command(packet, "Verify %i bytes @ +%08x" % (length, address))
+
+  def header(self, device, length, crc, version=0):
+    """Writes the image header, which the bootloader checks against the image
+    before it will run it. Must be sent after the image is written.
+    """
+    packet = PacketBuilder()
+    packet.put_uint8(ord('H'))
+    packet.put_uint8(device)
+    packet.put_uint32(length)
+    packet.put_uint32(crc)
+    packet.put_uint32(version)
+    self.command(packet, "Header for %i bytes, CRC %08x, version %i" % (length, crc, version))
+
+  def stats(self, device, reset=False):
+    """Returns the device's profiled stage timings, as a list of dicts with the
+    stage name, count, and min, max and mean durations in microseconds. Only
+    supported by bootloaders built with profiling (scons PROFILE=1).
+    """
+    packet = PacketBuilder()
+    packet.put_uint8(ord('S'))
+    packet.put_uint8(device)
+    packet.put_uint8(1 if reset else 0)
+    lines = []
+    self.command(packet, "Stats", data_lines=lines)
+
+    fields = [line.split()[1:] for line in lines if line.startswith(b's ')]
+    frequency = float(int(fields[0][0], 16)) / 1000000  # ticks per us
+    stages = []
+    for name, (count, min, max, sum) in zip(STAGE_NAMES, fields[1:]):
+      count = int(count, 16)
+      stages.append({
+        'stage': name,
+        'count': count,
+        'min_us': int(min, 16) / frequency,
+        'max_us': int(max, 16) / frequency,
+        'mean_us': int(sum, 16) / frequency / count if count else 0,
+      })
+    return stages
+
+  def trace(self, device):
+    """Returns the device's trace ring, oldest first, as a list of dicts with
+    the time (device microseconds, wrapping at 32 bits), event number and
+    arguments, and the total number of events the device has recorded.
+    """
+    records = []
+    total = 0
+    page = 0
+    while True:
+      packet = PacketBuilder()
+      packet.put_uint8(ord('T'))
+      packet.put_uint8(device)
+      packet.put_uint8(page)
+      lines = []
+      self.command(packet, "Trace page %i" % page, data_lines=lines)
+
+      fields = [line.split()[1:] for line in lines if line.startswith(b't ')]
+      total = int(fields[0][0], 16)
+      for time_us, event, arg8, arg16 in fields[1:]:
+        records.append({
+          'time_us': int(time_us, 16),
+          'event': int(event, 16),
+          'arg8': int(arg8, 16),
+          'arg16': int(arg16, 16),
+        })
+      if len(fields) - 1 < TRACE_PAGE_LENGTH:
+        return records, total
+      page += 1
+
+  def boot_info(self, device):
+    """Returns the device's boot milestone times and last update statistics,
+    as a dict keyed by BOOT_INFO_FIELDS. Fields newer than the device's
+    bootloader are missing.
+    """
+    packet = PacketBuilder()
+    packet.put_uint8(ord('B'))
+    packet.put_uint8(device)
+    lines = []
+    self.command(packet, "Boot info", data_lines=lines)
+
+    fields = [line.split()[1:] for line in lines if line.startswith(b'b ')][0]
+    info = dict(zip(BOOT_INFO_FIELDS, [int(field, 16) for field in fields]))
+    # Drop fields past the info's length, as read from an older slave. These
+    # are uint32s, after the uint32 magic and uint16 version and length.
+    for index, name in enumerate(BOOT_INFO_FIELDS[2:]):
+      if name in info and 8 + (index + 1) * 4 > info['length']:
+        del info[name]
+    return info
+
+  def slots(self, device):
+    """Returns the device's app slots as a dict with the slot count, the boot
+    slot (NO_SLOT if none) and the target slot that updates are written to.
+    """
+    packet = PacketBuilder()
+    packet.put_uint8(ord('Q'))
+    packet.put_uint8(device)
+    lines = []
+    self.command(packet, "Slots", data_lines=lines)
+
+    fields = [line.split()[1:] for line in lines if line.startswith(b'q ')][0]
+    return dict(zip(['count', 'boot', 'target'], [int(field, 16) for field in fields]))
+
+  def select_slot(self, device, slot):
+    """Selects the app slot to boot, which must hold a valid image."""
+    packet = PacketBuilder()
+    packet.put_uint8(ord('A'))
+    packet.put_uint8(device)
+    packet.put_uint8(slot)
+    self.command(packet, "Select slot %i" % slot)
+
+  def run_app(self, device, address):
+    packet = PacketBuilder()
+    packet.put_uint8(ord('J'))
+    packet.put_uint8(device)
+    packet.put_uint32(address)
+    self.command(packet, "Run app @ +%08x" % address, reply_expected=False)
+
+  def show_progress(self, curr, max):
+    if self.progress:
+      sys.stdout.write('\r' + pbar(curr, max))
+      sys.stdout.flush()
+
+  def end_progress(self):
+    if self.progress:
+      sys.stdout.write('\n')
+
+  @staticmethod
+  def compress_page(data, chunk_size=CHUNK_SIZE):
+    """Splits a page's data into blocks which each compress to at most
+    chunk_size bytes. Returns a list of (offset, length, compressed data).
+    """
+    blocks = []
+    offset = 0
+    while offset < len(data):
+      length = min(MAX_DECOMPRESSED_SIZE, len(data) - offset)
+      compressed = lz_compress(data[offset:offset+length])
+      while len(compressed) > chunk_size:
+        length = max(1, length // 2)
+        compressed = lz_compress(data[offset:offset+length])
+      blocks.append((offset, length, compressed))
+      offset += length
+    return blocks
+
+  def program_pages(self, device, program_bin, write_page):
+    """Writes the image a page at a time with write_page(page_address, page),
+    then flushes the page. The master pipelines slave writes, so a failure may
+    only be reported by a later command of the page, or the flush. If any
+    fails, the whole page is erased and rewritten.
+    """
+    for page_address in range(0, len(program_bin), ERASE_SIZE):
+      page = program_bin[page_address:page_address+ERASE_SIZE]
+
+      retry = 0
+      while True:
+        try:
+          write_page(page_address, page)
+          self.flush(device, retries=0)
+          break
+        except BootloaderResponseError:
+          retry += 1
+          if retry > self.retries:
+            raise
+          logging.error("Retrying page @ +%08x (try %i of max %i)", page_address, retry, self.retries)
+          self.retry_count += 1
+          self.erase(device, page_address, ERASE_SIZE)
+
+      self.show_progress(min(page_address + ERASE_SIZE, len(program_bin)), len(program_bin))
+    self.end_progress()
+
+  def program_uncompressed(self, device, program_bin, chunk_size=CHUNK_SIZE):
+    """Writes the image in chunks, which never span erase pages."""
+    def write_page(page_address, page):
+      for offset in range(0, len(page), chunk_size):
+        self.write(device, page_address + offset, page[offset:offset+chunk_size])
+    self.program_pages(device, program_bin, write_page)
+
+  def program_compressed(self, device, program_bin, chunk_size=CHUNK_SIZE):
+    """Writes the image as compressed blocks, which never span erase pages."""
+    compressed_sizes = {}
+    def write_page(page_address, page):
+      blocks = self.compress_page(page, chunk_size)
+      compressed_sizes[page_address] = sum([len(compressed) for _, _, compressed in blocks])
+      for offset, length, compressed in blocks:
+        self.write_compressed(device, page_address + offset,
+                              page[offset:offset+length], compressed)
+    self.program_pages(device, program_bin, write_page)
+    logging.info("  compressed %i -> %i bytes", len(program_bin), sum(compressed_sizes.values()))
+
+  def program(self, device, program_bin_filename, compress=False,
+              chunk_size=CHUNK_SIZE, version=0, write_header=True, erase_app=False):
+    with open(program_bin_filename, 'rb') as program_bin:
+      return self.program_bytes(device, program_bin.read(), compress, chunk_size,
+                                version, write_header, erase_app)
+
+  def program_bytes(self, device, program_bin, compress=False,
+                    chunk_size=CHUNK_SIZE, version=0, write_header=True,
+                    erase_app=False):
+    """Erases, writes and verifies an image, then writes its header (unless
+    write_header is False, for bootloaders which don't support it). Erases
+    the whole app region if erase_app is True, otherwise the image's pages.
+    Returns a
+    dict of statistics: the erase, write (including the final flush) and
+    verify (including the header) times in seconds, the image size, and the
+    round-trip latencies and retry count of its commands.
+    """
+    time.sleep(0.1) # wait for some time to initialize the serial object, otherwise the initial flush doesn't work
+    bytes_read = self.serial.read(self.serial.inWaiting())
+    logging.info("Serial: flushed %i bytes: %s", len(bytes_read), bytes_read)
+    self.reset_stats()
+
+    program_size = len(program_bin)
+    erase_size = (program_size + ERASE_SIZE - 1) // ERASE_SIZE * ERASE_SIZE
+
+    start = time.time()
+    if erase_app:
+      logging.info("Erase app region of device %i ...", device)
+      device_time = self.erase_app(device)
+      erase_time = time.time() - start
+      logging.info("  done (%.03f s, %.03f s on the device)", erase_time, device_time)
+    else:
+      logging.info("Erase %i bytes from device %i ...", erase_size, device)
+      self.erase(device, 0, erase_size)
+      erase_time = time.time() - start
+      logging.info("  done (%.03f s)", erase_time)
+
+    logging.info("Write %i bytes to device %i", program_size, device)
+    if self.progress:
+      sys.stdout.write("...")
+    start = time.time()
+    if compress:
+      self.program_compressed(device, program_bin, chunk_size)
+    else:
+      self.program_uncompressed(device, program_bin, chunk_size)
+    self.flush(device)
+    write_time = time.time() - start
+    logging.info("  done (%.03f s, %.03fKiB/s)", write_time, program_size / 1024.0 / write_time)
+
+    start = time.time()
+    crc = binascii.crc32(program_bin) & 0xffffffff
+    self.verify(device, 0, program_size, crc)
+    logging.info("  verified CRC %08x", crc)
+    if write_header:
+      self.header(device, program_size, crc, version)
+      logging.info("  wrote header, version %i", version)
+    verify_time = time.time() - start
+
+    return {
+      'image_size': program_size,
+      'erase_s': erase_time,
+      'write_s': write_time,
+      'verify_s': verify_time,
+      'latencies_s': list(self.latencies),
+      'retries': self.retry_count,
+    }
+
+  def load_ram(self, device, image_bin, chunk_size=CHUNK_SIZE):
+    """Loads an image into the device's RAM load region, for ram_run. The
+    image must be linked to run from the start of the region, which is
+    the F303's CCM or the L432's SRAM2 (past its vector table). Returns the
+    image CRC.
+    """
+    bytes_read = self.serial.read(self.serial.inWaiting())
+    logging.info("Serial: flushed %i bytes: %s", len(bytes_read), bytes_read)
+
+    logging.info("Load %i bytes into device %i RAM", len(image_bin), device)
+    if self.progress:
+      sys.stdout.write("...")
+    start = time.time()
+    for offset in range(0, len(image_bin), chunk_size):
+      self.ram_write(device, offset, image_bin[offset:offset+chunk_size])
+      self.show_progress(min(offset + chunk_size, len(image_bin)), len(image_bin))
+    self.end_progress()
+    load_time = time.time() - start
+    logging.info("  done (%.03f s, %.03fKiB/s)", load_time, len(image_bin) / 1024.0 / load_time)
+    return binascii.crc32(image_bin) & 0xffffffff
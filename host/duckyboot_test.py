@@ -0,0 +1,149 @@
+import unittest
+
+from duckyboot import *
+
+class FakeSerial(object):
+  """Replies to each frame with the next of the given response lines."""
+  def __init__(self, responses):
+    self.responses = list(responses)
+    self.written = b''
+
+  def write(self, data):
+    self.written += bytes(data)
+
+  def readline(self):
+    return self.responses.pop(0)
+
+class TestBootloaderComms(unittest.TestCase):
+  def test_percentile(self):
+    self.assertEquals(None, percentile([], 50))
+    self.assertEquals(1, percentile([1], 99))
+    self.assertEquals(5, percentile([1, 2, 3, 4, 5, 6, 7, 8, 9, 10], 50))
+    self.assertEquals(9, percentile([10, 9, 8, 7, 6, 5, 4, 3, 2, 1], 90))
+    self.assertEquals(10, percentile(list(range(1, 11)), 99))
+
+  def test_command(self):
+    ser = FakeSerial([b'D\n'])
+    comms = BootloaderComms(ser)
+    comms.flush(1)
+    self.assertEquals(b'\x00' + cobs_encode(b'F\x01') + b'\x00', ser.written)
+    self.assertEquals(1, len(comms.latencies))
+    self.assertEquals(0, comms.retry_count)
+
+  def test_retries(self):
+    comms = BootloaderComms(FakeSerial([b'C\n', b'D\n']))
+    comms.flush(0)
+    self.assertEquals(2, len(comms.latencies))
+    self.assertEquals(1, comms.retry_count)
+
+    comms = BootloaderComms(FakeSerial([b'C\n'] * 4), retries=3)
+    self.assertRaises(BootloaderResponseError, comms.flush, 0)
+    self.assertEquals(3, comms.retry_count)
+
+    comms.reset_stats()
+    self.assertEquals([], comms.latencies)
+    self.assertEquals(0, comms.retry_count)
+
+  def test_stats(self):
+    ser = FakeSerial([b's 000f4240\n',
+                      b's 00000002 00000001 00000003 0000000000000004\n',
+                      b's 00000000 00000000 00000000 0000000000000000\n',
+                      b'D\n'])
+    stats = BootloaderComms(ser).stats(1, reset=True)
+    self.assertEquals(b'\x00' + cobs_encode(b'S\x01\x01') + b'\x00', ser.written)
+    self.assertEquals(2, len(stats))
+    self.assertEquals({'stage': 'decode', 'count': 2, 'min_us': 1, 'max_us': 3,
+                       'mean_us': 2}, stats[0])
+    self.assertEquals(0, stats[1]['count'])
+
+  def test_trace(self):
+    full_page = [b't 00000020\n'] + \
+        [b't %08x 00000000 00000057 0000000b\n' % i for i in range(16)]
+    ser = FakeSerial(full_page + [b'D\n',
+                      b't 00000020\n',
+                      b't 00000100 00000007 00000000 00000000\n',
+                      b'D\n'])
+    records, total = BootloaderComms(ser).trace(2)
+    self.assertEquals(b'\x00' + cobs_encode(b'T\x02\x00') + b'\x00'
+                      + cobs_encode(b'T\x02\x01') + b'\x00', ser.written)
+    self.assertEquals(0x20, total)
+    self.assertEquals(17, len(records))
+    self.assertEquals({'time_us': 0, 'event': 0, 'arg8': ord('W'), 'arg16': 11},
+                      records[0])
+    self.assertEquals({'time_us': 0x100, 'event': 7, 'arg8': 0, 'arg16': 0},
+                      records[16])
+
+  def test_header(self):
+    ser = FakeSerial([b'D\n'])
+    BootloaderComms(ser).header(0, 0x1234, 0xdeadbeef, 7)
+    self.assertEquals(b'\x00' + cobs_encode(b'H\x00\x00\x00\x12\x34\xde\xad\xbe\xef\x00\x00\x00\x07')
+                      + b'\x00', ser.written)
+
+  def test_boot_info(self):
+    ser = FakeSerial([b'b 0001 0034 00000002 00000010 00000020 00001000 00002000'
+                      b' ffffffff 00003000 00004000 00000100 00000800 00000080 ffffffff\n',
+                      b'D\n'])
+    info = BootloaderComms(ser).boot_info(1)
+    self.assertEquals(b'\x00' + cobs_encode(b'B\x01') + b'\x00', ser.written)
+    self.assertEquals(1, info['version'])
+    self.assertEquals(BOOT_FLAG_MASTER, info['flags'])
+    self.assertEquals(0x2000, info['first_command_us'])
+    self.assertEquals(BOOT_NOT_REACHED, info['app_jump_us'])
+    self.assertEquals(0x80, info['written_bytes'])
+    self.assertEquals(len(BOOT_INFO_FIELDS) - 2, len(info))  # past the version 1 length
+
+    ser = FakeSerial([b'b 0002 0038 00000002 00000010 00000020 00001000 00002000'
+                      b' ffffffff 00003000 00004000 00000100 00000800 00000080 00000800\n',
+                      b'D\n'])
+    info = BootloaderComms(ser).boot_info(1)
+    self.assertEquals(len(BOOT_INFO_FIELDS) - 1, len(info))  # past the version 2 length
+    self.assertEquals(0x800, info['blank_bytes'])
+
+    ser = FakeSerial([b'b 0003 003c 00000002 00000010 00000020 00001000 00002000'
+                      b' ffffffff 00003000 00004000 00000100 00000800 00000080 00000800'
+                      b' 0000007e\n',
+                      b'D\n'])
+    info = BootloaderComms(ser).boot_info(1)
+    self.assertEquals(len(BOOT_INFO_FIELDS), len(info))
+    self.assertEquals(126, info['fast_rows'])
+
+  def test_slots(self):
+    ser = FakeSerial([b'q 00000002 00000000 00000001\n', b'D\n'])
+    slots = BootloaderComms(ser).slots(0)
+    self.assertEquals(b'\x00' + cobs_encode(b'Q\x00') + b'\x00', ser.written)
+    self.assertEquals({'count': 2, 'boot': 0, 'target': 1}, slots)
+
+    ser = FakeSerial([b'D\n'])
+    BootloaderComms(ser).select_slot(1, 1)
+    self.assertEquals(b'\x00' + cobs_encode(b'A\x01\x01') + b'\x00', ser.written)
+
+  def test_program_pages(self):
+    # A pipelined write's failure is reported by the page's flush, so the whole
+    # page is erased and rewritten
+    ser = FakeSerial([b'D\n', b'D\n', b'E\n', b'D\n', b'D\n', b'D\n', b'D\n'])
+    comms = BootloaderComms(ser, progress=False)
+    comms.program_uncompressed(1, b'\x01' * 12, chunk_size=8)
+    self.assertEquals(1, comms.retry_count)
+    frames = [cobs_decode(frame) for frame in ser.written.split(b'\x00') if frame]
+    self.assertEquals(b'WWFEWWF', bytes(bytearray([frame[0] for frame in frames])))
+    self.assertEquals(b'E\x01\x00\x00\x00\x00\x00\x00\x08\x00', bytes(frames[3]))
+
+  def test_erase_app(self):
+    ser = FakeSerial([b'c 0004e200\n', b'D\n'])
+    self.assertEquals(0.32, BootloaderComms(ser).erase_app(1))
+    self.assertEquals(b'\x00' + cobs_encode(b'C\x01') + b'\x00', ser.written)
+
+    ser = FakeSerial([b'e 0003d090\n', b'e 0007a120\n', b'c 00124f80\n', b'D\n'])
+    self.assertEquals(1.2, BootloaderComms(ser).erase_app(0))
+
+  def test_ram(self):
+    ser = FakeSerial([b'D\n'])
+    comms = BootloaderComms(ser)
+    comms.ram_write(1, 0x80, b'\x01\x02')
+    self.assertEquals(b'\x00' + cobs_encode(b'R\x01\x00\x00\x00\x80\xb6\xcc\x42\x92\x01\x02')
+                      + b'\x00', ser.written)
+
+    ser = FakeSerial([])
+    BootloaderComms(ser).ram_run(0, 0, 0x100, 0xdeadbeef)
+    self.assertEquals(b'\x00' + cobs_encode(b'X\x00\x00\x00\x00\x00\x00\x00\x01\x00\xde\xad\xbe\xef')
+                      + b'\x00', ser.written)
@@ -0,0 +1,102 @@
+"""
+Serial traffic capture, for replaying a programming session against a master
+(see replay.py) to reproduce timing problems offline.
+
+A capture file is the header CAPTURE_MAGIC followed by records of:
+  uint8 kind (KIND_*), uint32 microseconds since the previous record,
+  uint16 data length, data
+all little-endian. Frames are recorded as written, with their framing.
+"""
+
+import struct
+import time
+
+CAPTURE_MAGIC = b'DCAP\x01'
+
+KIND_WRITE = 0  # data written to the master
+KIND_READLINE = 1  # a line read from the master, possibly empty on timeout
+KIND_READ = 2  # bytes read from the master, like flushing its output
+
+RECORD_HEADER = struct.Struct('<BIH')
+
+class CaptureSerial(object):
+  """Wraps a serial port, recording its traffic to a capture file while passing
+  everything through.
+  """
+  def __init__(self, ser, capture_file):
+    self.serial = ser
+    self.capture = capture_file
+    self.capture.write(CAPTURE_MAGIC)
+    self.last_time = time.time()
+
+  def record(self, kind, data):
+    now = time.time()
+    delta_us = min(int((now - self.last_time) * 1000000), 0xffffffff)
+    self.last_time = now
+    for offset in range(0, max(len(data), 1), 0xffff):  # split overlong data
+      chunk = data[offset:offset+0xffff]
+      self.capture.write(RECORD_HEADER.pack(kind, delta_us, len(chunk)) + chunk)
+      delta_us = 0
+
+  def write(self, data):
+    result = self.serial.write(data)
+    self.record(KIND_WRITE, bytes(data))
+    return result
+
+  def readline(self):
+    line = self.serial.readline()
+    self.record(KIND_READLINE, line)
+    return line
+
+  def read(self, size=1):
+    data = self.serial.read(size)
+    self.record(KIND_READ, data)
+    return data
+
+  def inWaiting(self):
+    return self.serial.inWaiting()
+
+  def close(self):
+    self.serial.close()
+    self.capture.close()
+
+def read_capture(capture_file):
+  """Returns the records of a capture file as a list of (kind, time in seconds
+  since the start of the capture, data).
+  """
+  if capture_file.read(len(CAPTURE_MAGIC)) != CAPTURE_MAGIC:
+    raise ValueError("Not a capture file, or an unsupported version")
+  records = []
+  time_s = 0.0
+  while True:
+    header = capture_file.read(RECORD_HEADER.size)
+    if len(header) < RECORD_HEADER.size:
+      return records  # a truncated last record is dropped
+    kind, delta_us, length = RECORD_HEADER.unpack(header)
+    data = capture_file.read(length)
+    if len(data) < length:
+      return records
+    time_s += delta_us / 1000000.0
+    records.append((kind, time_s, data))
+
+def split_commands(records):
+  """Groups records into exchanges: a list of (time sent, frames written, lines
+  read, time of the last line), where the time of the last line is None if no
+  lines were read. Reads (flushes) are kept as their own exchanges with no
+  frames.
+  """
+  exchanges = []
+  for kind, time_s, data in records:
+    if kind == KIND_WRITE:
+      if exchanges and exchanges[-1][1] and not exchanges[-1][2]:
+        exchanges[-1][1].append(data)  # consecutive writes, like a frame separator
+      else:
+        exchanges.append([time_s, [data], [], None])
+    elif kind == KIND_READLINE:
+      if not exchanges or not exchanges[-1][1]:
+        exchanges.append([time_s, [], [], None])  # line without a command
+      exchanges[-1][2].append(data)
+      exchanges[-1][3] = time_s
+    elif kind == KIND_READ:
+      exchanges.append([time_s, [], [], None])
+  return [tuple(exchange) for exchange in exchanges]
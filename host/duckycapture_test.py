@@ -0,0 +1,57 @@
+import io
+import unittest
+
+from duckycapture import *
+
+class FakeSerial(object):
+  def __init__(self, lines):
+    self.lines = list(lines)
+    self.written = b''
+
+  def write(self, data):
+    self.written += data
+
+  def readline(self):
+    return self.lines.pop(0)
+
+  def read(self, size=1):
+    return b'x' * size
+
+class TestCapture(unittest.TestCase):
+  def test_round_trip(self):
+    capture = io.BytesIO()
+    ser = CaptureSerial(FakeSerial([b's 1\n', b'D\n']), capture)
+    ser.write(b'\x00')
+    self.assertEquals(b'xx', ser.read(2))
+    ser.write(b'\x02S\x00')
+    self.assertEquals(b's 1\n', ser.readline())
+    self.assertEquals(b'D\n', ser.readline())
+    self.assertEquals(b'\x00\x02S\x00', ser.serial.written)
+
+    capture.seek(0)
+    records = read_capture(capture)
+    self.assertEquals([(KIND_WRITE, b'\x00'), (KIND_READ, b'xx'),
+                       (KIND_WRITE, b'\x02S\x00'), (KIND_READLINE, b's 1\n'),
+                       (KIND_READLINE, b'D\n')],
+                      [(kind, data) for kind, _, data in records])
+    times = [time_s for _, time_s, _ in records]
+    self.assertEquals(sorted(times), times)
+
+  def test_invalid(self):
+    self.assertRaises(ValueError, read_capture, io.BytesIO(b'DCAP\x00'))
+    # truncated records are dropped
+    self.assertEquals([], read_capture(io.BytesIO(CAPTURE_MAGIC + b'\x00\x01')))
+
+  def test_split_commands(self):
+    records = [(KIND_WRITE, 0.0, b'\x00'),
+               (KIND_WRITE, 0.1, b'F\x00'),
+               (KIND_READLINE, 0.2, b'D\n'),
+               (KIND_READ, 0.3, b''),
+               (KIND_WRITE, 0.4, b'J\x00'),
+               (KIND_WRITE, 0.5, b'S\x00'),
+               (KIND_READLINE, 0.6, b's 1\n'),
+               (KIND_READLINE, 0.7, b'D\n')]
+    self.assertEquals([(0.0, [b'\x00', b'F\x00'], [b'D\n'], 0.2),
+                       (0.3, [], [], None),
+                       (0.4, [b'J\x00', b'S\x00'], [b's 1\n', b'D\n'], 0.7)],
+                      split_commands(records))
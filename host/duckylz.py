@@ -0,0 +1,108 @@
+"""
+DuckyLZ compression, a LZSS variant with a small window so the decoder fits in
+bootloader RAM.
+The stream is a sequence of groups, each a flags byte followed by up to 8 items.
+Flag bits are read LSB first, one per item:
+- 1 means the item is a single literal byte.
+- 0 means the item is a two-byte back-reference. The first byte is the high 8
+  bits of (offset-1), the second byte is the low 2 bits of (offset-1) followed
+  by 6 bits of (length-3). The referenced data starts offset bytes before the
+  current output position and may overlap the output (to encode runs).
+The last group may have fewer than 8 items, unused flag bits are ignored.
+Back-references may only point into data decoded from the same stream, so a
+stream's decoded length is bounded by the decoder's output buffer (1024 bytes
+on the device).
+"""
+
+MIN_MATCH = 3
+MAX_MATCH = MIN_MATCH + 63
+MAX_OFFSET = 1024
+
+def lz_compress(in_bytearray):
+  """
+  Compresses a bytearray into DuckyLZ, using a greedy longest-match search.
+  """
+  in_bytearray = bytearray(in_bytearray)
+  out = bytearray()
+
+  flags_pos = None
+  flags_count = 8
+  pos = 0
+  # maps 3-byte prefixes to positions where they occurred, most recent last
+  prefixes = {}
+
+  def add_prefix(at):
+    if at + MIN_MATCH <= len(in_bytearray):
+      prefixes.setdefault(bytes(in_bytearray[at:at+MIN_MATCH]), []).append(at)
+
+  while pos < len(in_bytearray):
+    if flags_count == 8:
+      flags_pos = len(out)
+      out.append(0)
+      flags_count = 0
+
+    best_length = 0
+    best_offset = 0
+    candidates = prefixes.get(bytes(in_bytearray[pos:pos+MIN_MATCH]), [])
+    for candidate in reversed(candidates):
+      offset = pos - candidate
+      if offset > MAX_OFFSET:
+        break
+      length = 0
+      while (length < MAX_MATCH and pos + length < len(in_bytearray)
+             and in_bytearray[candidate + length] == in_bytearray[pos + length]):
+        length += 1
+      if length > best_length:
+        best_length = length
+        best_offset = offset
+        if length == MAX_MATCH:
+          break
+
+    if best_length >= MIN_MATCH:
+      encoded = ((best_offset - 1) << 6) | (best_length - MIN_MATCH)
+      out.append((encoded >> 8) & 0xff)
+      out.append(encoded & 0xff)
+      for i in range(best_length):
+        add_prefix(pos + i)
+      pos += best_length
+    else:
+      out[flags_pos] |= 1 << flags_count
+      out.append(in_bytearray[pos])
+      add_prefix(pos)
+      pos += 1
+    flags_count += 1
+
+  return out
+
+def lz_decompress(in_bytearray):
+  """
+  Decompresses a DuckyLZ bytearray.
+  Returns None if an invalid stream was detected.
+  """
+  in_bytearray = bytearray(in_bytearray)
+  out = bytearray()
+
+  pos = 0
+  while pos < len(in_bytearray):
+    flags = in_bytearray[pos]
+    pos += 1
+    for _ in range(8):
+      if pos >= len(in_bytearray):
+        break
+      if flags & 0x01:
+        out.append(in_bytearray[pos])
+        pos += 1
+      else:
+        if pos + 1 >= len(in_bytearray):
+          return None  # truncated back-reference
+        encoded = (in_bytearray[pos] << 8) | in_bytearray[pos+1]
+        pos += 2
+        offset = (encoded >> 6) + 1
+        length = (encoded & 0x3f) + MIN_MATCH
+        if offset > len(out):
+          return None
+        for _ in range(length):
+          out.append(out[-offset])
+      flags >>= 1
+
+  return out
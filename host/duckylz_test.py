@@ -0,0 +1,40 @@
+import random
+import unittest
+
+from duckylz import *
+
+class TestLZ(unittest.TestCase):
+  def check_compress_decompress(self, in_bytearray):
+    compressed = lz_compress(in_bytearray)
+    self.assertEqual(bytearray(in_bytearray), lz_decompress(compressed),
+                     "failed: %s -> %s" % (in_bytearray, compressed))
+    return compressed
+
+  def test_manual(self):
+    self.assertEquals(b'', lz_compress(b''))
+    self.assertEquals(b'\x01\x42', lz_compress(b'\x42'))
+    self.assertEquals(b'\x07\x01\x02\x03', lz_compress(b'\x01\x02\x03'))
+    # literal followed by an overlapping run of 4
+    self.assertEquals(b'\x01\xff\x00\x01', lz_compress(b'\xff'*5))
+    self.assertEquals(b'\x01\xff\x00\x3f\x00\x00', lz_compress(b'\xff'*(1+66+3)))
+
+  def test_basic(self):
+    self.check_compress_decompress(b'')
+    self.check_compress_decompress(b'\x00')
+    self.check_compress_decompress(b'\x00\x00\x00')
+    self.check_compress_decompress(b'abcabcabcabc')
+    self.check_compress_decompress(b'\x00\x01\x02\x03' * 64)
+
+  def test_longruns(self):
+    self.assertTrue(len(self.check_compress_decompress(b'\xff'*2048)) < 100)
+    self.check_compress_decompress(b'\x00'*1024 + b'\xff'*1024)
+
+  def test_window(self):
+    # repeated data beyond the window can't be referenced
+    rand = random.Random(42)
+    block = bytearray(rand.getrandbits(8) for _ in range(1100))
+    self.check_compress_decompress(block + block)
+
+  def test_invalid(self):
+    self.assertEquals(None, lz_decompress(b'\x00\x00\x00'))  # offset before start
+    self.assertEquals(None, lz_decompress(b'\x01\x42\x00'))  # truncated
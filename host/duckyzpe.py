@@ -0,0 +1,127 @@
+"""
+DuckyZPE, a zero-pair and 0xff-run eliminating variant of DuckyCOBS (see
+duckycobs.py).
+0x00 is still the start of frame flag, and encoded data never contains 0x00.
+The encoded frame is a sequence of groups, each starting with a code byte
+followed by some number of literal bytes and possibly a terminator:
+- 0x01 - 0x9f: (code-1) literal bytes, then a single 0x00.
+- 0xa0 - 0xbf: (code-0xa0) literal bytes, then a pair of 0x00.
+- 0xc0 - 0xdf: (code-0xc0) literal bytes, then a run length byte R (nonzero),
+  then R bytes of 0xff.
+- 0xe0 - 0xfe: (code-0xdf) literal bytes, no terminator.
+- 0xff: 253 literal bytes, no terminator (as in DuckyCOBS).
+The data is encoded as if it had an extra trailing 0x00, which the decoder drops.
+So the last group must end with a zero terminator, otherwise it is a decode
+error.
+Data without zero pairs, 0xff runs or long non-zero runs encodes identically to
+DuckyCOBS.
+"""
+
+ZERO_MAX_LITERALS = 0x9f - 0x01
+ZERO_PAIR_MAX_LITERALS = 0xbf - 0xa0
+FF_RUN_MAX_LITERALS = 0xdf - 0xc0
+FF_RUN_MIN = 3  # shortest run of 0xff encoded as a run
+FF_RUN_MAX = 255
+NONE_MAX_LITERALS = 0xfe - 0xdf
+LONG_LITERALS = 253
+
+def _ff_run_length(data, pos):
+  length = 0
+  while pos + length < len(data) and data[pos + length] == 0xff and length < FF_RUN_MAX:
+    length += 1
+  return length
+
+def zpe_encode(in_bytearray):
+  """
+  Encodes a bytearray into DuckyZPE. Does not include the start-of-frame or
+  end-of-frame bytes.
+  """
+  data = bytearray(in_bytearray) + b'\x00'
+  out = bytearray()
+
+  pos = 0
+  while pos < len(data):
+    end = pos
+    while data[end] != 0 and _ff_run_length(data, end) < FF_RUN_MIN:
+      end += 1
+    literals = data[pos:end]
+
+    if data[end] == 0:
+      if end + 1 < len(data) and data[end + 1] == 0 and len(literals) <= ZERO_PAIR_MAX_LITERALS:
+        max_literals, base, terminator_length = ZERO_PAIR_MAX_LITERALS, 0xa0, 2
+      else:
+        max_literals, base, terminator_length = ZERO_MAX_LITERALS, 0x01, 1
+    else:
+      max_literals, base = FF_RUN_MAX_LITERALS, 0xc0
+      terminator_length = _ff_run_length(data, end)
+
+    # Split off literals which don't fit in the terminated group
+    while len(literals) > max_literals:
+      if len(literals) >= LONG_LITERALS:
+        chunk_length = LONG_LITERALS
+        out.append(0xff)
+      else:
+        chunk_length = min(NONE_MAX_LITERALS, len(literals) - max_literals)
+        out.append(0xdf + chunk_length)
+      out.extend(literals[:chunk_length])
+      literals = literals[chunk_length:]
+
+    out.append(base + len(literals))
+    out.extend(literals)
+    if base == 0xc0:
+      out.append(terminator_length)
+
+    pos = end + terminator_length
+
+  return out
+
+def zpe_decode(in_bytearray):
+  """
+  Decodes a DuckyZPE bytearray. The input should not include the
+  start-of-frame or end-of-frame bytes, it is an error (assertion) if a zero
+  occurs in the sequence.
+  Returns None if an invalid packet was detected.
+  """
+  in_bytearray = bytearray(in_bytearray)
+  assert in_bytearray.find(b'\x00') < 0
+
+  out = bytearray()
+  pending_zeros = 0
+
+  pos = 0
+  while pos < len(in_bytearray):
+    out.extend(b'\x00' * pending_zeros)
+    pending_zeros = 0
+
+    code = in_bytearray[pos]
+    pos += 1
+    if code <= 0x9f:
+      num_literals = code - 0x01
+      pending_zeros = 1
+    elif code <= 0xbf:
+      num_literals = code - 0xa0
+      pending_zeros = 2
+    elif code <= 0xdf:
+      num_literals = code - 0xc0
+    elif code <= 0xfe:
+      num_literals = code - 0xdf
+    else:
+      num_literals = LONG_LITERALS
+
+    if pos + num_literals > len(in_bytearray):
+      return None
+    out.extend(in_bytearray[pos:pos+num_literals])
+    pos += num_literals
+
+    if 0xc0 <= code <= 0xdf:
+      if pos >= len(in_bytearray):
+        return None
+      out.extend(b'\xff' * in_bytearray[pos])
+      pos += 1
+
+  # the last group must point to the end of frame
+  if pending_zeros == 0:
+    return None
+  out.extend(b'\x00' * (pending_zeros - 1))
+
+  return out
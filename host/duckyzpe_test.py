@@ -0,0 +1,60 @@
+import unittest
+
+from duckycobs import *
+from duckyzpe import *
+
+class TestZPEEncode(unittest.TestCase):
+  def check_encode_decode(self, in_bytearray):
+    encoded = zpe_encode(in_bytearray)
+    self.assertTrue(encoded.find(b'\x00') < 0, "Must not have 0x00 in encoded bytes")
+    self.assertEqual(in_bytearray, zpe_decode(encoded),
+                     "failed: %s -> %s" % (in_bytearray, encoded))
+
+  def test_manual(self):
+    self.assertEquals(b'\x01', zpe_encode(b''))
+    self.assertEquals(b'\xa0', zpe_encode(b'\x00'))
+    self.assertEquals(b'\xa0\x01', zpe_encode(b'\x00\x00'))
+    self.assertEquals(b'\xc0\x03\x01', zpe_encode(b'\xff'*3))
+    self.assertEquals(b'\xc2ab\x0a\x02c', zpe_encode(b'ab' + b'\xff'*10 + b'c'))
+    self.assertEquals(b'\xc0\xff\x02\xff', zpe_encode(b'\xff'*256))
+    self.assertEquals(b'\xff' + b'\x01'*253 + b'\x30' + b'\x01'*47, zpe_encode(b'\x01'*300))
+    self.assertEquals(b'\xe1' + b'\x01'*2 + b'\xdf' + b'\x01'*31 + b'\x04\x01',
+                      zpe_encode(b'\x01'*33 + b'\xff'*4))
+
+  def test_cobs_compatible(self):
+    # Without zero pairs, 0xff runs or long runs, encoding matches DuckyCOBS
+    for data in [b'', b'\x01', b'\x00\xff\x00\xff', b'\xff\x00\xff\x00\x01',
+                 b'\x00\x01\x00\x02', b'\x01'*158]:
+      self.assertEquals(cobs_encode(data), zpe_encode(data))
+
+  def test_invalid(self):
+    self.assertEquals(None, zpe_decode(b''))
+    self.assertEquals(None, zpe_decode(b'\xe1\x01'))  # no terminating zero
+    self.assertEquals(None, zpe_decode(b'\x03\x01'))  # truncated literals
+    self.assertEquals(None, zpe_decode(b'\xc0'))  # missing run length
+
+  def test_basic(self):
+    self.check_encode_decode(b'')
+    self.check_encode_decode(b'\x00')
+    self.check_encode_decode(b'\x01')
+    self.check_encode_decode(b'\xff')
+    self.check_encode_decode(b'\x00\x00')
+    self.check_encode_decode(b'\x00\x01\x00\x02')
+    self.check_encode_decode(b'\x00\xff\x00\xff')
+    self.check_encode_decode(b'\xff\x00\xff\x00')
+    self.check_encode_decode(b'\x00\x00\x00')
+    self.check_encode_decode(b'\x01\xff\xff\xff\x00\x00\x02')
+
+  def test_longruns(self):
+    self.check_encode_decode(b'\xff'*252)
+    self.check_encode_decode(b'\xff'*253)
+    self.check_encode_decode(b'\xff'*254)
+    self.check_encode_decode(b'\x00'*512)
+    self.check_encode_decode(b'\xff'*512)
+    self.check_encode_decode(b'\x01'*512)
+    self.check_encode_decode(b'\x01'*200 + b'\x00\x00')
+    self.check_encode_decode(b'\x01'*200 + b'\xff'*3)
+
+  def test_shorter(self):
+    self.assertTrue(len(zpe_encode(b'\xff'*512)) < 10)
+    self.assertTrue(len(zpe_encode(b'\x12\x34\x00\x00'*64)) < len(cobs_encode(b'\x12\x34\x00\x00'*64)))
@@ -1,156 +1,153 @@
 import argparse
-import binascii
 import logging
-import math
-import os
 import serial
-import sys
 import time
 
-from duckycobs import *
-from duckypacket import *
-
-CHUNK_SIZE = 128
-ERASE_SIZE = 2048
+from duckyboot import *
+from duckycapture import CaptureSerial
 
 logging.basicConfig(format='%(asctime)s %(levelname)s: %(message)s', datefmt='%H:%M:%S', level=logging.INFO)
 
 parser = argparse.ArgumentParser(description='Bootloader host')
 parser.add_argument('serial', type=str,
                     help='serial port to use, like COM1 (Windows) or /dev/ttyACM0 (Linux)')
-parser.add_argument('bin_files', type=str, nargs='+',
+parser.add_argument('bin_files', type=str, nargs='*',
                     help='bin files to load')
 parser.add_argument('--baud', type=int, default=115200,
                     help='serial baud rate')
 parser.add_argument('--devices', type=int, nargs='+',
                     help='device number, 0 is master, slaves start at 1 (optional, defaults to 0...len(bin_files)-1)')
+parser.add_argument('--compress', action='store_true',
+                    help='send DuckyLZ compressed data, decompressed on the device')
+parser.add_argument('--zpe', action='store_true',
+                    help='use DuckyZPE framing if the bootloader supports it')
+parser.add_argument('--stats', action='store_true',
+                    help='print stage timings after programming each device, needs a profiling (PROFILE=1) bootloader')
+parser.add_argument('--image-version', type=int, default=0,
+                    help='version number to record in the image headers')
+parser.add_argument('--no-header', action='store_true',
+                    help="don't write image headers, for older bootloaders which don't support them")
+parser.add_argument('--erase-app', action='store_true',
+                    help='erase the whole app region before programming, instead of only the pages of the image')
+parser.add_argument('--boot-info', action='store_true',
+                    help='print boot milestone times and update statistics after programming each device')
+parser.add_argument('--ram', action='store_true',
+                    help='load the images into RAM and run them there, without touching flash; '
+                         'they must be linked to run from the RAM load region')
+parser.add_argument('--slot-b-files', type=str, nargs='+',
+                    help='bin files linked for the second app slot (L432), one per bin file; each device '
+                         'is programmed in its target slot with the matching file, which is then selected, '
+                         'keeping the running image for --rollback')
+parser.add_argument('--rollback', action='store_true',
+                    help="instead of programming, select the other app slot on each of --devices, "
+                         "switching back to the previous image, then start the apps")
+parser.add_argument('--warm-entry', action='store_true',
+                    help='first ask a running app to enter the bootloader, see bootloader/warm_entry.h')
+parser.add_argument('--capture', type=str,
+                    help='file to record serial traffic to, for replay.py')
 
 args = parser.parse_args()
 
 ser = serial.Serial(args.serial, args.baud, timeout=1)
 logging.info("Opened serial port '%s'", args.serial)
+if args.capture:
+  ser = CaptureSerial(ser, open(args.capture, 'wb'))
+  logging.info("Capturing to '%s'", args.capture)
 
-def pbar(curr, max, sym='=', space=' ', arrow='>', nsyms=32):
-  assert curr <= max
-  if curr == 0:
-    combined = space * nsyms
-  elif curr == max:
-    combined = sym * nsyms
-  else:
-    syms = int(curr * nsyms / max)
-    if syms > 0:
-      combined = (syms-1) * sym + arrow + (nsyms - syms) * space
-    else:
-      combined = arrow + (nsyms-1) * space
-
-  return "[{0}] {1}/{2}".format(combined, curr, max)
-
-# General exception when the bootloader returns a non-success error code.
-class BootloaderResponseError(Exception):
-  pass
-
-class BootloaderComms(object):
-  def __init__(self, ser, retries=3):
-    self.serial = ser
-    self.serial.write(b'\x00')
-    self.retries = retries
-
-  def command(self, packet, debug_text="", reply_expected=True):
-    retry = 0
-    while retry <= self.retries:
-      if retry > 0:
-        logging.error("Retrying command (try %i of max %i): %s", retry, self.retries, debug_text)
-      self.serial.write(cobs_encode(packet.get_bytes()) + b'\x00')
-      if reply_expected:
-        line = ser.readline().strip()
-        logging.debug("Serial <- '%s'", line)  # discard the ending space
-        if (line == b'D'):
-          return
-        else:
-          logging.error("Got response '%s' from bootloader", line)
-          retry += 1
-      else:
-        return
-    raise BootloaderResponseError("Hit max retries for command: %s" % (debug_text))
-
-  def erase(self, device, address, length):
-    packet = PacketBuilder()
-    packet.put_uint8(ord('E'))
-    packet.put_uint8(device)
-    packet.put_uint32(address)
-    packet.put_uint32(length)
-    self.command(packet, "Erase %i bytes @ +%08x" % (length, address))
-
-  def write(self, device, address, data):
-    packet = PacketBuilder()
-    packet.put_uint8(ord('W'))
-    packet.put_uint8(device)
-    packet.put_uint32(address)
-    packet.put_uint32(binascii.crc32(data) & 0xffffffff)
-    packet.put_bytes(data, len(data))
-    self.command(packet, "Program %i bytes @ +%08x" % (len(data), address))
-
-  def run_app(self, device, address):
-    packet = PacketBuilder()
-    packet.put_uint8(ord('J'))
-    packet.put_uint8(device)
-    packet.put_uint32(address)
-    self.command(packet, "Run app @ +%08x" % address, reply_expected=False)
-
-  def program(self, device, program_bin_filename):
-    time.sleep(0.1) # wait for some time to initialize the serial object, otherwise the initial flush doesn't work
-    bytes_read = ser.read(ser.inWaiting())
-    logging.info("Serial: flushed %i bytes: %s", len(bytes_read), bytes_read)
-
-    program_size = os.path.getsize(program_bin_filename)
-    erase_size = int(math.ceil(program_size / float(ERASE_SIZE)) * ERASE_SIZE)
-
-    logging.info("Erase %i bytes from device %i ...", erase_size, device)
-    start = time.time()
-    self.erase(device, 0, erase_size)
-    logging.info("  done (%.03f s)", time.time() - start)
-    
-    curr_address = 0
-    program_bin = open(program_bin_filename, 'rb')
-    logging.info("Write %i bytes to device %i", program_size, device)
-    sys.stdout.write("...")
-    start = time.time()
-    while True:
-      chunk = program_bin.read(CHUNK_SIZE)
-      if chunk:
-        # Pad the chunk so it's a full block
-        self.write(device, curr_address, chunk + "\xff" * (CHUNK_SIZE - len(chunk)))
-        curr_address += len(chunk)
-        sys.stdout.write('\r' + pbar(curr_address, program_size))
-        sys.stdout.flush()
-      else:
-        break
-    sys.stdout.write('\n')
-    elapsed = time.time() - start
-    logging.info("  done (%.03f s, %.03fKiB/s)", elapsed, program_size / 1024.0 / elapsed)
-
-    program_bin.close()
+if args.warm_entry:
+  ser.write(b'\x00')  # the example app enters the bootloader on a frame delimiter
+  time.sleep(WARM_ENTRY_DELAY)
+  ser.read(ser.inWaiting())  # discard the bootloader's startup output
+  logging.info("Requested warm entry")
 
 bootloader = BootloaderComms(ser)
+if args.zpe:
+  if bootloader.set_framing(FRAMING_ZPE):
+    logging.info("Using DuckyZPE framing")
+  else:
+    logging.warning("Bootloader doesn't support DuckyZPE framing, using DuckyCOBS")
 
 if not args.devices:
   devices = range(0, len(args.bin_files))
 else :
   devices = args.devices
-assert len(devices) == len(args.bin_files)
+if args.rollback:
+  assert devices, "--rollback needs --devices"
+  for device in devices:
+    slots = bootloader.slots(device)
+    assert slots['count'] > 1 and slots['boot'] != NO_SLOT, "device %i has no slot to roll back from" % device
+    slot = (slots['boot'] + 1) % slots['count']
+    logging.info("Rolling back device %i to slot %i", device, slot)
+    bootloader.select_slot(device, slot)
+  args.bin_files = []
+else:
+  assert len(devices) == len(args.bin_files)
+if args.slot_b_files:
+  assert len(args.slot_b_files) == len(args.bin_files)
+
+ram_crcs = {}
+for i, (device, bin_filename) in enumerate(zip(devices, args.bin_files)):
+  if args.ram:
+    with open(bin_filename, 'rb') as bin_file:
+      image_bin = bin_file.read()
+    ram_crcs[device] = (len(image_bin), bootloader.load_ram(device, image_bin))
+    continue
+
+  slot = None
+  if args.slot_b_files:
+    slots = bootloader.slots(device)
+    if slots['count'] > 1:
+      slot = slots['target']
+      if slot == 1:
+        bin_filename = args.slot_b_files[i]
+      logging.info("Device %i boots from slot %s, updating slot %i", device,
+                   'none' if slots['boot'] == NO_SLOT else slots['boot'], slot)
 
-for device, bin_filename in zip(devices, args.bin_files):
   logging.info("Programming '%s' onto device %i", bin_filename, device)
 
-  bootloader.program(device, bin_filename)
+  if args.stats:
+    try:
+      bootloader.stats(device, reset=True)
+    except BootloaderResponseError:
+      logging.warning("Bootloader doesn't support stats, it must be built with PROFILE=1")
+      args.stats = False
+  bootloader.program(device, bin_filename, args.compress,
+                     version=args.image_version, write_header=not args.no_header,
+                     erase_app=args.erase_app)
+  if slot is not None:
+    bootloader.select_slot(device, slot)
+  if args.stats:
+    logging.info("Stage timings for device %i:", device)
+    for stage in bootloader.stats(device):
+      logging.info("  %-8s %8i x  min %10.1f us  mean %10.1f us  max %10.1f us",
+                   stage['stage'], stage['count'], stage['min_us'], stage['mean_us'], stage['max_us'])
+  if args.boot_info:
+    info = bootloader.boot_info(device)
+    logging.info("Boot info for device %i (flags %x):", device, info['flags'])
+    for name in BOOT_INFO_FIELDS[3:8]:
+      if info[name] != BOOT_NOT_REACHED:
+        logging.info("  %-16s %10.3f ms", name[:-3], info[name] / 1000.0)
+    logging.info("  update %.3f ms, %i bytes received, %i erased, %i written",
+                 (info['update_end_us'] - info['update_start_us']) / 1000.0,
+                 info['received_bytes'], info['erased_bytes'], info['written_bytes'])
+    if 'blank_bytes' in info:
+      logging.info("  %i erased bytes skipped as blank", info['blank_bytes'])
+    if 'fast_rows' in info:
+      logging.info("  %i rows fast programmed", info['fast_rows'])
+
+def start(device):
+  if args.ram:
+    logging.info("Start RAM image on device %i", device)
+    bootloader.ram_run(device, 0, *ram_crcs[device])
+  else:
+    logging.info("Start app on device %i", device)
+    bootloader.run_app(device, 0)
 
 for device in devices:
   if device != 0:
-    logging.info("Start app on device %i", device)
-    bootloader.run_app(device, 0)
+    start(device)
 
 if 0 in devices:
-    logging.info("Start app on device 0")
-    bootloader.run_app(0, 0)
+  start(0)
 
 ser.close()
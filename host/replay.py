@@ -0,0 +1,140 @@
+"""
+Replays a capture (recorded with host.py --capture) against a master, on a
+connected chain or the chain simulator, and compares the replayed command
+latencies against the recorded ones:
+  python host.py /dev/ttyACM0 app.bin --capture station.cap
+  python replay.py station.cap --simulator ../build/native/simulator --slaves 0
+
+By default, frames are sent at their recorded times (or as soon as possible,
+if the replay falls behind), reproducing the host's pacing. With --fast, each
+frame is sent as soon as the previous reply arrives.
+
+The devices must be in the same state as when the capture was recorded (for
+example, freshly reset into the bootloader), since flash contents and the
+selected framing affect the responses.
+"""
+
+import argparse
+import logging
+import sys
+import time
+
+from duckyboot import percentile
+from duckycapture import *
+
+def replay(ser, exchanges, fast=False):
+  """Replays exchanges, returning the total time in seconds and a list of
+  (latency in seconds, lines read) for each, where the latency is from sending
+  until the last line is read, or None if the exchange reads no lines.
+  """
+  results = []
+  start = time.time()
+  for sent_time, frames, lines, _ in exchanges:
+    if not fast:
+      delay = start + sent_time - time.time()
+      if delay > 0:
+        time.sleep(delay)
+
+    sent = time.time()
+    for frame in frames:
+      ser.write(frame)
+    if not frames and not lines:
+      ser.read(ser.inWaiting())
+    replayed_lines = [ser.readline() for _ in lines]
+    results.append((time.time() - sent if lines else None, replayed_lines))
+  return time.time() - start, results
+
+def compare(exchanges, duration, results, top=5):
+  """Prints recorded against replayed timing, and any responses which differ.
+  Returns the number of exchanges with differing responses.
+  """
+  mismatches = 0
+  recorded_latencies = []
+  replayed_latencies = []
+  slowdowns = []
+  for index, ((sent_time, frames, lines, last_time), (latency, replayed_lines)) \
+      in enumerate(zip(exchanges, results)):
+    if [line.strip() for line in lines] != [line.strip() for line in replayed_lines]:
+      mismatches += 1
+      logging.error("Exchange %i: recorded response %s, replayed %s",
+                    index, lines, replayed_lines)
+    if latency is not None and frames:
+      recorded = last_time - sent_time
+      recorded_latencies.append(recorded)
+      replayed_latencies.append(latency)
+      slowdowns.append((latency - recorded, index, recorded, latency,
+                        sum([len(frame) for frame in frames])))
+
+  recorded_duration = 0
+  if exchanges:
+    recorded_duration = exchanges[-1][3] or exchanges[-1][0]
+  print("%i exchanges, %i with differing responses" % (len(exchanges), mismatches))
+  print("%-14s %10s %10s %8s" % ("", "recorded", "replayed", "change"))
+  rows = [("total s", recorded_duration, duration),
+          ("latency sum s", sum(recorded_latencies), sum(replayed_latencies))]
+  for p in [50, 90, 99]:
+    rows.append(("latency p%i ms" % p,
+                 (percentile(recorded_latencies, p) or 0) * 1000,
+                 (percentile(replayed_latencies, p) or 0) * 1000))
+  for name, recorded, replayed in rows:
+    change = (replayed - recorded) / recorded * 100 if recorded else 0
+    print("%-14s %10.3f %10.3f %+7.1f%%" % (name, recorded, replayed, change))
+
+  slowdowns.sort(reverse=True)
+  if slowdowns and slowdowns[0][0] > 0:
+    print("Largest slowdowns:")
+    for delta, index, recorded, latency, length in slowdowns[:top]:
+      if delta <= 0:
+        break
+      print("  exchange %5i (%4i bytes sent): %8.3f ms -> %8.3f ms"
+            % (index, length, recorded * 1000, latency * 1000))
+  return mismatches
+
+if __name__ == '__main__':
+  logging.basicConfig(format='%(asctime)s %(levelname)s: %(message)s', datefmt='%H:%M:%S', level=logging.INFO)
+
+  parser = argparse.ArgumentParser(description='Bootloader capture replay')
+  parser.add_argument('capture', type=str,
+                      help='capture file recorded by host.py --capture')
+  target = parser.add_mutually_exclusive_group(required=True)
+  target.add_argument('--serial', type=str,
+                      help='serial port of a connected master')
+  target.add_argument('--simulator', type=str,
+                      help='path to the chain simulator, started fresh for the replay')
+  parser.add_argument('--slaves', type=int, default=0,
+                      help='number of simulated slaves')
+  parser.add_argument('--target', type=str, default='f303k8',
+                      help='simulated device flash model, f303k8 or l432kc')
+  parser.add_argument('--baud', type=int, default=115200,
+                      help='serial baud rate')
+  parser.add_argument('--fast', action='store_true',
+                      help='send each frame as soon as the previous reply arrives')
+  parser.add_argument('--settle', type=float, default=1.0,
+                      help='time to wait for the chain to start, in seconds')
+  parser.add_argument('--timeout', type=float, default=1.0,
+                      help='serial reply timeout, in seconds')
+  args = parser.parse_args()
+
+  import serial
+  from bench import run_simulator
+
+  with open(args.capture, 'rb') as capture_file:
+    exchanges = split_commands(read_capture(capture_file))
+
+  process = None
+  if args.simulator:
+    process, port = run_simulator(args.simulator, args.slaves, args.baud, args.target)
+  else:
+    port = args.serial
+  try:
+    ser = serial.Serial(port, args.baud, timeout=args.timeout)
+    time.sleep(args.settle)
+    ser.read(ser.inWaiting())  # discard the startup output
+    duration, results = replay(ser, exchanges, args.fast)
+    ser.close()
+  finally:
+    if process:
+      process.terminate()
+      process.wait()
+
+  sys.exit(1 if compare(exchanges, duration, results) else 0)
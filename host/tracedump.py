@@ -0,0 +1,145 @@
+"""
+Dumps the protocol event trace of chain devices (see bootloader/trace.h) and
+prints it as a per-device timeline, to find where an update stalled or spent
+its time:
+  python tracedump.py /dev/ttyACM0 --devices 0 1 2
+
+Run it after (or while stuck during) an update, before the devices are reset.
+Device timestamps are not synchronized, so each timeline is relative to that
+device's oldest record.
+"""
+
+import argparse
+import logging
+import serial
+import time
+
+from duckyboot import *
+
+logging.basicConfig(format='%(asctime)s %(levelname)s: %(message)s', datefmt='%H:%M:%S', level=logging.INFO)
+
+# Trace::Event, in order
+EVENT_COMMAND = 0
+EVENT_RESPONSE = 1
+EVENT_FRAME_ERROR = 2
+EVENT_CRC_FAIL = 3
+EVENT_I2C_NACK = 4
+EVENT_STATUS_POLLS = 5
+EVENT_FLASH_START = 6
+EVENT_FLASH_END = 7
+EVENT_VERIFY_FAIL = 8
+EVENT_NAMES = ['command', 'response', 'frame error', 'crc fail', 'i2c nack',
+               'status polls', 'flash start', 'flash end', 'verify fail']
+
+# BootProto::BootCommand values seen in slave traces
+SLAVE_COMMANDS = {
+  0x08: 'status', 0x09: 'set address', 0x10: 'set boot out', 0x11: 'erase',
+  0x12: 'write', 0x13: 'run app', 0x14: 'write compressed', 0x15: 'flush',
+  0x16: 'verify', 0x17: 'result', 0x18: 'trace', 0x19: 'stats', 0x1a: 'header',
+  0x1b: 'boot info', 0x1c: 'RAM write', 0x1d: 'RAM run', 0x1e: 'slots',
+  0x1f: 'select slot',
+  0x20: 'erase app',
+}
+RESP_DONE = 0x5a
+RESP_NAMES = {0x00: 'busy', 0x10: 'invalid format', 0x11: 'invalid args',
+              0x12: 'invalid checksum', 0x13: 'flash error',
+              0x14: 'unknown error', RESP_DONE: 'done'}
+FRAME_ERRORS = {2: 'overflow', 3: 'invalid format'}
+ISP_STATUSES = {0x00: 'ok', 0x10: 'invalid args', 0x11: 'flash error'}
+
+def describe(device, record):
+  """Returns a readable description of a trace record's event and arguments."""
+  event, arg8, arg16 = record['event'], record['arg8'], record['arg16']
+  if event >= len(EVENT_NAMES):
+    return "event %i (%02x, %04x)" % (event, arg8, arg16)
+  name = EVENT_NAMES[event]
+  if event == EVENT_COMMAND:
+    if device == 0:
+      return "%s '%s' (%i bytes)" % (name, chr(arg8), arg16)
+    return "%s %s" % (name, SLAVE_COMMANDS.get(arg8, '%02x' % arg8))
+  elif event == EVENT_RESPONSE:
+    return "%s %s" % (name, RESP_NAMES.get(arg8, '%02x' % arg8))
+  elif event == EVENT_FRAME_ERROR:
+    return "%s %s" % (name, FRAME_ERRORS.get(arg8, '%i' % arg8))
+  elif event in (EVENT_CRC_FAIL, EVENT_VERIFY_FAIL):
+    return "%s (%i bytes)" % (name, arg16)
+  elif event == EVENT_I2C_NACK:
+    return "%s from device %i" % (name, arg8 + 1)
+  elif event == EVENT_STATUS_POLLS:
+    return "%s: device %i ready after %i polls" % (name, arg8 + 1, arg16)
+  elif event == EVENT_FLASH_START:
+    if arg8 == 0x11:
+      return "%s erase (%i pages)" % (name, arg16)
+    return "%s write (%i bytes)" % (name, arg16)
+  elif event == EVENT_FLASH_END:
+    return "%s %s" % (name, ISP_STATUSES.get(arg8, '%02x' % arg8))
+  return name
+
+def print_timeline(device, records, total):
+  """Prints a device's records with times in ms relative to the first record
+  and since the previous record, flagging host retries, and summarises flash
+  time and slave polling.
+  """
+  print("Device %i: %i events recorded, showing the last %i" % (device, total, len(records)))
+  if not records:
+    return
+
+  start = records[0]['time_us']
+  prev = start
+  flash_start = None
+  flash_us = 0
+  flash_ops = 0
+  polls = 0
+  last_command = None  # (opcode, length) of the last master command
+  last_failed = False  # whether its response was an error
+  for record in records:
+    time_us = record['time_us']
+    note = ""
+    if record['event'] == EVENT_COMMAND and device == 0:
+      command = (record['arg8'], record['arg16'])
+      if last_failed and command == last_command:
+        note = "  <- host retry"
+      last_command = command
+    elif record['event'] == EVENT_RESPONSE:
+      last_failed = record['arg8'] != RESP_DONE
+    elif record['event'] == EVENT_FLASH_START:
+      flash_start = time_us
+    elif record['event'] == EVENT_FLASH_END and flash_start is not None:
+      flash_us += (time_us - flash_start) & 0xffffffff
+      flash_ops += 1
+      flash_start = None
+    elif record['event'] == EVENT_STATUS_POLLS:
+      polls += record['arg16']
+
+    # Timestamps wrap at 32 bits, every ~71 minutes
+    print("  %10.3f ms  +%9.3f ms  %s%s" % (((time_us - start) & 0xffffffff) / 1000.0,
+                                            ((time_us - prev) & 0xffffffff) / 1000.0,
+                                            describe(device, record), note))
+    prev = time_us
+
+  print("  %i flash operations, %.3f ms total" % (flash_ops, flash_us / 1000.0))
+  if polls:
+    print("  %i slave status polls" % polls)
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser(description='Bootloader event trace dump')
+  parser.add_argument('serial', type=str,
+                      help='serial port to use, like COM1 (Windows) or /dev/ttyACM0 (Linux)')
+  parser.add_argument('--baud', type=int, default=115200,
+                      help='serial baud rate')
+  parser.add_argument('--devices', type=int, nargs='+', default=[0],
+                      help='devices to dump, 0 is master, slaves start at 1')
+  args = parser.parse_args()
+
+  ser = serial.Serial(args.serial, args.baud, timeout=1)
+  bootloader = BootloaderComms(ser, progress=False)
+  time.sleep(0.1)
+  ser.read(ser.inWaiting())  # discard any earlier output
+  for device in args.devices:
+    try:
+      records, total = bootloader.trace(device)
+    except BootloaderResponseError:
+      logging.error("Couldn't read the trace of device %i", device)
+      continue
+    print_timeline(device, records, total)
+  ser.close()
@@ -0,0 +1,331 @@
+/*
+ * Microbenchmarks for the bootloader core on the host, reporting ns/byte for
+ * the per-byte paths (framing decode, decompression, CRC, and packet parsing).
+ * Host numbers don't translate directly to the target, but catch regressions.
+ *
+ * Also reports the time for a full application update through Bootloader
+ * with simulated flash timing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mbed.h"
+
+#include "cobs.h"
+#include "crc.h"
+#include "lz.h"
+#include "packet.h"
+
+#include "blproto.h"
+#include "isp.h"
+#include "bootloader.h"
+
+const double kMinBenchmarkSeconds = 0.25;
+
+// Frame-sized input data, similar to firmware: mostly random bytes with runs
+// of zeros and 0xff.
+const size_t kDataLength = BootProto::kMaxPayloadLength;
+uint8_t data[kDataLength];
+
+uint8_t cobsFrame[kDataLength * 2];
+size_t cobsFrameLength;
+uint8_t zpeFrame[kDataLength * 2];
+size_t zpeFrameLength;
+
+uint8_t lzStream[BootProto::kMaxDecompressedLength * 2];
+size_t lzStreamLength;
+uint8_t lzOut[BootProto::kMaxDecompressedLength];
+
+volatile uint32_t sink;  // keeps results live
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Application image for the update benchmark, the host's default chunk size,
+// and the largest (decompressed) block of a compressed write
+const size_t kUpdateImageLength = 32768;
+const size_t kUpdateChunkLength = 128;
+const size_t kUpdateBlockLength = BootProto::kMaxDecompressedLength;
+uint8_t updateImage[kUpdateImageLength];
+uint8_t updateFlash[kUpdateImageLength + 2048];
+
+// App region and bootloader data lengths of the targets, from the bootloader
+// linker scripts, for the erase benchmark: the F303 has one slot, the L432 two.
+const size_t kF303AppLength = 64*1024 - 2048 - 2048 - 18*1024;
+const size_t kF303DataLength = 2048;
+const size_t kL432AppLength = 256*1024 - 2048 - 8192 - 20*1024;
+const size_t kL432DataLength = 8192;
+uint8_t eraseFlash[kL432AppLength + kL432DataLength];
+
+/**
+ * Fills out with pseudo-random firmware-like contents.
+ */
+static void generate_data(uint8_t* out, size_t length) {
+  size_t pos = 0;
+  while (pos < length) {
+    size_t run = rand() % 32 + 1;
+    int kind = rand() % 8;
+    for (size_t i=0; i<run && pos < length; i++, pos++) {
+      out[pos] = kind == 0 ? 0x00 : kind == 1 ? 0xff : (uint8_t)rand();
+    }
+  }
+}
+
+/**
+ * Builds a valid DuckyLZ stream which decodes to kMaxDecompressedLength
+ * bytes, with about half of the items as back-references.
+ */
+static void generate_lz_stream() {
+  size_t out_length = 0;
+  lzStreamLength = 0;
+  while (out_length < BootProto::kMaxDecompressedLength) {
+    size_t flags_pos = lzStreamLength++;
+    lzStream[flags_pos] = 0;
+    for (size_t item=0; item<8 && out_length < BootProto::kMaxDecompressedLength; item++) {
+      size_t remaining = BootProto::kMaxDecompressedLength - out_length;
+      if (out_length == 0 || remaining < LZDecoder::kMinMatchLength || rand() % 2) {
+        lzStream[flags_pos] |= 1 << item;
+        lzStream[lzStreamLength++] = (uint8_t)rand();
+        out_length += 1;
+      } else {
+        size_t max_offset = out_length < LZDecoder::kMaxMatchOffset ? out_length : LZDecoder::kMaxMatchOffset;
+        size_t offset = rand() % max_offset + 1;
+        size_t max_length = remaining < LZDecoder::kMaxMatchLength ? remaining : LZDecoder::kMaxMatchLength;
+        size_t length = LZDecoder::kMinMatchLength
+            + rand() % (max_length - LZDecoder::kMinMatchLength + 1);
+        uint16_t encoded = ((offset - 1) << 6) | (length - LZDecoder::kMinMatchLength);
+        lzStream[lzStreamLength++] = encoded >> 8;
+        lzStream[lzStreamLength++] = encoded & 0xff;
+        out_length += length;
+      }
+    }
+  }
+}
+
+static void decode_frame(COBSDecoder& decoder, const uint8_t* frame, size_t length) {
+  static BufferedPacketReader<BootProto::kMaxPayloadLength> packet;
+  packet.reset();
+  decoder.set_buffer(&packet);
+
+  uint8_t flag = 0x00;
+  size_t bytes_read;
+  decoder.decode(&flag, 1, &bytes_read);
+  // Byte at a time, as the master's UART loop does
+  for (size_t i=0; i<length; i++) {
+    uint8_t byte = frame[i];
+    decoder.decode(&byte, 1, &bytes_read);
+  }
+  sink += decoder.decode(&flag, 1, &bytes_read);
+  sink += packet.getRemainingBytes();
+}
+
+static void bench_cobs_decode() {
+  static COBSDecoder decoder;
+  decode_frame(decoder, cobsFrame, cobsFrameLength);
+}
+
+static void bench_zpe_decode() {
+  static ZPEDecoder decoder;
+  decode_frame(decoder, zpeFrame, zpeFrameLength);
+}
+
+static void bench_cobs_encode() {
+  static uint8_t out[kDataLength * 2];
+  sink += COBSEncoder::encode(data, kDataLength, out, sizeof(out));
+}
+
+static void bench_zpe_encode() {
+  static uint8_t out[kDataLength * 2];
+  sink += ZPEEncoder::encode(data, kDataLength, out, sizeof(out));
+}
+
+static void bench_lz_decode() {
+  LZDecoder decoder;
+  decoder.set_buffer(lzOut, sizeof(lzOut));
+  sink += decoder.decode(lzStream, lzStreamLength);
+  sink += decoder.get_length();
+}
+
+static void bench_crc32() {
+  sink += CRC32::compute_crc(data, kDataLength);
+}
+
+static void bench_packet_parse() {
+  // A write command as the slave parses it: header fields, then the payload
+  MemoryPacketReader packet(data, kDataLength);
+  sink += packet.read<uint8_t>();
+  sink += packet.read<uint32_t>();
+  sink += packet.read<uint16_t>();
+  sink += packet.read<uint32_t>();
+  while (packet.getRemainingBytes() >= 4) {
+    sink += packet.read<uint32_t>();
+  }
+}
+
+/**
+ * Runs func repeatedly for at least kMinBenchmarkSeconds, and prints the
+ * time per byte processed, where each call processes bytes_per_call bytes.
+ */
+static void run_benchmark(const char* name, void (*func)(), size_t bytes_per_call) {
+  func();  // warm up
+
+  size_t calls = 0;
+  size_t batch = 1;
+  double start = now_seconds();
+  double elapsed = 0;
+  while (elapsed < kMinBenchmarkSeconds) {
+    for (size_t i=0; i<batch; i++) {
+      func();
+    }
+    calls += batch;
+    batch *= 2;
+    elapsed = now_seconds() - start;
+  }
+
+  printf("%-16s %8.3f ns/byte  (%u bytes x %u)\n", name,
+      elapsed * 1e9 / ((double)calls * bytes_per_call),
+      (unsigned int)bytes_per_call, (unsigned int)calls);
+}
+
+/**
+ * Runs queued Bootloader commands to completion, skipping ahead the clock
+ * while waiting on the flash.
+ */
+static BootProto::RespStatus run_commands(Bootloader<SimulatedISP>& bootloader,
+    SimulatedISP& isp, VirtualClock& clock) {
+  BootProto::RespStatus status;
+  while ((status = bootloader.async_update()) == BootProto::kRespBusy) {
+    clock.advance_to_us(isp.get_busy_until_us());
+  }
+  return status;
+}
+
+/**
+ * Erases, writes in chunks, and flushes updateImage through Bootloader, one
+ * command at a time as the master does, and prints the simulated time.
+ */
+static void run_update_benchmark(const char* name, const SimulatedISP::Config& config,
+    size_t chunk_length=kUpdateChunkLength) {
+  VirtualClock clock;
+  SimulatedISP isp(updateFlash, sizeof(updateFlash), config, clock);
+  Bootloader<SimulatedISP> bootloader(isp, updateFlash, kUpdateImageLength,
+      updateFlash + kUpdateImageLength, 2048);
+
+  double start = now_seconds();
+  bootloader.async_erase(0, kUpdateImageLength);
+  BootProto::RespStatus status = run_commands(bootloader, isp, clock);
+  for (size_t pos=0; pos<kUpdateImageLength && status == BootProto::kRespDone;
+      pos+=chunk_length) {
+    bootloader.async_write(pos, updateImage + pos, chunk_length);
+    status = run_commands(bootloader, isp, clock);
+  }
+  if (status == BootProto::kRespDone) {
+    bootloader.async_flush();
+    status = run_commands(bootloader, isp, clock);
+  }
+  double elapsed = now_seconds() - start;
+
+  if (status != BootProto::kRespDone
+      || memcmp(updateFlash, updateImage, kUpdateImageLength) != 0) {
+    printf("%-16s failed\n", name);
+    return;
+  }
+  uint64_t program_us = isp.get_busy_us() - (uint64_t)isp.get_erase_count() * config.erase_page_us;
+  printf("%-18s %8.1f ms simulated  (%u bytes, %u pages erased, %u units and %u rows "
+      "written, program %.0f us/KB, host %.3f ns/byte)\n", name, clock.now_us() / 1000.0,
+      (unsigned int)kUpdateImageLength, (unsigned int)isp.get_erase_count(),
+      (unsigned int)isp.get_write_count(), (unsigned int)isp.get_row_count(),
+      program_us * 1024.0 / kUpdateImageLength,
+      elapsed * 1e9 / kUpdateImageLength);
+}
+
+/**
+ * Erases the whole target slot through Bootloader, as the 'C' command does,
+ * in a target's app region layout and with its blank check setting: once with
+ * an image in every page, and again once it's blank. Prints the simulated
+ * times.
+ */
+static void run_erase_benchmark(const char* name, const SimulatedISP::Config& config,
+    size_t app_length, size_t data_length, bool blank_check) {
+  VirtualClock clock;
+  SimulatedISP isp(eraseFlash, app_length + data_length, config, clock);
+  Bootloader<SimulatedISP> bootloader(isp, eraseFlash, app_length,
+      eraseFlash + app_length, data_length);
+  bootloader.set_blank_check(blank_check);
+  memset(eraseFlash, 0, app_length);
+
+  bootloader.async_erase(0, bootloader.get_slot_length());
+  BootProto::RespStatus status = run_commands(bootloader, isp, clock);
+  uint64_t full_us = clock.now_us();
+  bootloader.async_erase(0, bootloader.get_slot_length());
+  if (status == BootProto::kRespDone) {
+    status = run_commands(bootloader, isp, clock);
+  }
+  uint64_t blank_us = clock.now_us() - full_us;
+
+  if (status != BootProto::kRespDone
+      || isp.get_erase_count() != bootloader.get_slot_length() / config.erase_size
+          * (blank_check ? 1 : 2)) {
+    printf("%-18s failed\n", name);
+    return;
+  }
+  size_t pages = bootloader.get_slot_length() / config.erase_size;
+  printf("%-18s %8.1f ms simulated  (%u pages, %.1f ms/page), %.1f ms when blank\n",
+      name, full_us / 1000.0, (unsigned int)pages, full_us / 1000.0 / pages,
+      blank_us / 1000.0);
+}
+
+int main() {
+  srand(42);
+  generate_data(data, kDataLength);
+  generate_data(updateImage, kUpdateImageLength);
+  cobsFrameLength = COBSEncoder::encode(data, kDataLength, cobsFrame, sizeof(cobsFrame));
+  zpeFrameLength = ZPEEncoder::encode(data, kDataLength, zpeFrame, sizeof(zpeFrame));
+  generate_lz_stream();
+
+  LZDecoder decoder;
+  decoder.set_buffer(lzOut, sizeof(lzOut));
+  if (cobsFrameLength == 0 || zpeFrameLength == 0
+      || decoder.decode(lzStream, lzStreamLength) != LZDecoder::kResultWorking
+      || decoder.get_length() != sizeof(lzOut)) {
+    printf("invalid benchmark input\n");
+    return 1;
+  }
+
+  // Decode rates are per decoded byte, so framings can be compared
+  run_benchmark("cobs_decode", bench_cobs_decode, kDataLength);
+  run_benchmark("zpe_decode", bench_zpe_decode, kDataLength);
+  run_benchmark("cobs_encode", bench_cobs_encode, kDataLength);
+  run_benchmark("zpe_encode", bench_zpe_encode, kDataLength);
+  run_benchmark("lz_decode", bench_lz_decode, BootProto::kMaxDecompressedLength);
+  run_benchmark("crc32", bench_crc32, kDataLength);
+  run_benchmark("packet_parse", bench_packet_parse, kDataLength);
+
+  run_update_benchmark("update_f303k8", SimulatedISP::config_f303k8());
+  run_update_benchmark("update_l432kc", SimulatedISP::config_l432kc());
+
+  // Against programming every write unit, including erased (all 0xff) ones
+  SimulatedISP::Config config = SimulatedISP::config_f303k8();
+  config.skip_erased_data = false;
+  run_update_benchmark("update_f303k8_all", config);
+  config = SimulatedISP::config_l432kc();
+  config.skip_erased_data = false;
+  run_update_benchmark("update_l432kc_all", config);
+
+  // Block writes, which fast program whole rows on the L432, against without
+  config = SimulatedISP::config_l432kc();
+  run_update_benchmark("block_l432kc", config, kUpdateBlockLength);
+  config.row_size = 0;
+  run_update_benchmark("block_l432kc_units", config, kUpdateBlockLength);
+
+  run_erase_benchmark("erase_app_f303k8", SimulatedISP::config_f303k8(),
+      kF303AppLength, kF303DataLength, true);
+  run_erase_benchmark("erase_app_l432kc", SimulatedISP::config_l432kc(),
+      kL432AppLength, kL432DataLength, false);  // ECC, see main.cpp
+  return 0;
+}
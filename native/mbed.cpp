@@ -0,0 +1,30 @@
+/*
+ * Core function stubs for the unit tests and benchmarks, which only use the
+ * platform-independent sources.
+ */
+
+#include <time.h>
+
+#include "mbed.h"
+
+SCB_Type native_scb;
+extern "C" uint32_t* _AppVectors;  // see image.h
+uint32_t* _AppVectors;
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+}
+
+void NVIC_SystemReset() {
+}
+
+void __set_MSP(uint32_t topOfMainStack) {
+}
+
+void __set_PSP(uint32_t topOfProcStack) {
+}
+
+uint32_t us_ticker_read() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
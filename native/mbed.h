@@ -0,0 +1,149 @@
+/*
+ * Stub mbed.h for the host-native build. Provides what the bootloader sources
+ * use: Cortex-M core functions, and the subset of the mbed driver API used by
+ * main.cpp.
+ *
+ * The core functions are implemented as no-ops in mbed.cpp for the unit tests
+ * and benchmarks. The drivers are only implemented by the chain simulator, in
+ * sim_mbed.cpp.
+ */
+
+#ifndef NATIVE_MBED_H_
+#define NATIVE_MBED_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef int IRQn_Type;
+const int NVIC_NUM_VECTORS = 16;
+
+void NVIC_DisableIRQ(IRQn_Type irq);
+void NVIC_SystemReset();
+
+void __set_MSP(uint32_t topOfMainStack);
+void __set_PSP(uint32_t topOfProcStack);
+
+struct SCB_Type {
+  uint32_t VTOR;
+};
+
+extern SCB_Type native_scb;
+#define SCB (&native_scb)
+
+enum PinName {
+  D0, D1, D2, D3, D4, D5, D6,
+  LED1,
+  SERIAL_TX, SERIAL_RX,
+  NC
+};
+
+enum PinMode {
+  PullNone,
+  PullUp,
+  PullDown
+};
+
+void wait_ms(int ms);
+void wait_us(int us);
+
+uint32_t us_ticker_read();
+
+class Timer {
+public:
+  Timer();
+  void start();
+  void stop();
+  void reset();
+  int read_ms();
+  int read_us();
+
+protected:
+  uint64_t start_us;
+  uint64_t elapsed_us;  // accumulated while stopped
+  bool running;
+};
+
+class DigitalIn {
+public:
+  DigitalIn(PinName pin, PinMode mode=PullNone);
+  void mode(PinMode pull);
+  int read();
+  operator int() {
+    return read();
+  }
+
+protected:
+  PinName pin;
+};
+
+class DigitalOut {
+public:
+  DigitalOut(PinName pin);
+  void write(int value);
+  int read();
+  DigitalOut& operator=(int value) {
+    write(value);
+    return *this;
+  }
+  operator int() {
+    return read();
+  }
+
+protected:
+  PinName pin;
+  int value;
+};
+
+class RawSerial {
+public:
+  RawSerial(PinName tx, PinName rx);
+  void baud(int baudrate);
+  int putc(int c);
+  int puts(const char* str);
+  int getc();
+  bool readable();
+
+protected:
+  int get_fd();
+  uint64_t get_char_us();
+
+  PinName tx;
+  int baudrate;
+  uint64_t next_rx_us;  // earliest time the next byte can be received
+  uint64_t next_tx_us;  // earliest time the next byte can be sent
+  char line[128];  // partial output line, for devices without a PTY
+  size_t line_length;
+};
+
+class I2C {
+public:
+  I2C(PinName sda, PinName scl);
+  void frequency(int hz);
+  int write(int address, const char* data, int length, bool repeated=false);
+  int read(int address, char* data, int length, bool repeated=false);
+
+protected:
+  int hz;
+};
+
+class I2CSlave {
+public:
+  enum RxStatus {
+    NoData = 0,
+    ReadAddressed = 1,
+    WriteGeneral = 2,
+    WriteAddressed = 3
+  };
+
+  I2CSlave(PinName sda, PinName scl);
+  void frequency(int hz);
+  void address(int address);
+  int receive();
+  int read(char* data, int length);
+  int read();
+  int write(const char* data, int length);
+  int write(int data);
+};
+
+#endif
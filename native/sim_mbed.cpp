@@ -0,0 +1,387 @@
+/*
+ * mbed driver implementations for the chain simulator. Each simulated device
+ * is a process, the drivers talk to the other devices through the shared
+ * Sim::Bus.
+ *
+ * The I2C bus is modeled at the transaction level: the master deposits a
+ * transaction on the bus and blocks (like clock stretching) until the
+ * addressed slave has consumed it, or returns to receive(). Each transaction
+ * additionally takes its modeled wire time, 9 bit times per byte (including the
+ * address byte) plus a fixed overhead.
+ */
+
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mbed.h"
+#include "simulator.h"
+
+SCB_Type native_scb;
+
+namespace Sim {
+  // Time after which a transaction to an unresponsive slave is abandoned,
+  // longer than any flash operation a slave could block on.
+  const uint64_t kTransactionTimeoutUs = 10 * 1000 * 1000;
+
+  uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  void sleep_until_us(uint64_t time_us) {
+    uint64_t now = now_us();
+    if (time_us > now) {
+      usleep(time_us - now);
+    }
+  }
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+}
+
+void NVIC_SystemReset() {
+  printf("[device %i] reset\n", Sim::device);
+  exit(0);
+}
+
+void __set_MSP(uint32_t topOfMainStack) {
+  // Jumping to the app, which can't run on the host, so this is where the
+  // device's simulation ends.
+  printf("[device %i] running app\n", Sim::device);
+  exit(0);
+}
+
+void __set_PSP(uint32_t topOfProcStack) {
+}
+
+uint32_t us_ticker_read() {
+  return (uint32_t)Sim::now_us();
+}
+
+void wait_ms(int ms) {
+  usleep(ms * 1000);
+}
+
+void wait_us(int us) {
+  usleep(us);
+}
+
+Timer::Timer() : start_us(0), elapsed_us(0), running(false) {
+}
+
+void Timer::start() {
+  if (!running) {
+    start_us = Sim::now_us();
+    running = true;
+  }
+}
+
+void Timer::stop() {
+  if (running) {
+    elapsed_us += Sim::now_us() - start_us;
+    running = false;
+  }
+}
+
+void Timer::reset() {
+  start_us = Sim::now_us();
+  elapsed_us = 0;
+}
+
+int Timer::read_ms() {
+  return read_us() / 1000;
+}
+
+int Timer::read_us() {
+  if (running) {
+    return elapsed_us + (Sim::now_us() - start_us);
+  } else {
+    return elapsed_us;
+  }
+}
+
+DigitalIn::DigitalIn(PinName pin, PinMode mode) : pin(pin) {
+}
+
+void DigitalIn::mode(PinMode pull) {
+}
+
+int DigitalIn::read() {
+  if (pin == D3) {  // BOOT_IN, from the previous device's BOOT_OUT
+    if (Sim::device == 0) {
+      return 1;  // pulled up
+    } else {
+      return Sim::bus->bootOut[Sim::device - 1];
+    }
+  }
+  return 1;  // everything else is pulled up and unconnected
+}
+
+DigitalOut::DigitalOut(PinName pin) : pin(pin), value(0) {
+}
+
+void DigitalOut::write(int value) {
+  this->value = value;
+  if (pin == D6) {  // BOOT_OUT
+    Sim::bus->bootOut[Sim::device] = value;
+  }
+}
+
+int DigitalOut::read() {
+  return value;
+}
+
+RawSerial::RawSerial(PinName tx, PinName rx) :
+    tx(tx), baudrate(9600), next_rx_us(0), next_tx_us(0), line_length(0) {
+}
+
+void RawSerial::baud(int baudrate) {
+  this->baudrate = baudrate;
+}
+
+/**
+ * Returns the PTY backing this UART, or -1 if output goes to stdout.
+ */
+int RawSerial::get_fd() {
+  if (Sim::device != 0) {
+    return -1;
+  } else if (tx == SERIAL_TX) {
+    return Sim::options.usbFd;
+  } else {
+    return Sim::options.extFd;
+  }
+}
+
+/**
+ * Returns the time to transfer a character (10 bits), or 0 if unthrottled.
+ */
+uint64_t RawSerial::get_char_us() {
+  int rate = Sim::options.baud != 0 ? Sim::options.baud : baudrate;
+  if (rate <= 0) {
+    return 0;
+  }
+  return 10 * 1000000 / rate;
+}
+
+int RawSerial::putc(int c) {
+  int fd = get_fd();
+  if (fd >= 0) {
+    Sim::sleep_until_us(next_tx_us);
+    next_tx_us = Sim::now_us() + get_char_us();
+    uint8_t data = c;
+    if (write(fd, &data, 1) != 1) {
+      // Nothing is reading the PTY and its buffer is full, drop the byte as the
+      // UART would.
+    }
+  } else if (tx == SERIAL_TX) {  // slaves print the USB UART, prefixed by device
+    if (c == '\n' || line_length == sizeof(line) - 1) {
+      line[line_length] = '\0';
+      printf("[device %i] %s\n", Sim::device, line);
+      fflush(stdout);
+      line_length = 0;
+    } else if (c != '\r') {
+      line[line_length++] = c;
+    }
+  }
+  return c;
+}
+
+int RawSerial::puts(const char* str) {
+  while (*str != '\0') {
+    putc(*str++);
+  }
+  return 0;
+}
+
+int RawSerial::getc() {
+  int fd = get_fd();
+  uint8_t data = 0;
+  if (fd < 0) {
+    while (1) {  // nothing is ever received
+      pause();
+    }
+  }
+  struct pollfd pfd = {fd, POLLIN, 0};
+  while (poll(&pfd, 1, -1) != 1 || read(fd, &data, 1) != 1) {
+  }
+  uint64_t now = Sim::now_us();
+  next_rx_us = (next_rx_us > now ? next_rx_us : now) + get_char_us();
+  return data;
+}
+
+bool RawSerial::readable() {
+  int fd = get_fd();
+  if (fd < 0 || Sim::now_us() < next_rx_us) {
+    return false;
+  }
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+namespace {
+  /**
+   * Returns the device index with the I2C address, or -1 if none.
+   */
+  int find_device(int address) {
+    for (int i=1; i<Sim::kMaxDevices; i++) {
+      if (Sim::bus->address[i] == address) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * Sleeps for the modeled time of a transaction of length bytes.
+   */
+  void model_transfer(int hz, int length) {
+    if (Sim::options.i2cClockHz != 0) {
+      hz = Sim::options.i2cClockHz;
+    }
+    uint64_t bit_ns = 1000000000ULL / hz;
+    usleep(Sim::options.i2cOverheadUs + (1 + length) * 9 * bit_ns / 1000);
+  }
+
+  /**
+   * Starts a transaction and waits for the slave to finish it. Returns false
+   * if the slave went away or didn't respond in time.
+   */
+  bool run_transaction(int target, Sim::TransactionState state, int length) {
+    Sim::bus->target = target;
+    Sim::bus->length = length;
+    Sim::bus->position = 0;
+    __sync_synchronize();
+    Sim::bus->state = state;
+
+    uint64_t timeout_us = Sim::now_us() + Sim::kTransactionTimeoutUs;
+    while (Sim::bus->state != Sim::kIdle) {
+      if (Sim::bus->address[target] == -1 || Sim::now_us() > timeout_us) {
+        Sim::bus->state = Sim::kIdle;
+        return false;
+      }
+      sched_yield();
+    }
+    __sync_synchronize();
+    return true;
+  }
+
+  /**
+   * Ends the slave's side of the current transaction, releasing the master.
+   */
+  void release_transaction() {
+    __sync_synchronize();
+    Sim::bus->state = Sim::kIdle;
+  }
+
+  bool is_active(Sim::TransactionState state) {
+    return Sim::bus->state == state && Sim::bus->target == Sim::device;
+  }
+}
+
+I2C::I2C(PinName sda, PinName scl) : hz(100000) {
+}
+
+void I2C::frequency(int hz) {
+  this->hz = hz;
+}
+
+int I2C::write(int address, const char* data, int length, bool repeated) {
+  int target = find_device(address);
+  model_transfer(hz, length);
+  if (target < 0 || length > Sim::kMaxTransfer) {
+    return 1;  // NACK
+  }
+  memcpy((uint8_t*)Sim::bus->data, data, length);
+  return run_transaction(target, Sim::kWritePending, length) ? 0 : 1;
+}
+
+int I2C::read(int address, char* data, int length, bool repeated) {
+  int target = find_device(address);
+  model_transfer(hz, length);
+  if (target < 0 || length > Sim::kMaxTransfer) {
+    return 1;  // NACK
+  }
+  memset((uint8_t*)Sim::bus->data, 0xff, length);  // bus idles high
+  bool done = run_transaction(target, Sim::kReadPending, length);
+  memcpy(data, (uint8_t*)Sim::bus->data, length);
+  return done ? 0 : 1;
+}
+
+I2CSlave::I2CSlave(PinName sda, PinName scl) {
+}
+
+void I2CSlave::frequency(int hz) {
+}
+
+void I2CSlave::address(int address) {
+  Sim::bus->address[Sim::device] = address;
+}
+
+int I2CSlave::receive() {
+  // Returning to receive ends any transaction the slave didn't finish
+  if (is_active(Sim::kWriteActive) || is_active(Sim::kReadActive)) {
+    release_transaction();
+  }
+
+  int state = Sim::bus->state;
+  __sync_synchronize();
+  if (Sim::bus->target == Sim::device) {
+    if (state == Sim::kWritePending) {
+      Sim::bus->state = Sim::kWriteActive;
+      return WriteAddressed;
+    } else if (state == Sim::kReadPending) {
+      Sim::bus->state = Sim::kReadActive;
+      return ReadAddressed;
+    }
+  }
+
+  usleep(10);  // don't starve the other device processes while polling
+  return NoData;
+}
+
+int I2CSlave::read(char* data, int length) {
+  if (!is_active(Sim::kWriteActive)
+      || Sim::bus->position + length > Sim::bus->length) {
+    return 1;
+  }
+  memcpy(data, (uint8_t*)Sim::bus->data + Sim::bus->position, length);
+  Sim::bus->position += length;
+  if (Sim::bus->position == Sim::bus->length) {
+    release_transaction();
+  }
+  return 0;
+}
+
+int I2CSlave::read() {
+  uint8_t data;
+  if (read((char*)&data, 1) != 0) {
+    return -1;
+  }
+  return data;
+}
+
+int I2CSlave::write(const char* data, int length) {
+  if (!is_active(Sim::kReadActive)) {
+    return 1;
+  }
+  int remaining = Sim::bus->length - Sim::bus->position;
+  if (length > remaining) {
+    length = remaining;
+  }
+  memcpy((uint8_t*)Sim::bus->data + Sim::bus->position, data, length);
+  Sim::bus->position += length;
+  if (Sim::bus->position == Sim::bus->length) {
+    release_transaction();
+  }
+  return 0;
+}
+
+int I2CSlave::write(int data) {
+  char c = data;
+  return write(&c, 1) == 0;
+}
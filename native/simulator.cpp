@@ -0,0 +1,219 @@
+/*
+ * Chain simulator: runs the real bootloader (main.cpp, built with its main()
+ * renamed to device_main()) as a master and N slaves, one process per device,
+ * on RAM-backed flash with modeled flash and I2C timing.
+ *
+ * The master's USB and external UARTs are PTYs, so host.py can program the
+ * chain unchanged:
+ *   build/native/simulator --slaves 2
+ *   python host/host.py /dev/pts/N a.bin b.bin c.bin
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "mbed.h"
+#include "isp.h"
+#include "simulator.h"
+#include "warm_entry.h"
+
+int device_main();
+
+extern ISP this_isp;
+
+// Flash image in the same order as the bootloader linker scripts, so the
+// linker symbols main.cpp uses exist: the app region, bootloader data, then
+// the bootloader's vector table. The app region and bootloader data are laid
+// out like the L432, with two app slots, but only bound host writes.
+// _BootInfo, _WarmEntry and _AppVectors stand in for the RAM region reserved
+// at the top of RAM, and _RamLoadStart for the RAM load region (F303 CCM
+// sized).
+asm(".pushsection .bss\n"
+    ".balign 2048\n"
+    ".globl _AppStart\n"
+    "_AppStart:\n"
+    ".space 0x38000\n"
+    ".globl _AppEnd\n"
+    "_AppEnd:\n"
+    ".globl _BootloaderDataStart\n"
+    "_BootloaderDataStart:\n"
+    ".space 8192\n"
+    ".globl _BootloaderDataEnd\n"
+    "_BootloaderDataEnd:\n"
+    ".globl _BootloaderVector\n"
+    "_BootloaderVector:\n"
+    ".space 512\n"
+    ".balign 4\n"
+    ".globl _BootInfo\n"
+    "_BootInfo:\n"
+    ".space 64\n"
+    ".globl _WarmEntry\n"
+    "_WarmEntry:\n"
+    ".space 16\n"
+    ".globl _AppVectors\n"
+    "_AppVectors:\n"
+    ".space 16\n"
+    ".balign 512\n"
+    ".globl _RamLoadStart\n"
+    "_RamLoadStart:\n"
+    ".space 4096\n"
+    ".globl _RamLoadEnd\n"
+    "_RamLoadEnd:\n"
+    ".popsection\n");
+
+extern char _AppStart, _BootloaderDataEnd[];
+
+namespace Sim {
+  Bus* bus;
+  Options options;
+  int device;
+}
+
+namespace {
+  RealClock flashClock;
+
+  pid_t devicePids[Sim::kMaxDevices];
+
+  void usage(const char* name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --slaves N            number of slave devices (default 1, max %i)\n"
+        "  --target T            flash model, f303k8 (default) or l432kc\n"
+        "  --i2c-clock HZ        I2C clock, overriding the device setting\n"
+        "  --i2c-overhead-us US  per-transaction I2C overhead (default 20)\n"
+        "  --baud BAUD           UART baud rate, overriding the device setting,\n"
+        "                        0 for unthrottled\n"
+        "  --warm-entry FLAGS    start the master as if its app requested a warm\n"
+        "                        entry, with WarmEntry::Flags\n",
+        name, Sim::kMaxDevices - 1);
+    exit(1);
+  }
+
+  /**
+   * Opens a PTY in raw mode and returns the master side, printing the path of
+   * the slave side. The slave side is left open so the master side stays
+   * usable while nothing else has it open.
+   */
+  int open_pty(const char* name) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+      perror("posix_openpt");
+      exit(1);
+    }
+    int slaveFd = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(slaveFd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slaveFd, TCSANOW, &tio);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    printf("%s UART: %s\n", name, ptsname(fd));
+    return fd;
+  }
+
+  void stop_devices(int signal) {
+    for (int i=0; i<Sim::kMaxDevices; i++) {
+      if (devicePids[i] > 0) {
+        kill(devicePids[i], SIGTERM);
+      }
+    }
+  }
+
+  void unregister_device() {
+    Sim::bus->address[Sim::device] = -1;
+  }
+}
+
+ISP::ISP() : SimulatedISP((uint8_t*)&_AppStart, _BootloaderDataEnd - &_AppStart,
+    config_f303k8(), flashClock) {
+}
+
+int main(int argc, char** argv) {
+  int numSlaves = 1;
+  SimulatedISP::Config config = SimulatedISP::config_f303k8();
+  Sim::options.i2cClockHz = 0;
+  Sim::options.i2cOverheadUs = 20;
+  Sim::options.baud = 0;
+  int warmEntryFlags = -1;
+
+  for (int i=1; i<argc; i++) {
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    const char* arg = argv[i];
+    const char* value = argv[++i];
+    if (!strcmp(arg, "--slaves")) {
+      numSlaves = atoi(value);
+    } else if (!strcmp(arg, "--target") && !strcmp(value, "f303k8")) {
+      config = SimulatedISP::config_f303k8();
+    } else if (!strcmp(arg, "--target") && !strcmp(value, "l432kc")) {
+      config = SimulatedISP::config_l432kc();
+    } else if (!strcmp(arg, "--i2c-clock")) {
+      Sim::options.i2cClockHz = atoi(value);
+    } else if (!strcmp(arg, "--i2c-overhead-us")) {
+      Sim::options.i2cOverheadUs = atoi(value);
+    } else if (!strcmp(arg, "--baud")) {
+      Sim::options.baud = atoi(value) == 0 ? -1 : atoi(value);
+    } else if (!strcmp(arg, "--warm-entry")) {
+      warmEntryFlags = atoi(value);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (numSlaves < 0 || numSlaves >= Sim::kMaxDevices) {
+    usage(argv[0]);
+  }
+
+  this_isp.set_config(config);
+
+  Sim::bus = (Sim::Bus*)mmap(NULL, sizeof(Sim::Bus), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (Sim::bus == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  for (int i=0; i<Sim::kMaxDevices; i++) {
+    Sim::bus->bootOut[i] = 0;
+    Sim::bus->address[i] = -1;
+  }
+  Sim::bus->state = Sim::kIdle;
+
+  Sim::options.usbFd = open_pty("USB");
+  Sim::options.extFd = open_pty("Ext");
+  fflush(stdout);
+
+  for (int i=0; i<=numSlaves; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      stop_devices(0);
+      return 1;
+    } else if (pid == 0) {
+      Sim::device = i;
+      atexit(unregister_device);
+      signal(SIGINT, SIG_IGN);  // the parent stops devices with SIGTERM
+      if (i == 0 && warmEntryFlags >= 0) {
+        WarmEntry::request(0, WarmEntry::kDeviceAuto, warmEntryFlags);
+      }
+      return device_main();
+    }
+    devicePids[i] = pid;
+  }
+
+  signal(SIGINT, stop_devices);
+  signal(SIGTERM, stop_devices);
+
+  while (wait(NULL) > 0 || errno == EINTR) {
+  }
+  return 0;
+}
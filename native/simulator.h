@@ -0,0 +1,57 @@
+/*
+ * State shared between the chain simulator's device processes (simulator.cpp)
+ * and its mbed driver implementations (sim_mbed.cpp).
+ */
+
+#ifndef NATIVE_SIMULATOR_H_
+#define NATIVE_SIMULATOR_H_
+
+#include <stdint.h>
+
+namespace Sim {
+  const int kMaxDevices = 9;  // master and up to 8 slaves
+  const int kMaxTransfer = 1024;  // bytes in one I2C transaction
+
+  enum TransactionState {
+    kIdle,  // bus free
+    kWritePending,  // master wrote data, slave hasn't seen it yet
+    kWriteActive,  // slave is reading the data
+    kReadPending,  // master is requesting data, slave hasn't seen it yet
+    kReadActive  // slave is writing the data
+  };
+
+  /**
+   * The modeled I2C bus and BOOT chain, in memory shared by all device
+   * processes. There is only one master, so only it starts transactions.
+   */
+  struct Bus {
+    volatile int bootOut[kMaxDevices];  // each device's BOOT_OUT pin
+    volatile int address[kMaxDevices];  // I2C address each device responds to, or -1
+
+    volatile int state;  // TransactionState
+    volatile int target;  // device index addressed by the transaction
+    volatile int length;  // bytes written by the master, or requested by it
+    volatile int position;  // bytes read or written by the slave so far
+    volatile uint8_t data[kMaxTransfer];
+  };
+
+  struct Options {
+    int numSlaves;
+    int i2cClockHz;  // overrides the device setting if nonzero
+    int i2cOverheadUs;  // per transaction, for start / stop and firmware latency
+    int baud;  // overrides the device setting if nonzero, -1 for unthrottled
+    int usbFd;  // PTY master side of the master device's UARTs
+    int extFd;
+  };
+
+  extern Bus* bus;
+  extern Options options;
+  extern int device;  // index of this process's device, 0 is the master
+
+  /**
+   * Returns the current time in microseconds.
+   */
+  uint64_t now_us();
+}
+
+#endif
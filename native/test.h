@@ -0,0 +1,70 @@
+/*
+ * Minimal unit test support for the host-native build, so the tests have no
+ * dependencies beyond the C++ standard library.
+ */
+
+#ifndef NATIVE_TEST_H_
+#define NATIVE_TEST_H_
+
+#include <stdio.h>
+#include <string.h>
+
+class TestCase {
+public:
+  TestCase(const char* name, void (*func)()) :
+      name(name), func(func), next(NULL) {
+    if (last == NULL) {
+      first = this;
+    } else {
+      last->next = this;
+    }
+    last = this;
+  }
+
+  /**
+   * Runs all registered tests in registration order, returning the number of
+   * failed checks.
+   */
+  static int run_all();
+
+  // Called by the CHECK macros on failure.
+  static void fail(const char* file, int line, const char* message);
+
+private:
+  const char* name;
+  void (*func)();
+  TestCase* next;
+
+  static TestCase* first;
+  static TestCase* last;
+  static int failures;
+};
+
+/**
+ * Defines and registers a test function.
+ */
+#define TEST(name) \
+  static void test_##name(); \
+  static TestCase testcase_##name(#name, test_##name); \
+  static void test_##name()
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      TestCase::fail(__FILE__, __LINE__, #cond); \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual) do { \
+    if (!((expected) == (actual))) { \
+      TestCase::fail(__FILE__, __LINE__, #expected " == " #actual); \
+    } \
+  } while (0)
+
+#define CHECK_BYTES(expected, expected_length, actual, actual_length) do { \
+    if ((expected_length) != (actual_length) \
+        || memcmp((expected), (actual), (expected_length)) != 0) { \
+      TestCase::fail(__FILE__, __LINE__, #actual " matches " #expected); \
+    } \
+  } while (0)
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * Tests for the Bootloader command queue and write combining, against a
+ * RAM-backed ISP.
+ */
+
+#include <stdlib.h>
+
+#include "mbed.h"
+
+#include "bootloader.h"
+#include "crc.h"
+#include "test.h"
+
+/**
+ * ISP over a RAM array, which takes a few async_update() calls per operation
+ * and checks write alignment.
+ */
+class TestISP : public ISPBase {
+public:
+  static const size_t kFlashSize = 16384;
+  static const size_t kEraseSize = 2048;
+
+  TestISP(size_t write_size) :
+      write_size(write_size), op(kOpNone), status(kISPOk), min_delay(0),
+      fail_addr(NULL), num_writes(0), erased_bytes(0) {
+    memset(flash, 0x00, sizeof(flash));
+  }
+
+  bool isp_begin() { return true; }
+  bool isp_end() { return true; }
+  uint32_t get_device_id() { return 0; }
+  uint32_t get_device_serial() { return 0; }
+  size_t get_flash_addr_start() { return (size_t)flash; }
+  size_t get_flash_addr_end() { return (size_t)flash + kFlashSize - 1; }
+  size_t get_erase_size() { return kEraseSize; }
+  size_t get_write_size() { return write_size; }
+
+  bool async_update() {
+    if (op == kOpNone) {
+      return false;
+    }
+    if (delay > 0) {
+      delay--;
+      return true;
+    }
+    for (size_t i=0; i<length; i++) {
+      if (op == kOpErase) {
+        addr[i] = 0xff;
+      } else {
+        addr[i] &= data[i];
+        if (addr + i == fail_addr) {
+          status = kISPFlashError;
+        }
+      }
+    }
+    op = kOpNone;
+    return false;
+  }
+
+  bool get_last_async_status(ISPStatus* statusOut) {
+    *statusOut = status;
+    return op == kOpNone;
+  }
+
+  bool async_erase(void* start_addr, size_t erase_length) {
+    if (op != kOpNone) {
+      return false;
+    }
+    status = kISPOk;
+    if (((uint8_t*)start_addr - flash) % kEraseSize != 0 || erase_length % kEraseSize != 0) {
+      status = kISPInvalidArgs;
+      return true;
+    }
+    start(kOpErase, start_addr, NULL, erase_length);
+    erased_bytes += erase_length;
+    return true;
+  }
+
+  bool async_write(void* start_addr, void* write_data, size_t write_length) {
+    if (op != kOpNone) {
+      return false;
+    }
+    status = kISPOk;
+    if (((uint8_t*)start_addr - flash) % write_size != 0 || write_length % write_size != 0
+        || write_length == 0) {
+      status = kISPInvalidArgs;
+      return true;
+    }
+    start(kOpWrite, start_addr, write_data, write_length);
+    num_writes++;
+    return true;
+  }
+
+  uint8_t flash[kFlashSize];
+  const size_t write_size;
+
+protected:
+  enum Op {kOpNone, kOpErase, kOpWrite};
+
+  void start(Op new_op, void* start_addr, void* new_data, size_t new_length) {
+    op = new_op;
+    addr = (uint8_t*)start_addr;
+    data = (uint8_t*)new_data;
+    length = new_length;
+    delay = min_delay + rand() % 3;
+  }
+
+  Op op;
+  uint8_t* addr;
+  uint8_t* data;
+  size_t length;
+  int delay;
+  ISPStatus status;
+
+public:
+  int min_delay;  // minimum number of async_update() calls per operation
+  uint8_t* fail_addr;  // a write covering this address fails
+  size_t num_writes;
+  size_t erased_bytes;
+};
+
+static const size_t kAppLength = 12288;
+
+TEST(bootloader_write_combining) {
+  srand(1);
+  const size_t write_sizes[] = {2, 8};
+  for (size_t trial=0; trial<100; trial++) {
+    TestISP isp(write_sizes[trial % 2]);
+    Bootloader<TestISP> bootloader(isp, isp.flash, kAppLength, isp.flash + kAppLength, 2048);
+
+    uint8_t image[6000];
+    size_t length = rand() % sizeof(image) + 1;
+    for (size_t i=0; i<length; i++) {
+      image[i] = rand();
+    }
+
+    CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 6144));
+    size_t pos = 0;
+    while (pos < length) {
+      size_t chunk = rand() % 300 + 1;
+      if (chunk > length - pos) {
+        chunk = length - pos;
+      }
+      CHECK_EQUAL(BootProto::kRespDone, bootloader.write(pos, image + pos, chunk));
+      pos += chunk;
+    }
+    CHECK_EQUAL(BootProto::kRespDone, bootloader.flush());
+
+    CHECK_BYTES(image, length, isp.flash, length);
+    // Partial write unit padded with the erased value
+    for (size_t i=length; i<(length + isp.write_size - 1) / isp.write_size * isp.write_size; i++) {
+      CHECK_EQUAL(0xff, isp.flash[i]);
+    }
+  }
+}
+
+TEST(bootloader_queue) {
+  srand(2);
+  TestISP isp(8);
+  Bootloader<TestISP> bootloader(isp, isp.flash, kAppLength, isp.flash + kAppLength, 2048);
+
+  uint8_t image[4096];
+  for (size_t i=0; i<sizeof(image); i++) {
+    image[i] = rand();
+  }
+
+  uint8_t id = 0;
+  CHECK(bootloader.enqueue_erase(id++, 0, 4096));
+  for (size_t pos=0; pos<sizeof(image); pos+=512) {
+    while (!bootloader.can_enqueue()) {
+      bootloader.async_update();
+    }
+    CHECK(bootloader.enqueue_write(id++, pos, image + pos, 512));
+  }
+  while (!bootloader.can_enqueue()) {
+    bootloader.async_update();
+  }
+  CHECK(bootloader.enqueue_verify(id, 0, sizeof(image), CRC32::compute_crc(image, sizeof(image))));
+
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.wait());
+  // Only the most recent results are kept
+  for (uint8_t i=id+1-BootloaderBase::kResultLength; i<=id; i++) {
+    CHECK_EQUAL(BootProto::kRespDone, bootloader.get_result(i));
+  }
+  CHECK_BYTES(image, sizeof(image), isp.flash, sizeof(image));
+}
+
+TEST(bootloader_verify_chunked) {
+  TestISP isp(8);
+  memset(isp.flash, 0x5a, sizeof(isp.flash));
+  Bootloader<TestISP> bootloader(isp, isp.flash, kAppLength, isp.flash + kAppLength, 2048);
+  size_t length = 4 * BootloaderBase::kCrcChunkLength + 3;
+  uint32_t crc = CRC32::compute_crc(isp.flash, length);
+
+  // Each update computes at most a chunk of the CRC, the first when enqueued
+  CHECK(bootloader.enqueue_verify(1, 0, length, crc));
+  size_t updates = 0;
+  while (bootloader.async_update() == BootProto::kRespBusy) {
+    updates++;
+  }
+  CHECK_EQUAL(3u, updates);
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.get_result(1));
+  CHECK_EQUAL(BootProto::kRespInvalidChecksum, bootloader.verify(0, length, crc + 1));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.verify(0, 0, 0));
+}
+
+TEST(bootloader_interrupt_driven_isp) {
+  // Blocking commands wait on the ISP, which sleeps until its interrupt.
+  // The virtual clock only advances there, so they'd never complete otherwise.
+  uint8_t flash[8192];
+  VirtualClock clock;
+  SimulatedISP isp(flash, sizeof(flash), SimulatedISP::config_l432kc(), clock);
+  isp.set_interrupt_driven(true);
+  Bootloader<SimulatedISP> bootloader(isp, flash, 4096, flash + 4096, 2048);
+
+  uint8_t image[1000];
+  for (size_t i=0; i<sizeof(image); i++) {
+    image[i] = i * 3;
+  }
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 4096));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.write(0, image, sizeof(image)));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.flush());
+  CHECK_EQUAL(BootProto::kRespDone,
+      bootloader.verify(0, sizeof(image), CRC32::compute_crc(image, sizeof(image))));
+  CHECK_BYTES(image, sizeof(image), flash, sizeof(image));
+  CHECK_EQUAL(isp.get_busy_us(), clock.now_us());
+}
+
+TEST(bootloader_queue_full) {
+  TestISP isp(8);
+  Bootloader<TestISP> bootloader(isp, isp.flash, kAppLength, isp.flash + kAppLength, 2048);
+  isp.min_delay = 100;
+
+  // One running plus a full queue
+  for (uint8_t i=0; i<=BootloaderBase::kQueueLength; i++) {
+    CHECK(bootloader.enqueue_erase(i, 0, 2048));
+  }
+  CHECK(!bootloader.can_enqueue());
+  CHECK(!bootloader.enqueue_erase(42, 0, 2048));
+  CHECK_EQUAL(BootProto::kRespBusy, bootloader.get_result(BootloaderBase::kQueueLength));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.wait());
+  CHECK_EQUAL(BootProto::kRespInvalidArgs, bootloader.get_result(42));  // never queued
+}
+
+TEST(bootloader_errors) {
+  TestISP isp(8);
+  Bootloader<TestISP> bootloader(isp, isp.flash, kAppLength, isp.flash + kAppLength, 2048);
+
+  isp.min_delay = 100;
+
+  uint8_t data[16];
+  memset(data, 0x42, sizeof(data));
+
+  // Out of range arguments fail immediately, the first error is kept in the
+  // aggregate status while later commands still run
+  CHECK(bootloader.enqueue_erase(1, 0, 2048));
+  CHECK(bootloader.enqueue_erase(2, kAppLength, 2048));
+  CHECK_EQUAL(BootProto::kRespInvalidArgs, bootloader.get_result(2));
+  isp.fail_addr = isp.flash + 4;
+  CHECK(bootloader.enqueue_write(3, 0, data, sizeof(data)));
+  CHECK(bootloader.enqueue_verify(4, 0, sizeof(data), 0));
+  CHECK(bootloader.enqueue_erase(5, 2048, 2048));
+  CHECK_EQUAL(BootProto::kRespInvalidArgs, bootloader.wait());
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.get_result(1));
+  CHECK_EQUAL(BootProto::kRespFlashError, bootloader.get_result(3));
+  CHECK_EQUAL(BootProto::kRespInvalidChecksum, bootloader.get_result(4));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.get_result(5));
+  CHECK_EQUAL(BootProto::kRespInvalidArgs, bootloader.get_result(99));
+
+  // The aggregate status restarts once the queue is empty
+  isp.fail_addr = NULL;
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 2048));
+
+  // Rejected commands count towards the aggregate status
+  CHECK(bootloader.enqueue_erase(6, 0, 2048));
+  bootloader.set_result(7, BootProto::kRespInvalidChecksum);
+  CHECK_EQUAL(BootProto::kRespInvalidChecksum, bootloader.get_result(7));
+  CHECK_EQUAL(BootProto::kRespInvalidChecksum, bootloader.wait());
+}
+
+TEST(bootloader_erase_discards_partial_unit) {
+  TestISP isp(8);
+  Bootloader<TestISP> bootloader(isp, isp.flash, kAppLength, isp.flash + kAppLength, 2048);
+
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 2048));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.write(0, (void*)"\x01\x02\x03", 3));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 2048));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.flush());
+  CHECK_EQUAL(0u, isp.num_writes);
+  CHECK_EQUAL(0xff, isp.flash[0]);
+}
+
+TEST(bootloader_blank_check) {
+  TestISP isp(8);
+  Bootloader<TestISP> bootloader(isp, isp.flash, kAppLength, isp.flash + kAppLength, 2048);
+  bootloader.set_blank_check(true);
+
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 6144));
+  CHECK_EQUAL(6144u, isp.erased_bytes);
+  CHECK_EQUAL(0u, bootloader.get_blank_bytes());
+
+  // Already blank, so nothing is erased
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 6144));
+  CHECK_EQUAL(6144u, isp.erased_bytes);
+  CHECK_EQUAL(6144u, bootloader.get_blank_bytes());
+
+  // Only the written page is erased
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.write(4000, (void*)"\x01\x02\x03\x04\x05\x06\x07\x08", 8));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 6144));
+  CHECK_EQUAL(8192u, isp.erased_bytes);
+  CHECK_EQUAL(10240u, bootloader.get_blank_bytes());
+  CHECK_EQUAL(0xff, isp.flash[4000]);
+
+  // Without the blank check, blank pages are erased anyway
+  bootloader.set_blank_check(false);
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 6144));
+  CHECK_EQUAL(14336u, isp.erased_bytes);
+}
+
+TEST(bootloader_image_header) {
+  TestISP isp(8);
+  memset(isp.flash, 0xff, sizeof(isp.flash));
+  Bootloader<TestISP> bootloader(isp, isp.flash, kAppLength, isp.flash + kAppLength, 2048);
+  const Image::Header* header = bootloader.get_header();
+  CHECK(!bootloader.app_valid());
+
+  uint8_t image[1001];
+  for (size_t i=0; i<sizeof(image); i++) {
+    image[i] = i * 7;
+  }
+  uint32_t crc = CRC32::compute_crc(image, sizeof(image));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 2048));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.write(0, image, sizeof(image)));
+
+  // The header flushes the partial write unit before checking the CRC
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.header(sizeof(image), crc, 42));
+  CHECK(bootloader.app_valid());
+  CHECK_EQUAL(Image::kMagic, header->magic);
+  CHECK_EQUAL(sizeof(image), header->length);
+  CHECK_EQUAL(crc, header->crc);
+  CHECK_EQUAL(42u, header->version);
+
+  // Erasing any of the app invalidates it, until a new header is written
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(2048, 2048));
+  CHECK(!bootloader.app_valid());
+  CHECK_EQUAL(0u, header->valid);
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.header(sizeof(image), crc, 43));
+  CHECK(bootloader.app_valid());
+  CHECK_EQUAL(43u, header->version);
+
+  // A mismatched CRC is recorded as invalid
+  CHECK_EQUAL(BootProto::kRespInvalidChecksum, bootloader.header(sizeof(image), crc + 1, 44));
+  CHECK(!bootloader.app_valid());
+  CHECK_EQUAL(Image::kMagic, header->magic);
+  CHECK_EQUAL(BootProto::kRespInvalidArgs, bootloader.header(kAppLength + 1, crc, 45));
+  CHECK(!bootloader.run_app(0));
+}
+
+TEST(bootloader_slots) {
+  TestISP isp(8);
+  memset(isp.flash, 0xff, sizeof(isp.flash));
+  // Two 4K slots, with a header page each and the two slot select pages
+  Bootloader<TestISP> bootloader(isp, isp.flash, 8192, isp.flash + 8192, 4 * 2048);
+  CHECK_EQUAL(2u, bootloader.get_slot_count());
+  CHECK_EQUAL(0u, bootloader.get_target_slot());
+  CHECK_EQUAL(Image::kNoSlot, bootloader.get_boot_slot());
+
+  uint8_t image[100];
+  memset(image, 0xa5, sizeof(image));
+  uint32_t crc = CRC32::compute_crc(image, sizeof(image));
+  CHECK_EQUAL(BootProto::kRespInvalidArgs, bootloader.erase(4096, 2048));  // outside the slot
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 2048));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.write(0, image, sizeof(image)));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.header(sizeof(image), crc, 1));
+  CHECK_EQUAL(0, bootloader.get_boot_slot());
+
+  // Until a slot is selected, updates go to the first slot as without slots
+  CHECK_EQUAL(0u, bootloader.get_target_slot());
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.select(0));
+  CHECK_EQUAL(1u, bootloader.get_target_slot());
+
+  // Updating the other slot leaves the selected image bootable throughout
+  memset(image, 0x5a, sizeof(image));
+  uint32_t crc2 = CRC32::compute_crc(image, sizeof(image));
+  CHECK_EQUAL(BootProto::kRespInvalidChecksum, bootloader.select(1));
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.erase(0, 2048));
+  CHECK_EQUAL(0xff, isp.flash[4096]);
+  CHECK_EQUAL(0xa5, isp.flash[0]);
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.write(0, image, sizeof(image)));
+  CHECK_EQUAL(0, bootloader.get_boot_slot());
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.header(sizeof(image), crc2, 2));
+  CHECK_EQUAL(0x5a, isp.flash[4096]);
+  CHECK_EQUAL(2u, bootloader.get_header(1)->version);
+  CHECK_EQUAL(0, bootloader.get_boot_slot());
+
+  // Switching and rolling back only append select entries
+  size_t writes = isp.num_writes;
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.select(1));
+  CHECK_EQUAL(1, bootloader.get_boot_slot());
+  CHECK_EQUAL(0u, bootloader.get_target_slot());
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.select(0));
+  CHECK_EQUAL(0, bootloader.get_boot_slot());
+  CHECK_EQUAL(writes + 2, isp.num_writes);
+  CHECK_EQUAL(BootProto::kRespInvalidArgs, bootloader.select(2));
+
+  // A new bootloader instance (after reset) picks up the selection
+  Bootloader<TestISP> rebooted(isp, isp.flash, 8192, isp.flash + 8192, 4 * 2048);
+  CHECK_EQUAL(0, rebooted.get_boot_slot());
+  CHECK_EQUAL(1u, rebooted.get_target_slot());
+
+  // Once the current select page is full, selections move to the other page,
+  // which is erased first if needed, and becomes current with its marker.
+  // After every step, either the old or the new selection boots.
+  for (int page=1; page>=0; page--) {
+    const Image::SlotSelect* current = Image::select_page(isp.flash + 8192, 2048, 2, 1 - page);
+    while (Image::select_used(current, 2048) < 2048 / sizeof(Image::SlotSelect)) {
+      CHECK_EQUAL(BootProto::kRespDone, bootloader.select(1 - bootloader.get_boot_slot()));
+    }
+    int old_slot = bootloader.get_boot_slot();
+    int new_slot = 1 - old_slot;
+    CHECK(bootloader.async_select(new_slot));
+    BootProto::RespStatus status;
+    do {
+      status = bootloader.async_update();
+      int slot = Image::boot_slot(isp.flash + 8192, 2048, 2, 4096);
+      CHECK(slot == old_slot || slot == new_slot);
+    } while (status == BootProto::kRespBusy);
+    CHECK_EQUAL(BootProto::kRespDone, status);
+    CHECK_EQUAL(new_slot, bootloader.get_boot_slot());
+    CHECK_EQUAL(page, Image::current_select_page(isp.flash + 8192, 2048, 2));
+    CHECK_EQUAL(2u, Image::select_used(  // the marker and the new entry
+        Image::select_page(isp.flash + 8192, 2048, 2, page), 2048));
+  }
+
+  // If the selected image becomes invalid, the other one boots
+  CHECK_EQUAL(BootProto::kRespDone, bootloader.select(1));
+  ((Image::Header*)(isp.flash + 8192 + 2048))->valid = 0;
+  CHECK_EQUAL(0, bootloader.get_boot_slot());
+  CHECK_EQUAL(0u, bootloader.get_target_slot());
+}
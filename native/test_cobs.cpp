@@ -0,0 +1,183 @@
+/*
+ * Tests for the DuckyCOBS and DuckyZPE encoders and decoders, using the same
+ * vectors as host/duckycobs_test.py and host/duckyzpe_test.py.
+ */
+
+#include <stdlib.h>
+
+#include "mbed.h"
+
+#include "cobs.h"
+#include "test.h"
+
+typedef BufferedPacketReader<1024> TestPacket;
+
+/**
+ * Feeds a full frame, including the start-of-frame and end-of-frame flags,
+ * to the decoder one byte at a time. Returns the result at the end of frame.
+ */
+static COBSDecoder::COBSResult decode_frame(COBSDecoder& decoder, TestPacket& packet,
+    const uint8_t* encoded, size_t length) {
+  packet.reset();
+  decoder.set_buffer(&packet);
+
+  uint8_t flag = 0x00;
+  size_t bytes_read;
+  decoder.decode(&flag, 1, &bytes_read);
+  for (size_t i=0; i<length; i++) {
+    uint8_t byte = encoded[i];
+    COBSDecoder::COBSResult result = decoder.decode(&byte, 1, &bytes_read);
+    if (result != COBSDecoder::kResultWorking) {
+      return result;
+    }
+  }
+  return decoder.decode(&flag, 1, &bytes_read);
+}
+
+static void check_cobs_roundtrip(const uint8_t* data, size_t length) {
+  uint8_t encoded[1200];
+  size_t encoded_length = COBSEncoder::encode(data, length, encoded, sizeof(encoded));
+  CHECK(encoded_length > 0);
+  CHECK(memchr(encoded, 0x00, encoded_length) == NULL);
+
+  COBSDecoder decoder;
+  TestPacket packet;
+  CHECK_EQUAL(COBSDecoder::kResultDone, decode_frame(decoder, packet, encoded, encoded_length));
+  CHECK_BYTES(data, length, packet.read_buf(0), packet.getRemainingBytes());
+}
+
+static void check_zpe_roundtrip(const uint8_t* data, size_t length) {
+  uint8_t encoded[1200];
+  size_t encoded_length = ZPEEncoder::encode(data, length, encoded, sizeof(encoded));
+  CHECK(encoded_length > 0);
+  CHECK(memchr(encoded, 0x00, encoded_length) == NULL);
+
+  ZPEDecoder decoder;
+  TestPacket packet;
+  CHECK_EQUAL(COBSDecoder::kResultDone, decode_frame(decoder, packet, encoded, encoded_length));
+  CHECK_BYTES(data, length, packet.read_buf(0), packet.getRemainingBytes());
+}
+
+TEST(cobs_encode_manual) {
+  uint8_t out[300];
+  CHECK_BYTES("\x01", 1, out, COBSEncoder::encode(NULL, 0, out, sizeof(out)));
+  CHECK_BYTES("\x01\x01", 2, out,
+      COBSEncoder::encode((const uint8_t*)"\x00", 1, out, sizeof(out)));
+  CHECK_BYTES("\x01\x02\xff\x02\xff", 5, out,
+      COBSEncoder::encode((const uint8_t*)"\x00\xff\x00\xff", 4, out, sizeof(out)));
+  CHECK_BYTES("\x02\xff\x02\xff\x01", 5, out,
+      COBSEncoder::encode((const uint8_t*)"\xff\x00\xff\x00", 4, out, sizeof(out)));
+
+  uint8_t ff[254];
+  memset(ff, 0xff, sizeof(ff));
+  uint8_t expected[256];
+  expected[0] = 0xff;
+  memset(expected + 1, 0xff, 253);
+  expected[254] = 0x02;
+  expected[255] = 0xff;
+  CHECK_BYTES(expected, 256, out, COBSEncoder::encode(ff, 254, out, sizeof(out)));
+}
+
+TEST(cobs_encode_overflow) {
+  uint8_t data[16];
+  memset(data, 0x42, sizeof(data));
+  uint8_t out[16];
+  CHECK_EQUAL(0u, COBSEncoder::encode(data, sizeof(data), out, sizeof(out)));
+  CHECK_EQUAL(0u, ZPEEncoder::encode(data, sizeof(data), out, sizeof(out)));
+}
+
+TEST(cobs_roundtrip) {
+  check_cobs_roundtrip(NULL, 0);
+  check_cobs_roundtrip((const uint8_t*)"\x00", 1);
+  check_cobs_roundtrip((const uint8_t*)"\x00\x00", 2);
+  check_cobs_roundtrip((const uint8_t*)"\x00\x01\x00\x02", 4);
+  check_cobs_roundtrip((const uint8_t*)"\xff\x00\xff\x00", 4);
+
+  uint8_t data[512];
+  for (size_t length=252; length<=254; length++) {
+    memset(data, 0xff, length);
+    check_cobs_roundtrip(data, length);
+  }
+  memset(data, 0x00, sizeof(data));
+  check_cobs_roundtrip(data, sizeof(data));
+}
+
+TEST(cobs_decode_invalid) {
+  COBSDecoder decoder;
+  TestPacket packet;
+  // Frame ends before the next special byte
+  CHECK_EQUAL(COBSDecoder::kErrorInvalidFormat,
+      decode_frame(decoder, packet, (const uint8_t*)"\x03\x01", 2));
+}
+
+TEST(zpe_encode_manual) {
+  uint8_t out[300];
+  CHECK_BYTES("\x01", 1, out, ZPEEncoder::encode(NULL, 0, out, sizeof(out)));
+  CHECK_BYTES("\xa0", 1, out,
+      ZPEEncoder::encode((const uint8_t*)"\x00", 1, out, sizeof(out)));
+  CHECK_BYTES("\xa0\x01", 2, out,
+      ZPEEncoder::encode((const uint8_t*)"\x00\x00", 2, out, sizeof(out)));
+  CHECK_BYTES("\xc0\x03\x01", 3, out,
+      ZPEEncoder::encode((const uint8_t*)"\xff\xff\xff", 3, out, sizeof(out)));
+  CHECK_BYTES("\xc2" "ab\x0a\x02" "c", 6, out,
+      ZPEEncoder::encode((const uint8_t*)"ab\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff" "c",
+          13, out, sizeof(out)));
+
+  uint8_t ff[256];
+  memset(ff, 0xff, sizeof(ff));
+  CHECK_BYTES("\xc0\xff\x02\xff", 4, out, ZPEEncoder::encode(ff, 256, out, sizeof(out)));
+}
+
+TEST(zpe_cobs_compatible) {
+  // Without zero pairs, 0xff runs or long runs, encoding matches DuckyCOBS
+  const char* vectors[] = {"\x01", "\x00\xff\x00\xff", "\xff\x00\xff\x00\x01",
+      "\x00\x01\x00\x02"};
+  const size_t lengths[] = {1, 4, 5, 4};
+  for (size_t i=0; i<sizeof(lengths)/sizeof(lengths[0]); i++) {
+    uint8_t cobs_out[16], zpe_out[16];
+    size_t cobs_length = COBSEncoder::encode((const uint8_t*)vectors[i], lengths[i],
+        cobs_out, sizeof(cobs_out));
+    size_t zpe_length = ZPEEncoder::encode((const uint8_t*)vectors[i], lengths[i],
+        zpe_out, sizeof(zpe_out));
+    CHECK_BYTES(cobs_out, cobs_length, zpe_out, zpe_length);
+  }
+}
+
+TEST(zpe_roundtrip) {
+  check_zpe_roundtrip(NULL, 0);
+  check_zpe_roundtrip((const uint8_t*)"\x00", 1);
+  check_zpe_roundtrip((const uint8_t*)"\x00\x00\x00", 3);
+  check_zpe_roundtrip((const uint8_t*)"\x01\xff\xff\xff\x00\x00\x02", 7);
+
+  uint8_t data[512];
+  const uint8_t fills[] = {0x00, 0x01, 0xff};
+  for (size_t i=0; i<sizeof(fills); i++) {
+    memset(data, fills[i], sizeof(data));
+    check_zpe_roundtrip(data, sizeof(data));
+  }
+
+  srand(42);
+  for (size_t trial=0; trial<200; trial++) {
+    size_t length = rand() % sizeof(data);
+    for (size_t i=0; i<length; i++) {
+      // Mostly zeros and 0xff, to exercise the pair and run codes
+      int choice = rand() % 4;
+      data[i] = choice == 0 ? 0x00 : choice == 1 ? 0xff : (uint8_t)rand();
+    }
+    check_zpe_roundtrip(data, length);
+  }
+}
+
+TEST(zpe_decode_invalid) {
+  ZPEDecoder decoder;
+  TestPacket packet;
+  // No terminating zero
+  CHECK_EQUAL(COBSDecoder::kErrorInvalidFormat,
+      decode_frame(decoder, packet, (const uint8_t*)"\xe1\x01", 2));
+  // Truncated literals
+  CHECK_EQUAL(COBSDecoder::kErrorInvalidFormat,
+      decode_frame(decoder, packet, (const uint8_t*)"\x03\x01", 2));
+  // Missing run length
+  CHECK_EQUAL(COBSDecoder::kErrorInvalidFormat,
+      decode_frame(decoder, packet, (const uint8_t*)"\xc0", 1));
+}
@@ -0,0 +1,17 @@
+/*
+ * Tests for CRC32, which must match binascii.crc32 on the host.
+ */
+
+#include "mbed.h"
+
+#include "crc.h"
+#include "test.h"
+
+TEST(crc32) {
+  CHECK_EQUAL(0x00000000u, CRC32::compute_crc(NULL, 0));
+  CHECK_EQUAL(0xcbf43926u, CRC32::compute_crc((uint8_t*)"123456789", 9));
+  CHECK_EQUAL(0xd202ef8du, CRC32::compute_crc((uint8_t*)"\x00", 1));
+
+  uint8_t ff[4] = {0xff, 0xff, 0xff, 0xff};
+  CHECK_EQUAL(0xffffffffu, CRC32::compute_crc(ff, sizeof(ff)));
+}
@@ -0,0 +1,219 @@
+/*
+ * Tests for the RAM-backed SimulatedISP and its timing model.
+ */
+
+#include "mbed.h"
+
+#include "isp.h"
+#include "test.h"
+
+static const size_t kFlashLength = 8192;
+
+/**
+ * Returns the config with zero operation times, so the blocking ISP calls
+ * complete with a VirtualClock.
+ */
+static SimulatedISP::Config untimed(SimulatedISP::Config config) {
+  config.erase_page_us = 0;
+  config.program_unit_us = 0;
+  return config;
+}
+
+TEST(simulated_isp_erase_write) {
+  uint8_t flash[kFlashLength];
+  VirtualClock clock;
+  SimulatedISP isp(flash, sizeof(flash), untimed(SimulatedISP::config_f303k8()), clock);
+  CHECK_EQUAL(0xff, flash[0]);
+
+  uint8_t data[4] = {0x12, 0x34, 0x56, 0x78};
+  CHECK_EQUAL(ISPBase::kISPOk, isp.write(flash + 2, data, sizeof(data)));
+  CHECK_BYTES(data, sizeof(data), flash + 2, sizeof(data));
+  CHECK_EQUAL(0xff, flash[6]);
+
+  // Writing units which aren't erased fails, as on the STM32s
+  CHECK_EQUAL(ISPBase::kISPFlashError, isp.write(flash + 2, data, 2));
+  // except for writing zeros
+  uint8_t zeros[2] = {0, 0};
+  CHECK_EQUAL(ISPBase::kISPOk, isp.write(flash + 2, zeros, 2));
+  CHECK_EQUAL(0x00, flash[2]);
+
+  CHECK_EQUAL(ISPBase::kISPOk, isp.erase(flash, 2048));
+  CHECK_EQUAL(0xff, flash[2]);
+  CHECK_EQUAL(ISPBase::kISPOk, isp.write(flash + 2, data, sizeof(data)));
+}
+
+TEST(simulated_isp_and_writes) {
+  uint8_t flash[kFlashLength];
+  VirtualClock clock;
+  SimulatedISP::Config config = untimed(SimulatedISP::config_l432kc());
+  config.overwrite_is_error = false;
+  SimulatedISP isp(flash, sizeof(flash), config, clock);
+
+  uint8_t data[8] = {0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0};
+  CHECK_EQUAL(ISPBase::kISPOk, isp.write(flash, data, sizeof(data)));
+  memset(data, 0x3c, sizeof(data));
+  // Writes can only clear bits
+  CHECK_EQUAL(ISPBase::kISPOk, isp.write(flash, data, sizeof(data)));
+  CHECK_EQUAL(0x30, flash[0]);
+  CHECK_EQUAL(0x30, flash[7]);
+}
+
+TEST(simulated_isp_invalid_args) {
+  uint8_t flash[kFlashLength];
+  VirtualClock clock;
+  SimulatedISP isp(flash, sizeof(flash), untimed(SimulatedISP::config_l432kc()), clock);
+
+  uint8_t data[8] = {0};
+  CHECK_EQUAL(ISPBase::kISPInvalidArgs, isp.write(flash + 4, data, 8));
+  CHECK_EQUAL(ISPBase::kISPInvalidArgs, isp.write(flash, data, 4));
+  CHECK_EQUAL(ISPBase::kISPInvalidArgs, isp.write(flash + kFlashLength, data, 8));
+  CHECK_EQUAL(ISPBase::kISPInvalidArgs, isp.erase(flash + 1024, 2048));
+  CHECK_EQUAL(ISPBase::kISPInvalidArgs, isp.erase(flash, kFlashLength + 2048));
+  CHECK_EQUAL(0xff, flash[0]);
+}
+
+TEST(simulated_isp_timing) {
+  uint8_t flash[kFlashLength];
+  VirtualClock clock;
+  SimulatedISP isp(flash, sizeof(flash), SimulatedISP::config_f303k8(), clock);
+
+  // Two page erase
+  CHECK(isp.async_erase(flash, 4096));
+  CHECK_EQUAL(40000u, isp.get_busy_until_us());
+  CHECK(isp.async_update());
+  CHECK(!isp.async_erase(flash, 2048));  // busy
+  clock.advance_us(39999);
+  CHECK(isp.async_update());
+  clock.advance_us(1);
+  CHECK(!isp.async_update());
+  ISPBase::ISPStatus status;
+  CHECK(isp.get_last_async_status(&status));
+  CHECK_EQUAL(ISPBase::kISPOk, status);
+
+  // 8 halfword writes
+  uint8_t data[16] = {0};
+  CHECK(isp.async_write(flash, data, sizeof(data)));
+  CHECK_EQUAL(40000u + 8 * 50, isp.get_busy_until_us());
+  CHECK_EQUAL(0xff, flash[0]);  // not written until complete
+  clock.advance_to_us(isp.get_busy_until_us());
+  CHECK(!isp.async_update());
+  CHECK_EQUAL(0x00, flash[0]);
+
+  CHECK_EQUAL(2u, isp.get_erase_count());
+  CHECK_EQUAL(8u, isp.get_write_count());
+  CHECK_EQUAL(40000u + 8 * 50, isp.get_busy_us());
+}
+
+TEST(simulated_isp_skip_erased_data) {
+  uint8_t flash[kFlashLength];
+  VirtualClock clock;
+  SimulatedISP isp(flash, sizeof(flash), SimulatedISP::config_l432kc(), clock);
+
+  // The all 0xff doubleword isn't programmed, so takes no time
+  uint8_t data[24];
+  memset(data, 0xff, sizeof(data));
+  data[0] = 0x12;
+  data[23] = 0x34;
+  CHECK(isp.async_write(flash, data, sizeof(data)));
+  CHECK_EQUAL(2u * 82, isp.get_busy_until_us());
+  clock.advance_to_us(isp.get_busy_until_us());
+  CHECK(!isp.async_update());
+  CHECK_BYTES(data, sizeof(data), flash, sizeof(data));
+  CHECK_EQUAL(2u, isp.get_write_count());
+
+  // nor fails over programmed units
+  memset(data, 0xff, sizeof(data));
+  CHECK(isp.async_write(flash, data, sizeof(data)));
+  CHECK(!isp.async_update());
+  ISPBase::ISPStatus status;
+  CHECK(isp.get_last_async_status(&status));
+  CHECK_EQUAL(ISPBase::kISPOk, status);
+  CHECK_EQUAL(0x12, flash[0]);
+}
+
+TEST(simulated_isp_fast_rows) {
+  uint8_t flash[kFlashLength];
+  VirtualClock clock;
+  SimulatedISP isp(flash, sizeof(flash), SimulatedISP::config_l432kc(), clock);
+
+  // One row, then the rest of a second row as doublewords, since it's unaligned
+  uint8_t data[512 - 8];
+  memset(data, 0x5a, sizeof(data));
+  CHECK(isp.async_write(flash, data, sizeof(data)));
+  CHECK_EQUAL(1910u + 31 * 82, isp.get_busy_until_us());
+  clock.advance_to_us(isp.get_busy_until_us());
+  CHECK(!isp.async_update());
+  CHECK_BYTES(data, sizeof(data), flash, sizeof(data));
+  CHECK_EQUAL(1u, isp.get_row_count());
+  CHECK_EQUAL(31u, isp.get_write_count());
+
+  // A row with few doublewords to program is faster without fast programming
+  memset(data, 0xff, sizeof(data));
+  memset(data, 0x00, 8 * 23);
+  CHECK(isp.async_write(flash + 2048, data, 256));
+  CHECK_EQUAL(23u * 82, isp.get_busy_until_us() - clock.now_us());
+  clock.advance_to_us(isp.get_busy_until_us());
+  CHECK(!isp.async_update());
+  CHECK_EQUAL(1u, isp.get_row_count());
+}
+
+TEST(simulated_isp_interrupt_driven) {
+  uint8_t flash[kFlashLength];
+  VirtualClock clock;
+  SimulatedISP isp(flash, sizeof(flash), SimulatedISP::config_f303k8(), clock);
+  isp.set_interrupt_driven(true);
+  ISPBase::ISPStatus status;
+
+  // The interrupt completes the operation once the flash is done
+  CHECK(isp.async_erase(flash, 2048));
+  isp.irq_handler();
+  CHECK(!isp.get_last_async_status(&status));
+  clock.advance_to_us(isp.get_busy_until_us());
+  isp.irq_handler();
+  CHECK(isp.get_last_async_status(&status));
+  CHECK_EQUAL(ISPBase::kISPOk, status);
+
+  // Waiting sleeps until the operation completes
+  uint8_t data[4] = {0x12, 0x34, 0x56, 0x78};
+  CHECK(isp.async_write(flash, data, sizeof(data)));
+  isp.wait_for_update();
+  CHECK_EQUAL(20000u + 2 * 50, clock.now_us());
+  CHECK(isp.get_last_async_status(&status));
+  CHECK_BYTES(data, sizeof(data), flash, sizeof(data));
+
+  // Polling still completes operations without the interrupt, like failures
+  CHECK(isp.async_write(flash, data, sizeof(data)));
+  CHECK(isp.async_update());
+  clock.advance_to_us(isp.get_busy_until_us());
+  CHECK(!isp.async_update());
+  CHECK(isp.get_last_async_status(&status));
+  CHECK_EQUAL(ISPBase::kISPFlashError, status);
+
+  // Erases wake after each page
+  uint64_t start_us = clock.now_us();
+  CHECK(isp.async_erase(flash, 4096));
+  isp.wait_for_update();
+  CHECK_EQUAL(start_us + 20000, clock.now_us());
+  CHECK(!isp.get_last_async_status(&status));
+  isp.wait_for_update();
+  CHECK_EQUAL(start_us + 40000, clock.now_us());
+  CHECK(isp.get_last_async_status(&status));
+}
+
+TEST(flash_word_load) {
+  uint32_t words[3] = {0, 0, 0};
+  uint8_t* bytes = (uint8_t*)words;
+  for (size_t i=0; i<sizeof(words); i++) {
+    bytes[i] = i + 1;
+  }
+  CHECK_EQUAL(0x0201, FlashWord::load16(bytes));
+  CHECK_EQUAL(0x0302, FlashWord::load16(bytes + 1));
+  CHECK_EQUAL(0x04030201u, FlashWord::load32(bytes));
+  CHECK_EQUAL(0x06050403u, FlashWord::load32(bytes + 2));
+  CHECK_EQUAL(0x08070605u, FlashWord::load32(bytes + 4));
+
+  memset(bytes, 0xff, sizeof(words));
+  CHECK(FlashWord::is_erased(bytes, sizeof(words)));
+  bytes[11] = 0xfe;
+  CHECK(!FlashWord::is_erased(bytes, sizeof(words)));
+}
@@ -0,0 +1,70 @@
+/*
+ * Tests for the DuckyLZ decoder, using the same vectors as
+ * host/duckylz_test.py.
+ */
+
+#include "mbed.h"
+
+#include "lz.h"
+#include "test.h"
+
+TEST(lz_decode_manual) {
+  uint8_t out[1024];
+  LZDecoder decoder;
+
+  decoder.set_buffer(out, sizeof(out));
+  CHECK_EQUAL(LZDecoder::kResultWorking, decoder.decode((const uint8_t*)"\x07\x01\x02\x03", 4));
+  CHECK(decoder.is_complete());
+  CHECK_BYTES("\x01\x02\x03", 3, out, decoder.get_length());
+
+  // Literal followed by an overlapping run of 4
+  decoder.set_buffer(out, sizeof(out));
+  CHECK_EQUAL(LZDecoder::kResultWorking, decoder.decode((const uint8_t*)"\x01\xff\x00\x01", 4));
+  CHECK(decoder.is_complete());
+  CHECK_BYTES("\xff\xff\xff\xff\xff", 5, out, decoder.get_length());
+
+  // Maximum length match, then a minimum length match
+  uint8_t expected[1+66+3];
+  memset(expected, 0xff, sizeof(expected));
+  decoder.set_buffer(out, sizeof(out));
+  CHECK_EQUAL(LZDecoder::kResultWorking,
+      decoder.decode((const uint8_t*)"\x01\xff\x00\x3f\x00\x00", 6));
+  CHECK_BYTES(expected, sizeof(expected), out, decoder.get_length());
+}
+
+TEST(lz_decode_chunked) {
+  // Stream split across decode calls, including mid back-reference
+  uint8_t out[1024];
+  LZDecoder decoder;
+  decoder.set_buffer(out, sizeof(out));
+  const uint8_t stream[] = {0x01, 0xff, 0x00, 0x01};
+  for (size_t i=0; i<sizeof(stream); i++) {
+    CHECK_EQUAL(LZDecoder::kResultWorking, decoder.decode(stream + i, 1));
+    CHECK_EQUAL(i != 2, decoder.is_complete());
+  }
+  CHECK_EQUAL(5u, decoder.get_length());
+}
+
+TEST(lz_decode_invalid) {
+  uint8_t out[1024];
+  LZDecoder decoder;
+
+  CHECK_EQUAL(LZDecoder::kErrorNoBuffer, decoder.decode((const uint8_t*)"\x01\x42", 2));
+
+  // Offset before start of output
+  decoder.set_buffer(out, sizeof(out));
+  CHECK_EQUAL(LZDecoder::kErrorInvalidFormat, decoder.decode((const uint8_t*)"\x00\x00\x00", 3));
+  // Errors are sticky until reset
+  CHECK_EQUAL(LZDecoder::kErrorInvalidFormat, decoder.decode((const uint8_t*)"\x01\x42", 2));
+
+  // Truncated back-reference
+  decoder.set_buffer(out, sizeof(out));
+  CHECK_EQUAL(LZDecoder::kResultWorking, decoder.decode((const uint8_t*)"\x01\x42\x00", 3));
+  CHECK(!decoder.is_complete());
+
+  // Output overflow
+  decoder.set_buffer(out, 4);
+  CHECK_EQUAL(LZDecoder::kErrorOverflow, decoder.decode((const uint8_t*)"\x01\xff\x00\x01", 4));
+  decoder.set_buffer(out, 1);
+  CHECK_EQUAL(LZDecoder::kErrorOverflow, decoder.decode((const uint8_t*)"\x03\x01\x02", 3));
+}
@@ -0,0 +1,36 @@
+/*
+ * Unit test runner for the host-native build.
+ */
+
+#include <stdio.h>
+
+#include "test.h"
+
+TestCase* TestCase::first = NULL;
+TestCase* TestCase::last = NULL;
+int TestCase::failures = 0;
+
+void TestCase::fail(const char* file, int line, const char* message) {
+  printf("%s:%d: check failed: %s\n", file, line, message);
+  failures++;
+}
+
+int TestCase::run_all() {
+  int num_tests = 0;
+  int failed_tests = 0;
+  for (TestCase* test = first; test != NULL; test = test->next) {
+    int prev_failures = failures;
+    test->func();
+    num_tests++;
+    if (failures != prev_failures) {
+      printf("FAIL %s\n", test->name);
+      failed_tests++;
+    }
+  }
+  printf("%i of %i tests passed\n", num_tests - failed_tests, num_tests);
+  return failures;
+}
+
+int main() {
+  return TestCase::run_all() == 0 ? 0 : 1;
+}
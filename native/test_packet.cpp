@@ -0,0 +1,57 @@
+/*
+ * Tests for the packet builders and readers, using the same vectors as
+ * host/duckypacket_test.py.
+ */
+
+#include "mbed.h"
+
+#include "packet.h"
+#include "test.h"
+
+TEST(packet_build) {
+  BufferedPacketBuilder<16> packet;
+  CHECK(packet.put<uint8_t>(0x42));
+  CHECK(packet.put<uint8_t>(0xff));
+  CHECK(packet.put<uint32_t>(0xdeadbeef));
+  CHECK(packet.put<uint16_t>(0x4200));
+  CHECK_BYTES("\x42\xff\xde\xad\xbe\xef\x42\x00", 8, packet.getBuffer(), packet.getLength());
+}
+
+TEST(packet_build_overflow) {
+  BufferedPacketBuilder<5> packet;
+  CHECK(packet.put<uint32_t>(0xdeadbeef));
+  CHECK(!packet.put<uint16_t>(0x4200));
+  CHECK(packet.put<uint8_t>(0x42));
+  CHECK(!packet.put<uint8_t>(0x42));
+  CHECK_EQUAL(5u, packet.getLength());
+}
+
+TEST(packet_read) {
+  uint8_t data[] = {0x42, 0xff, 0xde, 0xad, 0xbe, 0xef, 0x42, 0x00, 0xab, 0xcd};
+  MemoryPacketReader packet(data, sizeof(data));
+  CHECK_EQUAL(0x42, packet.read<uint8_t>());
+  CHECK_EQUAL(0xff, packet.read<uint8_t>());
+  CHECK_EQUAL(0xdeadbeef, packet.read<uint32_t>());
+  CHECK_EQUAL(0x4200, packet.read<uint16_t>());
+  CHECK_EQUAL(2u, packet.getRemainingBytes());
+  CHECK(packet.read_buf(3) == NULL);
+  CHECK(packet.read_buf(2) == data + 8);
+  CHECK_EQUAL(0u, packet.getRemainingBytes());
+}
+
+TEST(packet_buffered_reader) {
+  BufferedPacketReader<8> packet;
+  for (uint8_t i=0; i<8; i++) {
+    CHECK(packet.putByte(i));
+  }
+  CHECK(!packet.putByte(8));
+  CHECK_EQUAL(0x00010203u, packet.read<uint32_t>());
+  CHECK_EQUAL(4u, packet.getRemainingBytes());
+
+  packet.reset();
+  CHECK_EQUAL(0u, packet.getRemainingBytes());
+  uint8_t* ptr = packet.ptrPutBytes(4);
+  CHECK(ptr != NULL);
+  memcpy(ptr, "\x12\x34\x56\x78", 4);
+  CHECK_EQUAL(0x12345678u, packet.read<uint32_t>());
+}